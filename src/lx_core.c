@@ -25,11 +25,18 @@
 #include <linux/delay.h>
 #include <linux/printk.h>
 #include <linux/version.h>
+#include <linux/ktime.h>
+#include <linux/interrupt.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
 #include <asm/io.h>
 
 #include "lxcommon.h"
 #include "lx_core.h"
 
+#include "lx_trace.h"
+
 #if KERNEL_VERSION(4, 16, 0) > LINUX_VERSION_CODE
 /* Workaround to build the module */
 #undef dev_dbg
@@ -38,10 +45,55 @@
 #define dev_err(dev,  ...) printk(__VA_ARGS__)
 #endif
 
-static int indexcpu[SNDRV_CARDS] = {7, 6, 5}; /* Index 0-MAX */
+static int indexcpu[SNDRV_CARDS] = {7, 6, 5,
+		[3 ... SNDRV_CARDS - 1] = -1}; /* Index 0-MAX */
 
 module_param_array(indexcpu, int, NULL, 0444);
-MODULE_PARM_DESC(indexcpu, "CPU affinity for irq.");
+MODULE_PARM_DESC(indexcpu, "CPU affinity for irq, -1 leaves it to irqbalance.");
+
+static unsigned int cmd_spin_us = 20;
+
+module_param(cmd_spin_us, uint, 0644);
+MODULE_PARM_DESC(cmd_spin_us,
+	"Busy-wait (us) on a DSP command before sleeping on its completion.");
+
+static unsigned int irq_moderation_hz;
+
+module_param(irq_moderation_hz, uint, 0644);
+MODULE_PARM_DESC(irq_moderation_hz,
+	"Run streams with a higher period rate on a timer irq of this rate, 0 disables.");
+
+static bool irq_resync;
+
+module_param(irq_resync, bool, 0644);
+MODULE_PARM_DESC(irq_resync,
+	"Catch up missed period irqs from the card counter instead of an xrun.");
+
+/* interrupt statistics cost a patched out branch when disabled */
+static DEFINE_STATIC_KEY_TRUE(lx_irq_stats_enabled);
+static bool irq_stats = true;
+
+static int lx_irq_stats_param_set(const char *val,
+		const struct kernel_param *kp)
+{
+	int err = param_set_bool(val, kp);
+
+	if (err < 0)
+		return err;
+	if (irq_stats)
+		static_branch_enable(&lx_irq_stats_enabled);
+	else
+		static_branch_disable(&lx_irq_stats_enabled);
+	return 0;
+}
+
+static const struct kernel_param_ops lx_irq_stats_param_ops = {
+	.set = lx_irq_stats_param_set,
+	.get = param_get_bool,
+};
+
+module_param_cb(irq_stats, &lx_irq_stats_param_ops, &irq_stats, 0644);
+MODULE_PARM_DESC(irq_stats, "Count interrupt and mmio statistics per cpu.");
 
 struct lx_chip *lx_chips_slave;
 struct lx_chip *lx_chips_master;
@@ -88,11 +140,58 @@ static void __iomem *lx_dsp_register(struct lx_chip *chip, int port)
 	return base_address + dsp_port_offsets[port] * 4;
 }
 
+/* configuration registers kept in a write-through shadow, so that
+ * read-modify-write sequences do not need a PCIe read each time.
+ * The clock register also carries status bits, its shadow is dropped
+ * whenever the card reports a frequency change.
+ */
+#define LX_DSP_SHADOW_PORTS	(1U << REG_MADI_RAVENNA_CLOCK_CFG)
+
+void lx_mmio_init(struct lx_chip *chip)
+{
+	spin_lock_init(&chip->dsp_shadow_lock);
+	chip->dsp_shadow_valid = 0;
+}
+
+/* the hard irq counts its PLX_IRQCS and doorbell accesses too, keep them
+ * off shared cache lines
+ */
+static inline void lx_mmio_stat_add(struct lx_chip *chip, unsigned int stat,
+		unsigned int count)
+{
+	struct lx_irq_stats *stats;
+
+	if (!static_branch_likely(&lx_irq_stats_enabled))
+		return;
+	stats = get_cpu_ptr(chip->irq_stats);
+	local64_add(count, &stats->mmio[stat]);
+	put_cpu_ptr(chip->irq_stats);
+}
+
+static inline void lx_dsp_shadow_set(struct lx_chip *chip, int port, u32 data)
+{
+	if (LX_DSP_SHADOW_PORTS & (1U << port)) {
+		chip->dsp_shadow[port] = data;
+		chip->dsp_shadow_valid |= 1U << port;
+	}
+}
+
 unsigned int lx_dsp_reg_read(struct lx_chip *chip, int port)
 {
 	void __iomem *address = lx_dsp_register(chip, port);
+	unsigned long flags;
+	u32 data;
 
-	return ioread32(address);
+	lx_mmio_stat_add(chip, LX_MMIO_DSP_READS(port), 1);
+	if (!(LX_DSP_SHADOW_PORTS & (1U << port)))
+		return ioread32(address);
+
+	spin_lock_irqsave(&chip->dsp_shadow_lock, flags);
+	data = ioread32(address);
+	lx_dsp_shadow_set(chip, port, data);
+	spin_unlock_irqrestore(&chip->dsp_shadow_lock, flags);
+
+	return data;
 }
 
 static void lx_dsp_reg_readbuf(struct lx_chip *chip, int port,
@@ -102,6 +201,7 @@ static void lx_dsp_reg_readbuf(struct lx_chip *chip, int port,
 	u32 __iomem *address = lx_dsp_register(chip, port);
 	int i;
 
+	lx_mmio_stat_add(chip, LX_MMIO_DSP_READS(port), len);
 	/* we cannot use memcpy_fromio */
 	for (i = 0; i != len; ++i)
 		data[i] = ioread32(address + i);
@@ -110,19 +210,72 @@ static void lx_dsp_reg_readbuf(struct lx_chip *chip, int port,
 void lx_dsp_reg_write(struct lx_chip *chip, int port, unsigned data)
 {
 	void __iomem *address = lx_dsp_register(chip, port);
+	unsigned long flags;
+
+	lx_mmio_stat_add(chip, LX_MMIO_DSP_WRITES(port), 1);
+	if (!(LX_DSP_SHADOW_PORTS & (1U << port))) {
+		iowrite32(data, address);
+		return;
+	}
+
+	spin_lock_irqsave(&chip->dsp_shadow_lock, flags);
+	iowrite32(data, address);
+	lx_dsp_shadow_set(chip, port, data);
+	spin_unlock_irqrestore(&chip->dsp_shadow_lock, flags);
+}
+
+/* replace the bits of mask in a shadowed register, reading the card only
+ * if the shadow is not valid
+ */
+void lx_dsp_reg_update(struct lx_chip *chip, int port, u32 mask, u32 value)
+{
+	void __iomem *address = lx_dsp_register(chip, port);
+	unsigned long flags;
+	u32 data;
 
+	spin_lock_irqsave(&chip->dsp_shadow_lock, flags);
+	if (chip->dsp_shadow_valid & (1U << port)) {
+		data = chip->dsp_shadow[port];
+		lx_mmio_stat_add(chip, LX_MMIO_SHADOW_HITS, 1);
+	} else {
+		data = ioread32(address);
+		lx_mmio_stat_add(chip, LX_MMIO_DSP_READS(port), 1);
+	}
+	data = (data & ~mask) | (value & mask);
 	iowrite32(data, address);
+	lx_mmio_stat_add(chip, LX_MMIO_DSP_WRITES(port), 1);
+	lx_dsp_shadow_set(chip, port, data);
+	spin_unlock_irqrestore(&chip->dsp_shadow_lock, flags);
+}
+
+void lx_dsp_reg_invalidate(struct lx_chip *chip, int port)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->dsp_shadow_lock, flags);
+	chip->dsp_shadow_valid &= ~(1U << port);
+	spin_unlock_irqrestore(&chip->dsp_shadow_lock, flags);
 }
 
 static void lx_dsp_reg_writebuf(struct lx_chip *chip, int port, const u32 *data,
 		u32 len)
 {
 	u32 __iomem *address = lx_dsp_register(chip, port);
+#ifndef __LITTLE_ENDIAN
 	int i;
+#endif
 
+	lx_mmio_stat_add(chip, LX_MMIO_DSP_WRITES(port), len);
+#ifdef __LITTLE_ENDIAN
+	/* the CRM registers are consecutive words: post them as a burst,
+	 * the REG_CSM write that follows orders them before the doorbell
+	 */
+	__iowrite32_copy(address, data, len);
+#else
 	/* we cannot use memcpy_to */
 	for (i = 0; i != len; ++i)
 		iowrite32(data[i], address + i);
+#endif
 }
 
 
@@ -153,6 +306,7 @@ unsigned int lx_plx_reg_read(struct lx_chip *chip, int port)
 {
 	void __iomem *address = lx_plx_register(chip, port);
 
+	lx_mmio_stat_add(chip, LX_MMIO_PLX_READS(port), 1);
 	return ioread32(address);
 }
 
@@ -160,6 +314,7 @@ void lx_plx_reg_write(struct lx_chip *chip, int port, u32 data)
 {
 	void __iomem *address = lx_plx_register(chip, port);
 
+	lx_mmio_stat_add(chip, LX_MMIO_PLX_WRITES(port), 1);
 	iowrite32(data, address);
 }
 
@@ -186,6 +341,8 @@ struct dsp_cmd_info {
 	u16 dc_status_type;
 	/* Status length (if fixed).*/
 	u16 dc_status_length;
+	/* Queue class, transport commands go first. */
+	u16 dc_prio;
 	char *dcOpName;
 };
 #define DC_STATUS_TYPE_RANDOM   0
@@ -210,6 +367,7 @@ static struct dsp_cmd_info dsp_commands[] = {
                 .dc_cmd_length = 1,
                 .dc_status_type = DC_STATUS_TYPE_FIXED,
                 .dc_status_length = 0,
+                .dc_prio = LX_CMD_PRIO_CONTROL,
                 CMD_NAME("INFO_DEBUG")
         },
 	{
@@ -217,6 +375,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 2,
+		.dc_prio = LX_CMD_PRIO_STATUS,
 		CMD_NAME("GET_SYS_CFG")
 	},
 	{
@@ -224,6 +383,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_CONTROL,
 		CMD_NAME("SET_GRANULARITY")
 	},
 	{
@@ -231,6 +391,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_CONTROL,
 		CMD_NAME("SET_TIMER_IRQ")
 	},
 	{
@@ -238,6 +399,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 0,/*up to 10*/
+		.dc_prio = LX_CMD_PRIO_STATUS,
 		CMD_NAME("GET_EVENT")
 	},
 	{
@@ -245,6 +407,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 2,/*up to 4*/
+		.dc_prio = LX_CMD_PRIO_STATUS,
 		CMD_NAME("GET_PIPES")
 	},
 	{
@@ -252,6 +415,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_RANDOM,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_TRANSPORT,
 		CMD_NAME("ALLOCATE_PIPE")
 	},
 	{
@@ -259,6 +423,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_RANDOM,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_TRANSPORT,
 		CMD_NAME("RELEASE_PIPE")
 	},
 	{
@@ -266,6 +431,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = MAX_STREAM_BUFFER,
+		.dc_prio = LX_CMD_PRIO_CONTROL,
 		CMD_NAME("ASK_BUFFERS")
 	},
 	{
@@ -273,6 +439,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_RANDOM,
 		.dc_status_length = 0 /*up to 2*/,
+		.dc_prio = LX_CMD_PRIO_TRANSPORT,
 		CMD_NAME("STOP_PIPE")
 	},
 	{
@@ -280,6 +447,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 1 /*up to 2*/,
+		.dc_prio = LX_CMD_PRIO_CONTROL,
 		CMD_NAME("GET_PIPE_SPL_COUNT")
 	},
 	{
@@ -287,6 +455,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1/*up to 5*/,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_TRANSPORT,
 		CMD_NAME("TOGGLE_PIPE_STATE")
 	},
 	{
@@ -294,6 +463,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1/*up to 4*/,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_TRANSPORT,
 		CMD_NAME("DEF_STREAM")
 	},
 	{
@@ -301,6 +471,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 3,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_CONTROL,
 		CMD_NAME("SET_MUTE")
 	},
 	{
@@ -308,6 +479,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 2,
+		.dc_prio = LX_CMD_PRIO_CONTROL,
 		CMD_NAME("GET_STREAM_SPL_COUNT")
 	},
 	{
@@ -315,6 +487,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 3 /*up to 4*/,
 		.dc_status_type = DC_STATUS_TYPE_RANDOM,
 		.dc_status_length = 1,
+		.dc_prio = LX_CMD_PRIO_TRANSPORT,
 		CMD_NAME("UPDATE_BUFFER")
 	},
 	{
@@ -322,6 +495,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 4,
+		.dc_prio = LX_CMD_PRIO_STATUS,
 		CMD_NAME("GET_BUFFER")
 	},
 	{
@@ -329,6 +503,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 1 /*up to 4*/,
+		.dc_prio = LX_CMD_PRIO_TRANSPORT,
 		CMD_NAME("CANCEL_BUFFER")
 	},
 	{
@@ -336,6 +511,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 1,
+		.dc_prio = LX_CMD_PRIO_STATUS,
 		CMD_NAME("GET_PEAK")
 	},
 	{
@@ -343,6 +519,7 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_TRANSPORT,
 		CMD_NAME("SET_STREAM_STATE")
 	},
 
@@ -350,7 +527,8 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_code_op = CMD_OP(CMD_14_GET_MADI_STATE),
 		.dc_cmd_length = 1,
 		.dc_status_type = DC_STATUS_TYPE_FIXED,
-		.dc_status_length = 1,
+		.dc_status_length = 2,	/* modes, then link errors and freq */
+		.dc_prio = LX_CMD_PRIO_STATUS,
 		CMD_NAME("GET_MADI_STATE")
 	},
 	{
@@ -358,11 +536,13 @@ static struct dsp_cmd_info dsp_commands[] = {
 		.dc_cmd_length = 2,
 		.dc_status_type = DC_STATUS_TYPE_RANDOM,
 		.dc_status_length = 0,
+		.dc_prio = LX_CMD_PRIO_CONTROL,
 		CMD_NAME("SET_MADI_STATE")
 	},
 };
 
-static int lx_message_init(struct lx_chip *chip, enum cmd_mb_opcodes cmd)
+int lx_message_init_rmh(struct lx_chip *chip, struct lx_rmh *rmh,
+		enum cmd_mb_opcodes cmd)
 {
 	int return_value;
 
@@ -372,26 +552,26 @@ static int lx_message_init(struct lx_chip *chip, enum cmd_mb_opcodes cmd)
 		return_value = -EINVAL;
 	} else {
 		return_value = 0;
-		chip->rmh.cmd[0]   = dsp_commands[cmd].dc_code_op;
-		chip->rmh.cmd_len  = dsp_commands[cmd].dc_cmd_length;
-		chip->rmh.stat_len = dsp_commands[cmd].dc_status_length;
-		chip->rmh.dsp_stat = dsp_commands[cmd].dc_status_type;
-		chip->rmh.cmd_idx  = cmd;
-		memset(&chip->rmh.cmd[1],
+		rmh->cmd[0]   = dsp_commands[cmd].dc_code_op;
+		rmh->cmd_len  = dsp_commands[cmd].dc_cmd_length;
+		rmh->stat_len = dsp_commands[cmd].dc_status_length;
+		rmh->dsp_stat = dsp_commands[cmd].dc_status_type;
+		rmh->cmd_idx  = cmd;
+		memset(&rmh->cmd[1],
 			0,
 			(REG_CRM_NUMBER - 1) * sizeof(u32));
-
-
-#ifdef RMH_DEBUG
-		chip->rmh.cmd_idx = cmd;
-#endif
 	}
 	return return_value;
 }
 
+static int lx_message_init(struct lx_chip *chip, enum cmd_mb_opcodes cmd)
+{
+	return lx_message_init_rmh(chip, &chip->rmh, cmd);
+}
+
 #ifdef RMH_DEBUG
 #define LXRMH "lx_chip rmh: "
-static void lx_message_dump(struct lx_rmh *rmh)
+static void lx_message_dump(struct lx_chip *chip, struct lx_rmh *rmh)
 {
 	u8 idx = rmh->cmd_idx;
 	int i;
@@ -405,7 +585,8 @@ static void lx_message_dump(struct lx_rmh *rmh)
 	    dev_dbg(chip->card->dev, "\tstat[%d]: %08x\n", i, rmh->stat[i]);
 }
 #else
-static inline void lx_message_dump(struct lx_rmh *rmh)
+static inline void lx_message_dump(struct lx_chip *chip,
+		struct lx_rmh *rmh)
 {
 }
 #endif
@@ -415,81 +596,51 @@ static inline void lx_message_dump(struct lx_rmh *rmh)
 #define XILINX_POLL_NO_SLEEP    100
 #define XILINX_POLL_ITERATIONS  150
 
+/* a synchronous sender may sit behind other queued requests */
+#define LX_CMDQ_WAIT_MS		(4 * XILINX_TIMEOUT_MS)
+
 enum atomic_response_type {
 	ATOMIC_RESPONSE_BY_EVENT = 0x00,
 	ATOMIC_RESPONSE_BY_POLLING = 0x01,
 };
 
-int lx_message_send_atomic_generic(struct lx_chip *chip, struct lx_rmh *rmh,
-		unsigned char response_type)
-{
-	u32 reg = ED_DSP_TIMED_OUT;
-	int loop;
-
-	if (lx_dsp_reg_read(chip, REG_CSM) & (REG_CSM_MC | REG_CSM_MR)) {
-		dev_err(chip->card->dev, "PIOSendMessage eReg_CSM %x\n", reg);
-		return -EBUSY;
-	}
-
-	lx_dsp_reg_writebuf(chip, REG_CRM1, rmh->cmd, rmh->cmd_len);
-
-	if (response_type == ATOMIC_RESPONSE_BY_EVENT)
-		atomic_set(&chip->message_pending, 1);
-
-	/* MicroBlaze gogogo */
-	lx_dsp_reg_write(chip, REG_CSM, REG_CSM_MC);
-
-	loop = XILINX_TIMEOUT_MS * 1000;
-	switch (response_type) {
-	case ATOMIC_RESPONSE_BY_EVENT:
-		while ((atomic_read(&chip->message_pending) == 1) &&
-			(loop-- > 0))
-			udelay(1);
-
-		if (atomic_read(&chip->message_pending)) {
-			dev_err(chip->card->dev,
-				"%s, message_pending timeout...\n",
-				__func__);
-			reg = -EIO;
-			goto exit;
-		}
+#if KERNEL_VERSION(6, 2, 0) > LINUX_VERSION_CODE
+#define timer_delete(t)		del_timer(t)
+#define timer_delete_sync(t)	del_timer_sync(t)
+#endif
 
+/* command queue
+ *
+ * Every mailbox command is queued on a per-card list, one list per
+ * priority class. The head of the highest non-empty class is written to
+ * the mailbox as soon as the previous command has answered. Answers are
+ * collected from the CMD_DONE interrupt, from the watchdog timer or by a
+ * submitter that polls. cmdq_lock is a spinlock so that requests can be
+ * queued from atomic context.
+ */
 
-		if (lx_dsp_reg_read(chip, REG_CSM) & REG_CSM_MR) {
-			if (rmh->dsp_stat == 0)
-				reg = lx_dsp_reg_read(chip, REG_CRM1);
-			else
-				reg = 0;
-			goto polling_successful;
-		}
+/* mailbox timeouts in a row before the DSP is considered dead */
+#define LX_CMDQ_RECOVERY_TIMEOUTS	3
 
-		dev_warn(chip->card->dev,
-			"TIMEOUT lx_message_send_atomic! reply failed\n");
-		lx_message_dump(rmh);
+/* count a command that did not answer in time, cmdq_lock held */
+static void lx_cmdq_timed_out(struct lx_chip *chip)
+{
+	if (++chip->cmdq_timeouts >= LX_CMDQ_RECOVERY_TIMEOUTS) {
+		chip->cmdq_timeouts = 0;
+		lx_recovery_schedule(chip);
+	}
+}
 
-		break;
-	case  ATOMIC_RESPONSE_BY_POLLING:
-		while (loop-- > 0) {
-			if (lx_dsp_reg_read(chip, REG_CSM) & REG_CSM_MR) {
-				if (rmh->dsp_stat == 0)
-					reg = lx_dsp_reg_read(chip, REG_CRM1);
-				else
-					reg = 0;
-
-				goto polling_successful;
-			}
-			udelay(1);
-		}
-		dev_warn(chip->card->dev,
-		"TIMEOUT lx_message_send_atomic_poll! polling failed\n");
+/* read the answer of the active request, cmdq_lock held */
+static int lx_cmdq_read_reply(struct lx_chip *chip, struct lx_rmh *rmh)
+{
+	u32 reg;
 
-		lx_message_dump(rmh);
-		reg = -EIO;
-		goto exit;
+	if (rmh->dsp_stat == 0)
+		reg = lx_dsp_reg_read(chip, REG_CRM1);
+	else
+		reg = 0;
 
-		break;
-	}
-polling_successful:
 	if ((reg & ERROR_VALUE) == 0) {
 		/* read response */
 		if (rmh->stat_len) {
@@ -499,8 +650,7 @@ polling_successful:
 				 */
 				dev_err(chip->card->dev,
 					"rmh response length error\n");
-				reg = -EIO;
-				goto exit;
+				return -EIO;
 			}
 			lx_dsp_reg_readbuf(chip, REG_CRM2, rmh->stat,
 					rmh->stat_len);
@@ -510,22 +660,507 @@ polling_successful:
 	}
 	/* clear Reg_CSM_MR */
 	lx_dsp_reg_write(chip, REG_CSM, 0);
+	chip->cmdq_csm_clear = true;
 
 	switch (reg) {
 	case ED_DSP_TIMED_OUT:
 		dev_warn(chip->card->dev, "lx_message_send: dsp timeout\n");
+		lx_cmdq_timed_out(chip);
 		return -ETIMEDOUT;
 
 	case ED_DSP_CRASHED:
 		dev_warn(chip->card->dev, "lx_message_send: dsp crashed\n");
+		lx_recovery_schedule(chip);
 		return -EAGAIN;
 	}
 
-exit:
-/*        lx_message_dump(rmh); */
+	chip->cmdq_timeouts = 0;
 	return reg;
 }
 
+/* take a request off the queue or the mailbox, cmdq_lock held.
+ * Synchronous requests are completed here, the ones with a callback are
+ * moved to @done and finished once the lock is dropped.
+ */
+static void lx_cmdq_retire(struct lx_chip *chip, struct lx_cmd_req *req,
+		int status, struct list_head *done)
+{
+	if (chip->cmdq_active == req) {
+		chip->cmdq_active = NULL;
+		timer_delete(&chip->cmdq_timer);
+	} else {
+		list_del_init(&req->list);
+	}
+
+	req->status = status;
+	req->state = LX_CMD_DONE;
+	if (req->callback)
+		list_add_tail(&req->list, done);
+	else
+		complete(&req->done);
+}
+
+/* start the next queued request if the mailbox is free, cmdq_lock held */
+static void lx_cmdq_kick(struct lx_chip *chip, struct list_head *done)
+{
+	struct lx_cmd_req *req;
+	u32 csm;
+	int prio;
+
+	while (chip->cmdq_active == NULL) {
+		req = NULL;
+		for (prio = 0; prio < LX_CMD_PRIO_COUNT; prio++) {
+			if (!list_empty(&chip->cmdq[prio])) {
+				req = list_first_entry(&chip->cmdq[prio],
+						struct lx_cmd_req, list);
+				break;
+			}
+		}
+		if (req == NULL)
+			return;
+
+		/* we cleared the mailbox ourselves after the last answer,
+		 * only check it after a timeout or at startup
+		 */
+		if (chip->cmdq_csm_clear) {
+			lx_mmio_stat_add(chip, LX_MMIO_CSM_READS_SAVED, 1);
+		} else {
+			csm = lx_dsp_reg_read(chip, REG_CSM);
+			if (chip->cmdq_inject_busy)
+				csm |= REG_CSM_MC;
+			if (csm & (REG_CSM_MC | REG_CSM_MR)) {
+				/* a mute DSP never takes the command that
+				 * timed out, count its busy mailbox as a
+				 * timeout too or it is never recovered
+				 */
+				dev_err(chip->card->dev,
+					"PIOSendMessage eReg_CSM %x\n", csm);
+				lx_cmdq_retire(chip, req, -EBUSY, done);
+				lx_cmdq_timed_out(chip);
+				continue;
+			}
+		}
+
+		list_del_init(&req->list);
+		req->state = LX_CMD_ACTIVE;
+		req->deadline = jiffies + msecs_to_jiffies(XILINX_TIMEOUT_MS);
+		chip->cmdq_active = req;
+
+		/* testing: leave the command off the mailbox, the watchdog
+		 * will time it out and the mailbox then reads busy, like
+		 * a mute DSP that left REG_CSM_MC set, until the recovery
+		 */
+		if (atomic_add_unless(&chip->cmdq_inject_timeouts, -1, 0)) {
+			chip->cmdq_csm_clear = false;
+			chip->cmdq_inject_busy = true;
+			mod_timer(&chip->cmdq_timer, req->deadline + 1);
+			continue;
+		}
+
+		lx_dsp_reg_writebuf(chip, REG_CRM1, req->rmh->cmd,
+				req->rmh->cmd_len);
+
+		/* MicroBlaze gogogo */
+		lx_dsp_reg_write(chip, REG_CSM, REG_CSM_MC);
+		chip->cmdq_csm_clear = false;
+		mod_timer(&chip->cmdq_timer, req->deadline + 1);
+	}
+}
+
+/* run the callbacks of retired requests, cmdq_lock not held */
+static void lx_cmdq_finish(struct lx_chip *chip, struct list_head *done)
+{
+	struct lx_cmd_req *req, *n;
+
+	list_for_each_entry_safe(req, n, done, list) {
+		list_del_init(&req->list);
+		req->callback(chip, req);
+	}
+}
+
+/* collect the answer of the active request if the MicroBlaze replied */
+static void lx_cmdq_process(struct lx_chip *chip)
+{
+	struct lx_cmd_req *req;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	req = chip->cmdq_active;
+	if (req && (lx_dsp_reg_read(chip, REG_CSM) & REG_CSM_MR))
+		lx_cmdq_retire(chip, req, lx_cmdq_read_reply(chip, req->rmh),
+				&done);
+	lx_cmdq_kick(chip, &done);
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+
+	lx_cmdq_finish(chip, &done);
+}
+
+/* watchdog: the active request did not raise CMD_DONE in time. Also run by
+ * the polling loops, the timer may not fire on a cpu with irqs off, so that
+ * each request gets XILINX_TIMEOUT_MS from the time it reached the mailbox.
+ */
+static void lx_cmdq_watchdog(struct lx_chip *chip)
+{
+	struct lx_cmd_req *req;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	req = chip->cmdq_active;
+	if (req) {
+		if (lx_dsp_reg_read(chip, REG_CSM) & REG_CSM_MR) {
+			lx_cmdq_retire(chip, req,
+				lx_cmdq_read_reply(chip, req->rmh), &done);
+		} else if (time_after_eq(jiffies, req->deadline)) {
+			dev_warn(chip->card->dev,
+				"TIMEOUT lx_message_send_atomic! reply failed\n");
+			lx_message_dump(chip, req->rmh);
+			lx_cmdq_retire(chip, req, -EIO, &done);
+			lx_cmdq_timed_out(chip);
+		} else {
+			/* a newer request took the mailbox meanwhile */
+			mod_timer(&chip->cmdq_timer, req->deadline + 1);
+		}
+	}
+	lx_cmdq_kick(chip, &done);
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+
+	lx_cmdq_finish(chip, &done);
+}
+
+#if KERNEL_VERSION(4, 15, 0) <= LINUX_VERSION_CODE
+static void lx_cmdq_timeout(struct timer_list *t)
+{
+	struct lx_chip *chip = from_timer(chip, t, cmdq_timer);
+
+	lx_cmdq_watchdog(chip);
+}
+#else
+static void lx_cmdq_timeout(unsigned long data)
+{
+	lx_cmdq_watchdog((struct lx_chip *)data);
+}
+#endif
+
+/* give up on a request; returns its status if it answered meanwhile */
+static int lx_cmdq_cancel(struct lx_chip *chip, struct lx_cmd_req *req,
+		int err)
+{
+	unsigned long flags;
+	LIST_HEAD(done);
+	int ret;
+
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	if (req->state != LX_CMD_DONE) {
+		lx_cmdq_retire(chip, req, err, &done);
+		lx_cmdq_kick(chip, &done);
+	}
+	ret = req->status;
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+
+	lx_cmdq_finish(chip, &done);
+	return ret;
+}
+
+/* give up on a request the poll could not wait for any longer. One that
+ * sat on the mailbox timed out like in lx_cmdq_watchdog(), whose jiffies
+ * may not move while irqs are off. Returns false if it answered meanwhile.
+ */
+static bool lx_cmdq_expire(struct lx_chip *chip, struct lx_cmd_req *req)
+{
+	unsigned long flags;
+	LIST_HEAD(done);
+	bool expired;
+
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	expired = req->state != LX_CMD_DONE;
+	if (req->state == LX_CMD_ACTIVE) {
+		dev_warn(chip->card->dev,
+			"TIMEOUT lx_message_send_atomic! reply failed\n");
+		lx_message_dump(chip, req->rmh);
+		lx_cmdq_retire(chip, req, -EIO, &done);
+		lx_cmdq_timed_out(chip);
+	} else if (req->state == LX_CMD_QUEUED) {
+		lx_cmdq_retire(chip, req, -EIO, &done);
+	}
+	lx_cmdq_kick(chip, &done);
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+
+	lx_cmdq_finish(chip, &done);
+	return expired;
+}
+
+/* wait for a request with irqs off. It gets XILINX_TIMEOUT_MS to reach the
+ * mailbox, the request ahead answers or times out meanwhile, and as much
+ * again once there. REG_CSM is polled without the lock, the queue is only
+ * taken to collect an answer and, every ms, to time out the request ahead.
+ * Returns false if the request was given up.
+ */
+static bool lx_cmdq_poll(struct lx_chip *chip, struct lx_cmd_req *req)
+{
+	ktime_t end = ktime_add_ms(ktime_get(), XILINX_TIMEOUT_MS);
+	bool active = false;
+	unsigned int spin;
+
+	for (spin = 1; ; spin++) {
+		switch (READ_ONCE(req->state)) {
+		case LX_CMD_DONE:
+			return true;
+		case LX_CMD_ACTIVE:
+			if (!active) {
+				active = true;
+				end = ktime_add_ms(ktime_get(),
+						XILINX_TIMEOUT_MS);
+			}
+			break;
+		default:
+			break;
+		}
+
+		if (lx_dsp_reg_read(chip, REG_CSM) & REG_CSM_MR)
+			lx_cmdq_process(chip);
+		else if (spin % 1000 == 0)
+			lx_cmdq_watchdog(chip);
+		if (ktime_after(ktime_get(), end))
+			break;
+		udelay(1);
+	}
+
+	return !lx_cmdq_expire(chip, req);
+}
+
+void lx_cmdq_init(struct lx_chip *chip)
+{
+	int prio;
+
+	spin_lock_init(&chip->cmdq_lock);
+	spin_lock_init(&chip->cmd_stats_lock);
+	lx_cmd_stats_reset(chip);
+	for (prio = 0; prio < LX_CMD_PRIO_COUNT; prio++)
+		INIT_LIST_HEAD(&chip->cmdq[prio]);
+	chip->cmdq_active = NULL;
+	chip->cmdq_csm_clear = false;
+	chip->cmdq_inject_busy = false;
+	chip->cmdq_timeouts = 0;
+	atomic_set(&chip->cmdq_inject_timeouts, 0);
+#if KERNEL_VERSION(4, 15, 0) <= LINUX_VERSION_CODE
+	timer_setup(&chip->cmdq_timer, lx_cmdq_timeout, 0);
+#else
+	setup_timer(&chip->cmdq_timer, lx_cmdq_timeout, (unsigned long)chip);
+#endif
+}
+
+/* fail everything still queued, the card is going away */
+void lx_cmdq_flush(struct lx_chip *chip)
+{
+	struct lx_cmd_req *req;
+	unsigned long flags;
+	LIST_HEAD(done);
+	int prio;
+
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	if (chip->cmdq_active)
+		lx_cmdq_retire(chip, chip->cmdq_active, -ENODEV, &done);
+	/* the board is reset next, check the mailbox again after it */
+	chip->cmdq_csm_clear = false;
+	chip->cmdq_inject_busy = false;
+	for (prio = 0; prio < LX_CMD_PRIO_COUNT; prio++) {
+		while (!list_empty(&chip->cmdq[prio])) {
+			req = list_first_entry(&chip->cmdq[prio],
+					struct lx_cmd_req, list);
+			lx_cmdq_retire(chip, req, -ENODEV, &done);
+		}
+	}
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+
+	lx_cmdq_finish(chip, &done);
+	timer_delete_sync(&chip->cmdq_timer);
+}
+
+void lx_cmd_req_init(struct lx_cmd_req *req, struct lx_rmh *rmh,
+		lx_cmd_callback_t callback, void *private_data)
+{
+	INIT_LIST_HEAD(&req->list);
+	req->rmh = rmh;
+	req->prio = (rmh->cmd_idx < CMD_INVALID) ?
+			dsp_commands[rmh->cmd_idx].dc_prio : LX_CMD_PRIO_STATUS;
+	req->state = LX_CMD_DONE;
+	req->status = 0;
+	req->callback = callback;
+	req->private_data = private_data;
+	init_completion(&req->done);
+}
+
+/* queue a request, safe from any context.
+ * A request with a callback is finished by that callback, which runs from
+ * the interrupt, the watchdog timer or the context of another submitter.
+ */
+int lx_cmd_submit(struct lx_chip *chip, struct lx_cmd_req *req)
+{
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	if (req->state != LX_CMD_DONE) {
+		spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+		return -EBUSY;
+	}
+	req->state = LX_CMD_QUEUED;
+	req->status = 0;
+	list_add_tail(&req->list, &chip->cmdq[req->prio]);
+	lx_cmdq_kick(chip, &done);
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+
+	lx_cmdq_finish(chip, &done);
+	return 0;
+}
+
+/* commands answered by event may only sleep in process context; the
+ * trigger callbacks run with irqs off and keep polling the mailbox.
+ */
+static inline bool lx_message_may_sleep(void)
+{
+	return !in_interrupt() && !irqs_disabled();
+}
+
+/* wait for the CMD_DONE interrupt of a queued request.
+ * Spin a little first if recent commands answered quickly enough, then
+ * sleep on the request completion. Returns 0 when the request answered.
+ */
+static int lx_message_wait_event(struct lx_chip *chip, struct lx_cmd_req *req)
+{
+	ktime_t start = ktime_get();
+	unsigned int waited_us;
+	unsigned long flags;
+	unsigned int spin;
+	bool done = false;
+	bool spun = false;
+
+	if (READ_ONCE(chip->cmd_wait_avg_us) <= cmd_spin_us) {
+		for (spin = cmd_spin_us; spin > 0; spin--) {
+			if (completion_done(&req->done)) {
+				done = spun = true;
+				break;
+			}
+			udelay(1);
+		}
+	}
+
+	if (!done)
+		done = wait_for_completion_timeout(&req->done,
+				msecs_to_jiffies(LX_CMDQ_WAIT_MS)) != 0;
+
+	waited_us = (unsigned int)ktime_us_delta(ktime_get(), start);
+
+	/* senders run concurrently, the counters are kept under cmdq_lock */
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	if (spun)
+		chip->debug_irq.cmd_event_spin++;
+	else
+		chip->debug_irq.cmd_irq_waiting++;
+	chip->debug_irq.cmd_event++;
+	chip->debug_irq.cmd_wait_total_us += waited_us;
+	if (waited_us > chip->debug_irq.cmd_wait_max_us)
+		chip->debug_irq.cmd_wait_max_us = waited_us;
+	WRITE_ONCE(chip->cmd_wait_avg_us,
+			(chip->cmd_wait_avg_us * 7 + waited_us) / 8);
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+
+	return done ? 0 : -ETIMEDOUT;
+}
+
+void lx_cmd_stats_reset(struct lx_chip *chip)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->cmd_stats_lock, flags);
+	memset(chip->cmd_stats, 0, sizeof(chip->cmd_stats));
+	spin_unlock_irqrestore(&chip->cmd_stats_lock, flags);
+}
+
+static void lx_cmd_stats_add(struct lx_chip *chip, u16 cmd_idx,
+		unsigned char response_type, u64 ns, bool timed_out)
+{
+	struct lx_cmd_stats *stats;
+	unsigned long flags;
+	unsigned int bucket = 0;
+	u64 us = ns / NSEC_PER_USEC;
+
+	if (cmd_idx >= CMD_INVALID ||
+	    response_type >= LX_CMD_STATS_RESPONSES)
+		return;
+
+	if (us > 1)
+		bucket = min_t(unsigned int, ilog2(us),
+				LX_CMD_STATS_BUCKETS - 1);
+
+	spin_lock_irqsave(&chip->cmd_stats_lock, flags);
+	stats = &chip->cmd_stats[cmd_idx][response_type];
+	if (stats->count == 0 || ns < stats->min_ns)
+		stats->min_ns = ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+	stats->total_ns += ns;
+	stats->count++;
+	stats->hist[bucket]++;
+	if (timed_out)
+		stats->timeouts++;
+	spin_unlock_irqrestore(&chip->cmd_stats_lock, flags);
+}
+
+int lx_message_send_atomic_generic(struct lx_chip *chip, struct lx_rmh *rmh,
+		unsigned char response_type)
+{
+	struct lx_cmd_req req;
+	unsigned long flags;
+	ktime_t start;
+	u64 elapsed_ns;
+	int err;
+
+	if (response_type == ATOMIC_RESPONSE_BY_EVENT &&
+	    !lx_message_may_sleep()) {
+		spin_lock_irqsave(&chip->cmdq_lock, flags);
+		chip->debug_irq.cmd_event_polled++;
+		spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+		response_type = ATOMIC_RESPONSE_BY_POLLING;
+	}
+
+	trace_lx_cmd_send(chip->card->number, rmh->cmd_idx, rmh->cmd[0],
+			response_type);
+
+	lx_cmd_req_init(&req, rmh, NULL, NULL);
+	start = ktime_get();
+	err = lx_cmd_submit(chip, &req);
+	if (err < 0)
+		return err;
+
+	switch (response_type) {
+	case ATOMIC_RESPONSE_BY_EVENT:
+		if (lx_message_wait_event(chip, &req) < 0)
+			dev_err(chip->card->dev,
+				"%s, message_pending timeout...\n",
+				__func__);
+		break;
+	case  ATOMIC_RESPONSE_BY_POLLING:
+		if (!lx_cmdq_poll(chip, &req))
+			dev_warn(chip->card->dev,
+			"TIMEOUT lx_message_send_atomic_poll! polling failed\n");
+		break;
+	}
+
+	/* also makes sure the request is off the queue before returning */
+	err = lx_cmdq_cancel(chip, &req, -EIO);
+
+	elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	lx_cmd_stats_add(chip, rmh->cmd_idx, response_type, elapsed_ns,
+			err == -EIO || err == -ETIMEDOUT);
+	trace_lx_cmd_done(chip->card->number, rmh->cmd_idx, rmh->cmd[0],
+			response_type, elapsed_ns, err);
+
+	return err;
+}
+
 /* low-level dsp access */
 int lx_dsp_get_version(struct lx_chip *chip, u32 *rdsp_version)
 {
@@ -617,6 +1252,144 @@ exit:
 	return ret;
 }
 
+int lx_dsp_set_timer_irq(struct lx_chip *chip, u32 granules)
+{
+	int ret;
+
+	mutex_lock(&chip->msg_lock);
+
+	ret = lx_message_init(chip, CMD_03_SET_TIMER_IRQ);
+	if (ret < 0)
+		goto exit;
+
+	/* tick period in granules, 0 stops the timer. The firmware does not
+	 * document the argument, lx_irq_timer_check() makes sure of the rate
+	 */
+	chip->rmh.cmd[0] |= granules & MASK_SYS_TIMER_COUNT;
+	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
+						ATOMIC_RESPONSE_BY_EVENT);
+
+exit:
+	mutex_unlock(&chip->msg_lock);
+	return ret;
+}
+
+/* ticks the first timer programming is checked against */
+#define LX_TIMER_CHECK_TICKS	8
+#define LX_TIMER_CHECK_MAX_MS	500
+
+/* count the timer irqs for a few expected ticks and compare with the rate
+ * asked for. A firmware reading CMD_03 otherwise would leave the moderated
+ * streams without period wakeups. Sleeps, process context only.
+ */
+static bool lx_irq_timer_check(struct lx_chip *chip, u32 granules,
+		unsigned int rate)
+{
+	unsigned int window_ms;
+	unsigned int ticks;
+	u64 tick_ns, expected;
+	ktime_t start;
+	s64 ns;
+
+	if (rate == 0 || chip->pcm_granularity == 0)
+		return false;
+	tick_ns = div_u64((u64)granules * chip->pcm_granularity *
+			NSEC_PER_SEC, rate);
+	window_ms = clamp_t(u64, div_u64(tick_ns * LX_TIMER_CHECK_TICKS,
+			NSEC_PER_MSEC), 10, LX_TIMER_CHECK_MAX_MS);
+
+	ticks = atomic_read(&chip->irq_timer_ticks);
+	start = ktime_get();
+	msleep(window_ms);
+	ticks = atomic_read(&chip->irq_timer_ticks) - ticks;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	expected = div64_u64(ns, tick_ns);
+	dev_dbg(chip->card->dev, "%s, %u timer irqs in %lld ns, %llu expected\n",
+			__func__, ticks, ns, expected);
+	/* too slow a tick to tell within the window */
+	if (expected < 2)
+		return false;
+	return ticks * 2 >= expected && ticks <= expected * 2;
+}
+
+/*
+ * interrupt moderation: a stream whose period rate is above
+ * irq_moderation_hz gets its buffer without end of buffer notification and
+ * is advanced from the granule counter of the firmware timer irq instead,
+ * see lx_interrupt_timer(). The card has one timer, it ticks for the
+ * moderated stream asking for the fastest rate. Its first programming is
+ * checked, if the irqs do not come at that rate the streams keep their
+ * per period irqs until the module is reloaded. A NULL runtime leaves the
+ * timer mode. Called under setup_mutex, after period_multiple_gran is set.
+ */
+int lx_irq_moderation_set(struct lx_chip *chip, struct lx_stream *lx_stream,
+		struct snd_pcm_runtime *runtime)
+{
+	unsigned char multiple_gran = lx_stream->period_multiple_gran;
+	unsigned int tick = 0;
+	unsigned int max_tick;
+	unsigned int idx;
+	int is_capture;
+	u32 granules = 0;
+	u32 wanted;
+	int err;
+
+	if (runtime && irq_moderation_hz && chip->pcm_granularity &&
+	    multiple_gran &&
+	    runtime->rate / runtime->period_size > irq_moderation_hz) {
+		tick = runtime->rate / irq_moderation_hz /
+				chip->pcm_granularity;
+		/* at least a period, at most half of the buffer */
+		max_tick = max_t(unsigned int, runtime->periods / 2, 1) *
+				multiple_gran;
+		tick = clamp_t(unsigned int, tick, multiple_gran,
+				min_t(unsigned int, max_tick,
+					MASK_SYS_TIMER_COUNT));
+	}
+	if (chip->irq_timer_checked < 0)
+		tick = 0;
+	lx_stream->irq_timer_wanted = tick;
+	lx_stream->irq_moderated = tick != 0;
+
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (idx = 0; idx < chip->substreams; idx++) {
+			wanted = lx_chip_stream(chip, is_capture, idx)->
+					irq_timer_wanted;
+			if (wanted && (granules == 0 || wanted < granules))
+				granules = wanted;
+		}
+	if (granules == chip->irq_timer_gran)
+		return 0;
+
+	err = lx_dsp_set_timer_irq(chip, granules);
+	if (err != 0) {
+		dev_err(chip->card->dev,
+			"%s, timer irq of %u granules failed (%d), per period irqs\n",
+			__func__, granules, err);
+		lx_stream->irq_timer_wanted = 0;
+		lx_stream->irq_moderated = false;
+		return err;
+	}
+	chip->irq_timer_gran = granules;
+
+	if (granules == 0 || chip->irq_timer_checked != 0)
+		return 0;
+	if (runtime && lx_irq_timer_check(chip, granules, runtime->rate)) {
+		chip->irq_timer_checked = 1;
+		return 0;
+	}
+	/* nobody else was moderated before the first check */
+	dev_warn(chip->card->dev,
+		"%s, timer irq of %u granules not at its rate, per period irqs\n",
+		__func__, granules);
+	chip->irq_timer_checked = -1;
+	lx_stream->irq_timer_wanted = 0;
+	lx_stream->irq_moderated = false;
+	chip->irq_timer_gran = 0;
+	return lx_dsp_set_timer_irq(chip, 0);
+}
+
 int lx_dsp_read_async_events(struct lx_chip *chip, u32 *data)
 {
 	int ret;
@@ -631,7 +1404,7 @@ int lx_dsp_read_async_events(struct lx_chip *chip, u32 *data)
 	chip->rmh.stat_len = 10;
 
 	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
-					ATOMIC_RESPONSE_BY_POLLING);
+					ATOMIC_RESPONSE_BY_EVENT);
 	if (!ret)
 		memcpy(data, chip->rmh.stat, chip->rmh.stat_len * sizeof(u32));
 
@@ -644,19 +1417,24 @@ exit:
 	((u32)((u32)(pipe) | ((capture) ? ID_IS_CAPTURE : 0)) << ID_OFFSET)
 
 /* low-level pipe handling */
+static void lx_rmh_pipe_allocate(struct lx_rmh *rmh, u32 pipe, int is_capture,
+		int channels)
+{
+	rmh->cmd[0] |= PIPE_INFO_TO_CMD(is_capture, pipe);
+	rmh->cmd[0] |= channels;
+}
+
 int lx_pipe_allocate(struct lx_chip *chip, u32 pipe, int is_capture,
 		int channels)
 {
 	int ret;
-	u32 pipe_cmd = PIPE_INFO_TO_CMD(is_capture, pipe);
 
 	mutex_lock(&chip->msg_lock);
 	ret = lx_message_init(chip, CMD_06_ALLOCATE_PIPE);
 	if (ret < 0)
 		goto exit;
 
-	chip->rmh.cmd[0] |= pipe_cmd;
-	chip->rmh.cmd[0] |= channels;
+	lx_rmh_pipe_allocate(&chip->rmh, pipe, is_capture, channels);
 
 	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
 						ATOMIC_RESPONSE_BY_EVENT);
@@ -682,7 +1460,7 @@ int lx_pipe_release(struct lx_chip *chip, u32 pipe, int is_capture)
 	chip->rmh.cmd[0] |= pipe_cmd;
 
 	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
-					     ATOMIC_RESPONSE_BY_POLLING);
+					     ATOMIC_RESPONSE_BY_EVENT);
 exit:
 	mutex_unlock(&chip->msg_lock);
 	return ret;
@@ -761,7 +1539,7 @@ int lx_pipe_stop_single(struct lx_chip *chip, u32 pipe, int is_capture)
 	chip->rmh.cmd[0] |= pipe_cmd;
 
 	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
-					     ATOMIC_RESPONSE_BY_POLLING);
+					     ATOMIC_RESPONSE_BY_EVENT);
 exit:
 	mutex_unlock(&chip->msg_lock);
 	return ret;
@@ -769,53 +1547,45 @@ exit:
 
 static int lx_pipe_toggle_state(struct lx_chip *chip, u32 pipe, int is_capture)
 {
+	struct lx_rmh rmh;
 	int ret;
 	u32 pipe_cmd = PIPE_INFO_TO_CMD(is_capture, pipe);
  printk(KERN_DEBUG "\t\t%s, is_capture: %d, pipe: %d\n", __func__, is_capture, pipe);
 
-	mutex_lock(&chip->msg_lock);
-	ret = lx_message_init(chip, CMD_0B_TOGGLE_PIPE_STATE);
+	ret = lx_message_init_rmh(chip, &rmh, CMD_0B_TOGGLE_PIPE_STATE);
 	if (ret < 0)
 		goto exit;
 
-	chip->rmh.cmd[0] |= pipe_cmd;
-	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
-					ATOMIC_RESPONSE_BY_POLLING);
+	rmh.cmd[0] |= pipe_cmd;
+	ret = lx_message_send_atomic_generic(chip, &rmh,
+					ATOMIC_RESPONSE_BY_EVENT);
 
 exit:
-	mutex_unlock(&chip->msg_lock);
 	return ret;
 }
 
-static int lx_pipe_toggle_state_play_and_record(struct lx_chip *chip)
+static int lx_pipe_toggle_state_play_and_record(struct lx_chip *chip,
+		u64 play_mask, u64 record_mask)
 {
+	struct lx_rmh rmh;
 	int ret;
 	u32 pipe_cmd = MASK_MULTIPLE_PIPES_CMD;
 	/*printk(KERN_DEBUG "\t\%s\n", __func__);*/
-	mutex_lock(&chip->msg_lock);
 
-	ret = lx_message_init(chip, CMD_0B_TOGGLE_PIPE_STATE);
+	ret = lx_message_init_rmh(chip, &rmh, CMD_0B_TOGGLE_PIPE_STATE);
 	if (ret < 0)
 		goto exit;
 	/* in this case we have to specify pipes mask for play and record */
-	chip->rmh.cmd_len = 5;
-	chip->rmh.cmd[0] |= pipe_cmd;
-	if(chip->first_channel_selector<32){
-	    chip->rmh.cmd[1] = 0;
-	    chip->rmh.cmd[2] = 1<<chip->first_channel_selector; /* ok now, but it ll not work if we use severals pipes */
-	    chip->rmh.cmd[3] = 0;
-	    chip->rmh.cmd[4] = 1<<chip->first_channel_selector; /* ok now, but it ll not work if we use severals pipes */
-	} else {
-	    chip->rmh.cmd[1] = 1<<(chip->first_channel_selector - 32); /* ok now, but it ll not work if we use severals pipes */
-	    chip->rmh.cmd[2] = 0;
-	    chip->rmh.cmd[3] = 1<<(chip->first_channel_selector - 32); /* ok now, but it ll not work if we use severals pipes */
-	    chip->rmh.cmd[4] = 0;
-	}
-
-	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
-						ATOMIC_RESPONSE_BY_POLLING);
+	rmh.cmd_len = 5;
+	rmh.cmd[0] |= pipe_cmd;
+	rmh.cmd[1] = upper_32_bits(play_mask);
+	rmh.cmd[2] = lower_32_bits(play_mask);
+	rmh.cmd[3] = upper_32_bits(record_mask);
+	rmh.cmd[4] = lower_32_bits(record_mask);
+
+	ret = lx_message_send_atomic_generic(chip, &rmh,
+						ATOMIC_RESPONSE_BY_EVENT);
 exit:
-	mutex_unlock(&chip->msg_lock);
 	return ret;
 }
 
@@ -881,9 +1651,98 @@ int lx_pipe_start_single(struct lx_chip *chip, u32 pipe, int is_capture)
 	return err;
 }
 
+/* state waits
+ * max 2*PCMOnlyGranularity = 2*1024 at 44100 = < 50 ms, keep some margin.
+ * Process context sleeps between two state queries, backing off from
+ * LX_STATE_POLL_MIN_US to LX_STATE_POLL_MAX_US. The trigger callbacks run
+ * atomic with irqs off and can only delay, they poll every
+ * LX_STATE_POLL_ATOMIC_US at most so the cpu goes back to the mailbox
+ * rather than to a long udelay().
+ */
+#define LX_STATE_WAIT_MS	100
+#define LX_STATE_POLL_MIN_US	50
+#define LX_STATE_POLL_MAX_US	1000
+#define LX_STATE_POLL_ATOMIC_US	4
+
+static void lx_state_wait_backoff(unsigned int *delay_us)
+{
+	if (lx_message_may_sleep()) {
+		usleep_range(*delay_us, *delay_us + *delay_us / 2);
+		*delay_us = min_t(unsigned int, *delay_us * 2,
+				LX_STATE_POLL_MAX_US);
+	} else {
+		udelay(*delay_us);
+		*delay_us = min_t(unsigned int, *delay_us * 2,
+				LX_STATE_POLL_ATOMIC_US);
+	}
+}
+
+/* wait until the pipe or stream reaches state, or until timeout */
+static int lx_wait_for_state_until(struct lx_chip *chip, u32 pipe,
+		int is_capture, u16 state, bool stream, ktime_t timeout,
+		unsigned int *rwait_us)
+{
+	ktime_t start = ktime_get();
+	unsigned int delay_us = lx_message_may_sleep() ?
+			LX_STATE_POLL_MIN_US : 1;
+	int current_state;
+	u16 pipe_state;
+	int err;
+
+	for (;;) {
+		if (stream) {
+			err = lx_stream_state(chip, pipe, is_capture,
+					&current_state);
+		} else {
+			err = lx_pipe_state(chip, pipe, is_capture,
+					&pipe_state);
+			current_state = pipe_state;
+		}
+		if (err < 0) {
+			dev_err(chip->card->dev,
+			"\t\t\t %s : lx_%s_state failed %d\n",
+			__func__, stream ? "stream" : "pipe", err);
+			return err;
+		}
+
+		if (current_state == state)
+			break;
+
+		if (ktime_after(ktime_get(), timeout)) {
+			dev_err(chip->card->dev, "\t\t\t%s failed... %s %d " \
+					 "current state is %d expected : %d\n",
+				__func__, stream ? "stream" : "pipe", pipe,
+				current_state, state);
+			return -ETIMEDOUT;
+		}
+
+		lx_state_wait_backoff(&delay_us);
+	}
+
+	if (rwait_us)
+		*rwait_us = (unsigned int)ktime_us_delta(ktime_get(), start);
+	return 0;
+}
+
+static int lx_wait_for_state(struct lx_chip *chip, u32 pipe, int is_capture,
+		u16 state, bool stream, unsigned int *rwait_us)
+{
+	return lx_wait_for_state_until(chip, pipe, is_capture, state, stream,
+			ktime_add_ms(ktime_get(), LX_STATE_WAIT_MS), rwait_us);
+}
+
+static void lx_pipe_record_stop(struct lx_chip *chip, int is_capture,
+		unsigned int stop_us)
+{
+	chip->debug_irq.stop_last_us[is_capture] = stop_us;
+	if (stop_us > chip->debug_irq.stop_max_us[is_capture])
+		chip->debug_irq.stop_max_us[is_capture] = stop_us;
+}
+
 int lx_pipe_pause_single(struct lx_chip *chip, u32 pipe, int is_capture)
 {
 	int err = 0;
+	unsigned int stop_us;
 	/*printk(KERN_DEBUG "\t%s, is_capture: %d\n", __func__, is_capture);*/
 
 	err = lx_pipe_wait_for_start(chip, pipe, is_capture);
@@ -902,70 +1761,91 @@ int lx_pipe_pause_single(struct lx_chip *chip, u32 pipe, int is_capture)
 		return err;
 	}
 
-	lx_pipe_wait_for_idle(chip, pipe, is_capture);
+	err = lx_pipe_wait_for_state(chip, pipe, is_capture, PSTATE_IDLE,
+			&stop_us);
 	if (err < 0) {
 		dev_err(chip->card->dev,
 		"\t\t%s error wait for idle err %d, is_capture %d\n",
 		__func__, err, is_capture);
 		return err;
 	}
+	lx_pipe_record_stop(chip, is_capture, stop_us);
 
 	return err;
 }
 
-int lx_pipe_start_multiple(struct lx_chip *chip)
+int lx_pipe_start_multiple(struct lx_chip *chip, u64 play_mask,
+		u64 record_mask)
 {
 	int err;
 
-	err = lx_pipe_toggle_state_play_and_record(chip);
+	err = lx_pipe_toggle_state_play_and_record(chip, play_mask,
+			record_mask);
 	if (err < 0) {
 		dev_err(chip->card->dev, "%s: lx_pipe_toggle_state failed\n",
 				__func__);
 	}
 	return err;
 }
-int lx_pipe_pause_multiple(struct lx_chip *chip)
+int lx_pipe_pause_multiple(struct lx_chip *chip, u64 play_mask,
+		u64 record_mask)
 {
-	int err;
+	int err = 0;
+	unsigned int stop_us;
+	ktime_t start;
+	int is_capture;
+	u64 mask;
+	u32 pipe;
 	/*printk(KERN_DEBUG  "\t%s %p\n", __func__, chip);*/
 
-	err = lx_pipe_wait_for_start(chip, chip->first_channel_selector, 0);
-	if (err < 0) {
-		dev_err(chip->card->dev, "%s: lx_pipe_toggle_state failed " \
-				"can't pause play, it s not started\n",
-				__func__);
-		return err;
-	}
-
-	err = lx_pipe_wait_for_start(chip, chip->first_channel_selector, 1);
-	if (err < 0) {
-		dev_err(chip->card->dev, "%s: lx_pipe_toggle_state failed\n" \
-				"can't pause record, it s not started\n",
-				__func__);
-		return err;
+	for (is_capture = 0; is_capture < 2; is_capture++) {
+		for (mask = is_capture ? record_mask : play_mask; mask;
+				mask &= mask - 1) {
+			pipe = __ffs64(mask);
+			err = lx_pipe_wait_for_start(chip, pipe, is_capture);
+			if (err < 0) {
+				dev_err(chip->card->dev,
+					"%s: lx_pipe_toggle_state failed " \
+					"can't pause %s pipe %u, it s not started\n",
+					__func__, is_capture ? "record" : "play",
+					pipe);
+				return err;
+			}
+		}
 	}
 
-	err = lx_pipe_toggle_state_play_and_record(chip);
+	err = lx_pipe_toggle_state_play_and_record(chip, play_mask,
+			record_mask);
 	if (err < 0) {
 		dev_err(chip->card->dev,
 			"%s: lx_pipe_toggle_state failed\n",
 			__func__);
 	}
 
-	err = lx_pipe_wait_for_idle(chip, chip->first_channel_selector, 0);
-	if (err < 0) {
-		dev_err(chip->card->dev,
-			"\t\t%s error wait for play idle %d\n",
-			__func__, err);
-		return err;
-	}
-
-	err = lx_pipe_wait_for_idle(chip, chip->first_channel_selector, 1);
-	if (err < 0) {
-		dev_err(chip->card->dev,
-			"\t\t%s error wait for capture idle %d\n",
-			__func__, err);
-		return err;
+	/* the pipes of a direction were toggled together and share one
+	 * LX_STATE_WAIT_MS budget, the stop time is the one of the last pipe
+	 */
+	for (is_capture = 0; is_capture < 2; is_capture++) {
+		mask = is_capture ? record_mask : play_mask;
+		if (mask == 0)
+			continue;
+		start = ktime_get();
+		for (; mask; mask &= mask - 1) {
+			pipe = __ffs64(mask);
+			err = lx_wait_for_state_until(chip, pipe, is_capture,
+					PSTATE_IDLE, false,
+					ktime_add_ms(start, LX_STATE_WAIT_MS),
+					NULL);
+			if (err < 0) {
+				dev_err(chip->card->dev,
+					"\t\t%s error wait for %s idle %d\n",
+					__func__,
+					is_capture ? "capture" : "play", err);
+				return err;
+			}
+		}
+		stop_us = (unsigned int)ktime_us_delta(ktime_get(), start);
+		lx_pipe_record_stop(chip, is_capture, stop_us);
 	}
 
 	return err;
@@ -1018,89 +1898,70 @@ exit:
 
 int lx_pipe_state(struct lx_chip *chip, u32 pipe, int is_capture, u16 *rstate)
 {
+	struct lx_rmh rmh;
 	int ret;
 	u32 pipe_cmd = PIPE_INFO_TO_CMD(is_capture, pipe);
 
-	mutex_lock(&chip->msg_lock);
-	ret = lx_message_init(chip, CMD_0A_GET_PIPE_SPL_COUNT);
+	ret = lx_message_init_rmh(chip, &rmh, CMD_0A_GET_PIPE_SPL_COUNT);
 	if (ret < 0)
 		goto exit;
-	chip->rmh.cmd[0] |= pipe_cmd;
+	rmh.cmd[0] |= pipe_cmd;
 
 	/*printk(KERN_DEBUG "\t\t%s, pipe_cmd : %x, pipe : %d\n",
-	 * __func__, chip->rmh.cmd[0], pipe);
+	 * __func__, rmh.cmd[0], pipe);
 	 */
 
-	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
-						ATOMIC_RESPONSE_BY_POLLING);
+	ret = lx_message_send_atomic_generic(chip, &rmh,
+						ATOMIC_RESPONSE_BY_EVENT);
 
 	if (ret != 0)
 		dev_err(chip->card->dev, "could not query pipe's state\n");
 	else
-		*rstate = (chip->rmh.stat[0] >> PSTATE_OFFSET) & 0x0F;
+		*rstate = (rmh.stat[0] >> PSTATE_OFFSET) & 0x0F;
 exit:
-	mutex_unlock(&chip->msg_lock);
 	return ret;
 }
 
-static int lx_pipe_wait_for_state(struct lx_chip *chip, u32 pipe,
-		int is_capture, u16 state)
+/* wait for the pipe to reach state, the time it took is returned in
+ * rwait_us if not NULL
+ */
+int lx_pipe_wait_for_state(struct lx_chip *chip, u32 pipe, int is_capture,
+		u16 state, unsigned int *rwait_us)
 {
-	int i;
-	u16 current_state;
-
-	/* max 2*PCMOnlyGranularity = 2*1024 at 44100 = < 50 ms:
-	 * timeout 50 ms
-	 */
-	for (i = 0; i < 100; ++i) {
-		int err = lx_pipe_state(chip, pipe, is_capture, &current_state);
-		if (err < 0) {
-			dev_err(chip->card->dev,
-			"\t\t\t %s : lx_pipe_state failed %d\n",
-			__func__, err);
-			return err;
-		}
-
-		if (current_state == state) {
-/*printk(KERN_DEBUG"\t\t\t %s : %d ms\n", __func__,i);*/
-			return 0;
-		}
-		mdelay(1);
-	}
-
-	if (current_state != state) {
-		dev_err(chip->card->dev, "\t\t\t%s failed... pipe %d " \
-					 "current state is %d expected : %d\n",
-				__func__,pipe,  current_state, state);
-	}
-	return -ETIMEDOUT;
+	return lx_wait_for_state(chip, pipe, is_capture, state, false,
+			rwait_us);
 }
 
 int lx_pipe_wait_for_start(struct lx_chip *chip, u32 pipe, int is_capture)
 {
 /*printk(KERN_DEBUG"\t%s\n", __func__);*/
-	return lx_pipe_wait_for_state(chip, pipe, is_capture, PSTATE_RUN);
+	return lx_pipe_wait_for_state(chip, pipe, is_capture, PSTATE_RUN, NULL);
 }
 
 int lx_pipe_wait_for_idle(struct lx_chip *chip, u32 pipe, int is_capture)
 {
 /*printk(KERN_DEBUG"\t%s\n", __func__);*/
-	return lx_pipe_wait_for_state(chip, pipe, is_capture, PSTATE_IDLE);
+	return lx_pipe_wait_for_state(chip, pipe, is_capture, PSTATE_IDLE, NULL);
 }
 
 /* low-level stream handling */
+static void lx_rmh_stream_set_state(struct lx_rmh *rmh, u32 pipe,
+		int is_capture, enum stream_state_t state)
+{
+	rmh->cmd[0] |= PIPE_INFO_TO_CMD(is_capture, pipe);
+	rmh->cmd[0] |= state;
+}
+
 int lx_stream_set_state(struct lx_chip *chip, u32 pipe, int is_capture,
 		enum stream_state_t state)
 {
 	int ret;
-	u32 pipe_cmd = PIPE_INFO_TO_CMD(is_capture, pipe);
 
 	mutex_lock(&chip->msg_lock);
 	ret = lx_message_init(chip, CMD_13_SET_STREAM_STATE);
 	if (ret < 0)
 		goto exit;
-	chip->rmh.cmd[0] |= pipe_cmd;
-	chip->rmh.cmd[0] |= state;
+	lx_rmh_stream_set_state(&chip->rmh, pipe, is_capture, state);
 	/*printk(KERN_DEBUG "\t\t%s, pipe_cmd : %x, pipe : %d\n",
 	 *  __func__, chip->rmh.cmd[0], pipe);
 	 */
@@ -1119,72 +1980,75 @@ exit:
 
 int lx_madi_get_madi_state(struct lx_chip *chip, struct madi_status *status)
 {
+	struct lx_rmh rmh = {};
 	int ret;
 
-	mutex_lock(&chip->msg_lock);
-	ret = lx_message_init(chip, CMD_14_GET_MADI_STATE);
+	ret = lx_message_init_rmh(chip, &rmh, CMD_14_GET_MADI_STATE);
 	if (ret < 0)
 		goto exit;
-	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
+	ret = lx_message_send_atomic_generic(chip, &rmh,
 						ATOMIC_RESPONSE_BY_EVENT);
-	if (ret < 0) {
+	if (ret != 0) {
 		dev_err(chip->card->dev,
 			"%s->lx_message_send_atomic failed...\n",
 			__func__);
+		goto exit;
 	}
 
 	if (status != NULL) {
 
-		status->mute = MADI_GET_MUTE(chip->rmh.stat[0]);
-		status->channel_mode = MADI_GET_CHANNEL_MODE(chip->rmh.stat[0]);
+		status->mute = MADI_GET_MUTE(rmh.stat[0]);
+		status->channel_mode = MADI_GET_CHANNEL_MODE(rmh.stat[0]);
 		status->tx_frame_mode = MADI_GET_TX_FRAME_MODE(
-				chip->rmh.stat[0]);
+				rmh.stat[0]);
 		status->rx_frame_mode = MADI_GET_RX_FRAME_MODE(
-				chip->rmh.stat[0]);
+				rmh.stat[0]);
 
 		status->carrier_error = MADI_GET_CARRIER_ERROR(
-				chip->rmh.stat[1]);
-		status->lock_error = MADI_GET_LOCK_ERROR(chip->rmh.stat[1]);
-		status->async_error = MADI_GET_ASYNC_ERROR(chip->rmh.stat[1]);
-		status->madi_freq = MADI_GET_MADI_FREQ(chip->rmh.stat[1]);
+				rmh.stat[1]);
+		status->lock_error = MADI_GET_LOCK_ERROR(rmh.stat[1]);
+		status->async_error = MADI_GET_ASYNC_ERROR(rmh.stat[1]);
+		status->madi_freq = MADI_GET_MADI_FREQ(rmh.stat[1]);
 	}
 exit:
-	mutex_unlock(&chip->msg_lock);
 	return ret;
 }
-int lx_stream_def(struct lx_chip *chip, struct snd_pcm_runtime *runtime,
-		u32 pipe, int is_capture)
+static void lx_rmh_stream_def(struct lx_rmh *rmh,
+		struct snd_pcm_runtime *runtime, u32 pipe, int is_capture)
 {
-	int ret;
-	u32 pipe_cmd = PIPE_INFO_TO_CMD(is_capture, pipe);
 	u32 channels = runtime->channels;
 
-	if (runtime->channels != channels)
-		dev_err(chip->card->dev, "channel count mismatch: %d vs %d",
-				runtime->channels, channels);
-
-	mutex_lock(&chip->msg_lock);
-	ret = lx_message_init(chip, CMD_0C_DEF_STREAM);
-	if (ret < 0)
-		goto exit;
-	chip->rmh.cmd[0] |= pipe_cmd;
+	rmh->cmd[0] |= PIPE_INFO_TO_CMD(is_capture, pipe);
 
-	chip->rmh.cmd[0] |= MASK_STREAM_IS_ALSA;
+	rmh->cmd[0] |= MASK_STREAM_IS_ALSA;
 
 /* not use now... */
 /*16 bit format */
 
 	if (runtime->sample_bits == 16)
-		chip->rmh.cmd[0] |= (STREAM_FMT_16b << STREAM_FMT_OFFSET);
+		rmh->cmd[0] |= (STREAM_FMT_16b << STREAM_FMT_OFFSET);
 
 	if (snd_pcm_format_little_endian(runtime->format))
 		/* little endian/intel format */
-		chip->rmh.cmd[0] |= (STREAM_FMT_intel << STREAM_FMT_OFFSET);
+		rmh->cmd[0] |= (STREAM_FMT_intel << STREAM_FMT_OFFSET);
 
-	chip->rmh.cmd[0] |= channels - 1;
-	/*printk(KERN_DEBUG  "\t\t%s chip->rmh.cmd[0] %x, pipe : %d, channels %d\n",
-	 * __func__, chip->rmh.cmd[0], pipe, channels);
+	rmh->cmd[0] |= channels - 1;
+	/*printk(KERN_DEBUG  "\t\t%s rmh->cmd[0] %x, pipe : %d, channels %d\n",
+	 * __func__, rmh->cmd[0], pipe, channels);
 	 */
+}
+
+int lx_stream_def(struct lx_chip *chip, struct snd_pcm_runtime *runtime,
+		u32 pipe, int is_capture)
+{
+	int ret;
+
+	mutex_lock(&chip->msg_lock);
+	ret = lx_message_init(chip, CMD_0C_DEF_STREAM);
+	if (ret < 0)
+		goto exit;
+	lx_rmh_stream_def(&chip->rmh, runtime, pipe, is_capture);
+
 	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
 						ATOMIC_RESPONSE_BY_EVENT);
 exit:
@@ -1214,50 +2078,25 @@ exit:
 
 
 
-static int lx_stream_wait_for_state(struct lx_chip *chip, u32 pipe,
-		int is_capture, u16 state)
+int lx_stream_wait_for_state(struct lx_chip *chip, u32 pipe, int is_capture,
+		u16 state, unsigned int *rwait_us)
 {
-	int i;
-	int current_state;
-
-	/* max 2*PCMOnlyGranularity = 2*1024 at 44100 = < 50 ms:
-	 * timeout 50 ms
-	 */
-	for (i = 0; i < 100; ++i) {
-//		int err = lx_pipe_state(chip, pipe, is_capture, &current_state);
-		int err = lx_stream_state(chip, pipe, is_capture, &current_state);
-
-		if (err < 0) {
-			dev_err(chip->card->dev,
-			"\t\t\t %s : lx_stream_state failed %d\n",
-			__func__, err);
-			return err;
-		}
-
-		if (current_state == state) {
-/*printk(KERN_DEBUG"\t\t\t %s : %d ms\n", __func__,i);*/
-			return 0;
-		}
-		mdelay(1);
-	}
-
-	if (current_state != state) {
-		dev_err(chip->card->dev, "\t\t\t%s failed.... current state is %d\n",
-				__func__, current_state);
-	}
-	return -ETIMEDOUT;
+	return lx_wait_for_state(chip, pipe, is_capture, state, true,
+			rwait_us);
 }
 
 int lx_stream_wait_for_start(struct lx_chip *chip, u32 pipe, int is_capture)
 {
 /*printk(KERN_DEBUG"\t%s\n", __func__);*/
-	return lx_stream_wait_for_state(chip, pipe, is_capture, PSTATE_RUN);
+	return lx_stream_wait_for_state(chip, pipe, is_capture, PSTATE_RUN,
+			NULL);
 }
 
 int lx_stream_wait_for_idle(struct lx_chip *chip, u32 pipe, int is_capture)
 {
 /*rintk(KERN_DEBUG"\t%s\n", __func__);*/
-	return lx_stream_wait_for_state(chip, pipe, is_capture, PSTATE_IDLE);
+	return lx_stream_wait_for_state(chip, pipe, is_capture, PSTATE_IDLE,
+			NULL);
 }
 
 
@@ -1284,13 +2123,81 @@ exit:
 	return ret;
 }
 
+/* same counter on a local rmh, in frames of frame_bytes, the channels
+ * times the sample size of the ring. It polls the mailbox, up to the
+ * command timeout, so it is no use to the pcm callbacks that run with irqs
+ * off. *r_time dates the count at the middle of the mailbox round trip.
+ */
+int lx_stream_sample_count(struct lx_chip *chip, u32 pipe, int is_capture,
+		unsigned int frame_bytes, u64 *r_count, ktime_t *r_time,
+		u64 *r_round_trip_ns)
+{
+	struct lx_rmh rmh;
+	ktime_t start;
+	int ret;
+
+	if (frame_bytes == 0)
+		return -EINVAL;
+	ret = lx_message_init_rmh(chip, &rmh, CMD_0E_GET_STREAM_SPL_COUNT);
+	if (ret < 0)
+		return ret;
+	rmh.cmd[0] |= PIPE_INFO_TO_CMD(is_capture, pipe);
+
+	start = ktime_get();
+	ret = lx_message_send_atomic_generic(chip, &rmh,
+						ATOMIC_RESPONSE_BY_EVENT);
+	if (ret != 0)
+		return ret;
+	*r_round_trip_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	*r_time = ktime_add_ns(start, *r_round_trip_ns / 2);
+
+	*r_count = div_u64(((u64)(rmh.stat[0] & MASK_SPL_COUNT_HI) << 32)
+			+ rmh.stat[1], frame_bytes);
+	return 0;
+}
+
 /* low-level buffer handling */
+static void lx_rmh_buffer_give(struct lx_rmh *rmh, u32 pipe, int is_capture,
+		u32 buffer_size, u32 buf_address_lo, u32 buf_address_hi,
+		unsigned char period_multiple_gran, bool notify_eob)
+{
+	rmh->cmd[0] |= PIPE_INFO_TO_CMD(is_capture, pipe);
+	rmh->cmd[0] |= BF_CIRCULAR;
+	/* request interrupt notification, not for timer moderated streams */
+	if (notify_eob)
+		rmh->cmd[0] |= BF_NOTIFY_EOB;
+
+	rmh->cmd[1] = (buffer_size & MASK_DATA_SIZE)
+			| ((u32)period_multiple_gran
+					<< PERIOD_MULTIPLE_GRAN_OFFSET);
+/* printk(KERN_DEBUG "%s %x\n", __func__, rmh->cmd[1]); */
+	rmh->cmd[2] = buf_address_lo;
+
+	if (buf_address_hi) {
+		rmh->cmd_len = 4;
+		rmh->cmd[3] = buf_address_hi;
+		rmh->cmd[0] |= BF_64BITS_ADR;
+	}
+}
+
+static void lx_buffer_give_error(struct lx_chip *chip, int ret)
+{
+	if (ret == EB_RBUFFERS_TABLE_OVERFLOW)
+		dev_err(chip->card->dev,
+				"lx_buffer_give EB_RBUFFERS_TABLE_OVERFLOW\n");
+
+	if (ret == EB_INVALID_STREAM)
+		dev_err(chip->card->dev, "lx_buffer_give EB_INVALID_STREAM\n");
+
+	if (ret == EB_CMD_REFUSED)
+		dev_err(chip->card->dev, "lx_buffer_give EB_CMD_REFUSED\n");
+}
+
 int lx_buffer_give(struct lx_chip *chip, u32 pipe, int is_capture,
 		u32 buffer_size, u32 buf_address_lo, u32 buf_address_hi,
 		u32 *r_buffer_index, unsigned char period_multiple_gran)
 {
 	int ret;
-	u32 pipe_cmd = PIPE_INFO_TO_CMD(is_capture, pipe);
 /*printk(KERN_DEBUG "%s, period_multiple_gran %d\n", __func__,
 *	period_multiple_gran);
 */
@@ -1298,21 +2205,9 @@ int lx_buffer_give(struct lx_chip *chip, u32 pipe, int is_capture,
 	ret = lx_message_init(chip, CMD_0F_UPDATE_BUFFER);
 	if (ret < 0)
 		goto exit;
-	chip->rmh.cmd[0] |= pipe_cmd;
-	/* request interrupt notification */
-	chip->rmh.cmd[0] |= BF_NOTIFY_EOB | BF_CIRCULAR;
-
-	chip->rmh.cmd[1] = (buffer_size & MASK_DATA_SIZE)
-			| ((u32)period_multiple_gran
-					<< PERIOD_MULTIPLE_GRAN_OFFSET);
-/* printk(KERN_DEBUG "%s %x\n", __func__, chip->rmh.cmd[1]); */
-	chip->rmh.cmd[2] = buf_address_lo;
-
-	if (buf_address_hi) {
-		chip->rmh.cmd_len = 4;
-		chip->rmh.cmd[3] = buf_address_hi;
-		chip->rmh.cmd[0] |= BF_64BITS_ADR;
-	}
+	lx_rmh_buffer_give(&chip->rmh, pipe, is_capture, buffer_size,
+			buf_address_lo, buf_address_hi, period_multiple_gran,
+			true);
 
 	ret = lx_message_send_atomic_generic(chip, &chip->rmh,
 						ATOMIC_RESPONSE_BY_EVENT);
@@ -1322,15 +2217,7 @@ int lx_buffer_give(struct lx_chip *chip, u32 pipe, int is_capture,
 		goto exit;
 	}
 
-	if (ret == EB_RBUFFERS_TABLE_OVERFLOW)
-		dev_err(chip->card->dev,
-				"lx_buffer_give EB_RBUFFERS_TABLE_OVERFLOW\n");
-
-	if (ret == EB_INVALID_STREAM)
-		dev_err(chip->card->dev, "lx_buffer_give EB_INVALID_STREAM\n");
-
-	if (ret == EB_CMD_REFUSED)
-		dev_err(chip->card->dev, "lx_buffer_give EB_CMD_REFUSED\n");
+	lx_buffer_give_error(chip, ret);
 
 exit:
 	mutex_unlock(&chip->msg_lock);
@@ -1406,26 +2293,26 @@ static u32 peak_map[] = {0x00000109, /* -90.308dB */
 int lx_level_peaks(struct lx_chip *chip, int is_capture, int channels,
 		u32 *r_levels)
 {
+	struct lx_rmh rmh;
 	int ret = 0;
 	int i;
 
-	mutex_lock(&chip->msg_lock);
 	for (i = 0; i < channels; i += 4) {
 		u32 s0, s1, s2, s3;
 
-		ret = lx_message_init(chip, CMD_12_GET_PEAK);
+		ret = lx_message_init_rmh(chip, &rmh, CMD_12_GET_PEAK);
 		if (ret < 0)
 			goto exit;
-		chip->rmh.cmd[0] |= PIPE_INFO_TO_CMD(is_capture, i);
+		rmh.cmd[0] |= PIPE_INFO_TO_CMD(is_capture, i);
 
-		ret = lx_message_send_atomic_generic(chip, &chip->rmh,
+		ret = lx_message_send_atomic_generic(chip, &rmh,
 						ATOMIC_RESPONSE_BY_EVENT);
 
 		if (ret == 0) {
-			s0 = peak_map[chip->rmh.stat[0] & 0x0F];
-			s1 = peak_map[(chip->rmh.stat[0] >> 4) & 0xf];
-			s2 = peak_map[(chip->rmh.stat[0] >> 8) & 0xf];
-			s3 = peak_map[(chip->rmh.stat[0] >> 12) & 0xf];
+			s0 = peak_map[rmh.stat[0] & 0x0F];
+			s1 = peak_map[(rmh.stat[0] >> 4) & 0xf];
+			s2 = peak_map[(rmh.stat[0] >> 8) & 0xf];
+			s3 = peak_map[(rmh.stat[0] >> 12) & 0xf];
 		} else
 			s0 = s1 = s2 = s3 = 0;
 
@@ -1437,29 +2324,296 @@ int lx_level_peaks(struct lx_chip *chip, int is_capture, int channels,
 		r_levels += 4;
 	}
 exit:
-	mutex_unlock(&chip->msg_lock);
 	return ret;
 }
 
-/* interrupt handling */
-#define PCX_IRQ_NONE 0
-#define IRQCS_ACTIVE_PCIDB        BIT(13)
-#define IRQCS_ENABLE_PCIIRQ       BIT(8)
-#define IRQCS_ENABLE_PCIDB        BIT(9)
-
-static u32 lx_interrupt_test_ack(struct lx_chip *chip)
+/* command transactions
+ *
+ * A transaction is a short sequence of commands sent back to back under a
+ * single msg_lock acquisition. The next command is queued from the
+ * completion callback of the previous one, so the caller only sleeps once
+ * for the whole sequence. The first failing command aborts the rest unless
+ * it was added with ignore_error.
+ */
+struct lx_transaction *lx_transaction_begin(struct lx_chip *chip)
 {
-	u32 irqcs = lx_plx_reg_read(chip, PLX_IRQCS);
-	int loop = 0;
+	struct lx_transaction *trans = &chip->trans;
 
-	/* Test if PCI Doorbell interrupt is active */
-	if (irqcs & IRQCS_ACTIVE_PCIDB) {
-		u32 temp;
+	mutex_lock(&chip->msg_lock);
+	trans->chip = chip;
+	trans->count = 0;
+	trans->cur = 0;
+	trans->failed = -1;
+	trans->err = 0;
+	trans->aborted = false;
+	return trans;
+}
 
-		irqcs = PCX_IRQ_NONE;
+void lx_transaction_end(struct lx_transaction *trans)
+{
+	mutex_unlock(&trans->chip->msg_lock);
+}
 
-		while ((temp = lx_plx_reg_read(chip, PLX_L2PCIDB)) &&
-				loop++ < 32) {
+static struct lx_rmh *lx_transaction_next(struct lx_transaction *trans,
+		enum cmd_mb_opcodes cmd, bool ignore_error)
+{
+	struct lx_rmh *rmh;
+
+	if (trans->err < 0)
+		return NULL;
+	if (trans->count >= LX_TRANSACTION_MAX) {
+		dev_err(trans->chip->card->dev,
+			"%s, too many commands\n", __func__);
+		trans->err = -ENOSPC;
+		return NULL;
+	}
+
+	rmh = &trans->rmh[trans->count];
+	trans->err = lx_message_init_rmh(trans->chip, rmh, cmd);
+	if (trans->err < 0)
+		return NULL;
+	trans->ignore_error[trans->count] = ignore_error;
+	trans->count++;
+	return rmh;
+}
+
+int lx_transaction_pipe_allocate(struct lx_transaction *trans, u32 pipe,
+		int is_capture, int channels)
+{
+	struct lx_rmh *rmh = lx_transaction_next(trans, CMD_06_ALLOCATE_PIPE,
+			false);
+
+	if (rmh == NULL)
+		return trans->err;
+	lx_rmh_pipe_allocate(rmh, pipe, is_capture, channels);
+	return trans->count - 1;
+}
+
+int lx_transaction_pipe_stop(struct lx_transaction *trans, u32 pipe,
+		int is_capture, bool ignore_error)
+{
+	struct lx_rmh *rmh = lx_transaction_next(trans, CMD_09_STOP_PIPE,
+			ignore_error);
+
+	if (rmh == NULL)
+		return trans->err;
+	rmh->cmd[0] |= PIPE_INFO_TO_CMD(is_capture, pipe);
+	return trans->count - 1;
+}
+
+int lx_transaction_pipe_release(struct lx_transaction *trans, u32 pipe,
+		int is_capture)
+{
+	struct lx_rmh *rmh = lx_transaction_next(trans, CMD_07_RELEASE_PIPE,
+			false);
+
+	if (rmh == NULL)
+		return trans->err;
+	rmh->cmd[0] |= PIPE_INFO_TO_CMD(is_capture, pipe);
+	return trans->count - 1;
+}
+
+int lx_transaction_stream_def(struct lx_transaction *trans,
+		struct snd_pcm_runtime *runtime, u32 pipe, int is_capture)
+{
+	struct lx_rmh *rmh = lx_transaction_next(trans, CMD_0C_DEF_STREAM,
+			false);
+
+	if (rmh == NULL)
+		return trans->err;
+	lx_rmh_stream_def(rmh, runtime, pipe, is_capture);
+	return trans->count - 1;
+}
+
+int lx_transaction_stream_set_state(struct lx_transaction *trans, u32 pipe,
+		int is_capture, enum stream_state_t state, bool ignore_error)
+{
+	struct lx_rmh *rmh = lx_transaction_next(trans,
+			CMD_13_SET_STREAM_STATE, ignore_error);
+
+	if (rmh == NULL)
+		return trans->err;
+	lx_rmh_stream_set_state(rmh, pipe, is_capture, state);
+	return trans->count - 1;
+}
+
+int lx_transaction_buffer_give(struct lx_transaction *trans, u32 pipe,
+		int is_capture, u32 buffer_size, u32 buf_address_lo,
+		u32 buf_address_hi, unsigned char period_multiple_gran,
+		bool notify_eob)
+{
+	struct lx_rmh *rmh = lx_transaction_next(trans, CMD_0F_UPDATE_BUFFER,
+			false);
+
+	if (rmh == NULL)
+		return trans->err;
+	lx_rmh_buffer_give(rmh, pipe, is_capture, buffer_size,
+			buf_address_lo, buf_address_hi, period_multiple_gran,
+			notify_eob);
+	return trans->count - 1;
+}
+
+int lx_transaction_buffer_cancel(struct lx_transaction *trans, u32 pipe,
+		int is_capture, u32 buffer_index, bool ignore_error)
+{
+	struct lx_rmh *rmh = lx_transaction_next(trans, CMD_11_CANCEL_BUFFER,
+			ignore_error);
+
+	if (rmh == NULL)
+		return trans->err;
+	rmh->cmd[0] |= PIPE_INFO_TO_CMD(is_capture, pipe);
+	rmh->cmd[0] |= buffer_index;
+	return trans->count - 1;
+}
+
+/* completion callback of each command, queues the next one */
+static void lx_transaction_step(struct lx_chip *chip, struct lx_cmd_req *req)
+{
+	struct lx_transaction *trans = req->private_data;
+	unsigned int idx = req - trans->req;
+
+	if (req->status != 0 && !trans->ignore_error[idx]) {
+		trans->failed = idx;
+		trans->err = req->status;
+		goto done;
+	}
+	if (idx + 1 >= trans->count)
+		goto done;
+
+	WRITE_ONCE(trans->cur, idx + 1);
+	smp_mb();
+	if (READ_ONCE(trans->aborted)) {
+		trans->failed = idx + 1;
+		trans->err = -EIO;
+		goto done;
+	}
+	if (lx_cmd_submit(chip, &trans->req[idx + 1]) == 0)
+		return;
+	trans->failed = idx + 1;
+	trans->err = -EBUSY;
+done:
+	complete(&trans->done);
+}
+
+/* a step callback that missed aborted queues its request within a few us */
+#define LX_TRANSACTION_ABORT_ATOMIC_US	100
+
+static void lx_transaction_abort(struct lx_transaction *trans)
+{
+	struct lx_chip *chip = trans->chip;
+	bool may_sleep = lx_message_may_sleep();
+	ktime_t end = ktime_add_ms(ktime_get(), XILINX_TIMEOUT_MS);
+	int loop;
+
+	dev_err(chip->card->dev, "%s, timeout at command %d of %d\n",
+			__func__, trans->cur, trans->count);
+
+	WRITE_ONCE(trans->aborted, true);
+	smp_mb();
+
+	/* the cancelled request ends the transaction from its callback. A
+	 * callback running on another cpu may still queue the next request
+	 * before it sees aborted, cancel that one too.
+	 */
+	for (loop = LX_TRANSACTION_ABORT_ATOMIC_US; ; ) {
+		lx_cmdq_cancel(chip, &trans->req[READ_ONCE(trans->cur)],
+				-EIO);
+		if (may_sleep) {
+			if (wait_for_completion_timeout(&trans->done,
+					msecs_to_jiffies(1)))
+				return;
+			if (ktime_after(ktime_get(), end))
+				break;
+		} else {
+			if (completion_done(&trans->done))
+				return;
+			if (loop-- == 0)
+				break;
+			udelay(1);
+		}
+	}
+
+	dev_err(chip->card->dev, "%s, transaction stuck, recovering\n",
+			__func__);
+	lx_recovery_schedule(chip);
+}
+
+/* send the commands added since lx_transaction_begin(). Returns 0, or the
+ * status of the command that failed, whose index is left in trans->failed.
+ */
+int lx_transaction_commit(struct lx_transaction *trans)
+{
+	struct lx_chip *chip = trans->chip;
+	ktime_t start = ktime_get();
+	unsigned int waited_us;
+	unsigned long flags;
+	unsigned int i;
+
+	if (trans->err < 0 || trans->count == 0)
+		return trans->err;
+
+	for (i = 0; i < trans->count; i++)
+		lx_cmd_req_init(&trans->req[i], &trans->rmh[i],
+				lx_transaction_step, trans);
+	init_completion(&trans->done);
+
+	trans->err = lx_cmd_submit(chip, &trans->req[0]);
+	if (trans->err < 0)
+		return trans->err;
+
+	if (lx_message_may_sleep()) {
+		if (!wait_for_completion_timeout(&trans->done,
+			msecs_to_jiffies(trans->count * LX_CMDQ_WAIT_MS)))
+			lx_transaction_abort(trans);
+	} else {
+		/* poll each command up to its mailbox deadline, the first one
+		 * that misses it ends the transaction
+		 */
+		while (!completion_done(&trans->done)) {
+			if (!lx_cmdq_poll(chip,
+					&trans->req[READ_ONCE(trans->cur)])) {
+				lx_transaction_abort(trans);
+				break;
+			}
+			cpu_relax();
+		}
+	}
+
+	waited_us = (unsigned int)ktime_us_delta(ktime_get(), start);
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	chip->debug_irq.cmd_transactions++;
+	chip->debug_irq.cmd_transaction_cmds += trans->count;
+	chip->debug_irq.cmd_transaction_total_us += waited_us;
+	if (waited_us > chip->debug_irq.cmd_transaction_max_us)
+		chip->debug_irq.cmd_transaction_max_us = waited_us;
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+
+	if (trans->failed >= 0 &&
+	    trans->rmh[trans->failed].cmd_idx == CMD_0F_UPDATE_BUFFER)
+		lx_buffer_give_error(chip, trans->err);
+
+	return trans->err;
+}
+
+/* interrupt handling */
+#define PCX_IRQ_NONE 0
+#define IRQCS_ACTIVE_PCIDB        BIT(13)
+#define IRQCS_ENABLE_PCIIRQ       BIT(8)
+#define IRQCS_ENABLE_PCIDB        BIT(9)
+
+static u32 lx_interrupt_test_ack(struct lx_chip *chip)
+{
+	u32 irqcs = lx_plx_reg_read(chip, PLX_IRQCS);
+	int loop = 0;
+
+	/* Test if PCI Doorbell interrupt is active */
+	if (irqcs & IRQCS_ACTIVE_PCIDB) {
+		u32 temp;
+
+		irqcs = PCX_IRQ_NONE;
+
+		while ((temp = lx_plx_reg_read(chip, PLX_L2PCIDB)) &&
+				loop++ < 32) {
 			/* RAZ interrupt */
 			irqcs |= temp;
 			lx_plx_reg_write(chip, PLX_L2PCIDB, temp);
@@ -1469,268 +2623,1173 @@ static u32 lx_interrupt_test_ack(struct lx_chip *chip)
 	return PCX_IRQ_NONE;
 }
 
-int lx_interrupt_debug_events(struct lx_chip *chip)
+static void lx_interrupt_events_done(struct lx_chip *chip,
+		struct lx_cmd_req *req)
 {
-	int err;
-	u32 stat[10]; /* answer from CMD_04_GET_EVENT */
-
-	err = lx_dsp_read_async_events(chip, stat);
-	if (err < 0) {
+	if (req->status < 0)
 		dev_err(chip->card->dev,
 				"lx_dsp_read_async_events: dsp timeout\n");
-		return err;
-	}
 /*    printk(KERN_DEBUG "%s, %u %u %u %u\n",
 *	__func__, stat[1], stat[2], stat[3], stat[4] );
 */
+	atomic_set(&chip->event_req_pending, 0);
+}
+
+/* the answer is only used for debugging, so the read is queued and the
+ * trigger callbacks calling this do not wait for the mailbox
+ */
+int lx_interrupt_debug_events(struct lx_chip *chip)
+{
+	int err;
+
+	if (atomic_cmpxchg(&chip->event_req_pending, 0, 1) != 0)
+		return -EBUSY;
+
+	err = lx_message_init_rmh(chip, &chip->event_rmh, CMD_04_GET_EVENT);
+	if (err < 0)
+		goto failed;
+
+	/* we don't necessarily need the full length */
+	chip->event_rmh.stat_len = 10;
+
+	lx_cmd_req_init(&chip->event_req, &chip->event_rmh,
+			lx_interrupt_events_done, NULL);
+	err = lx_cmd_submit(chip, &chip->event_req);
+	if (err < 0)
+		goto failed;
+
+	return 0;
+
+failed:
+	atomic_set(&chip->event_req_pending, 0);
 	return err;
 }
 
-irqreturn_t lx_interrupt(int irq, void *dev_id)
+static inline void lx_irq_stat_add(struct lx_chip *chip,
+		enum lx_irq_stat stat, u64 value)
 {
-	struct lx_chip *chip = dev_id;
-	u32 irqsrc;
-	u32 audio_irq_cpt;
+	struct lx_irq_stats *stats;
 
-	chip->debug_irq.irq_all++;
-	irqsrc = lx_interrupt_test_ack(chip);
-	if (irqsrc == PCX_IRQ_NONE) {
-		chip->debug_irq.irq_none++;
-		return IRQ_NONE; /* this device did not cause the interrupt */
+	if (!static_branch_likely(&lx_irq_stats_enabled))
+		return;
+	stats = get_cpu_ptr(chip->irq_stats);
+	local64_add(value, &stats->v[stat]);
+	put_cpu_ptr(chip->irq_stats);
+}
+
+static inline void lx_irq_stat_inc(struct lx_chip *chip, enum lx_irq_stat stat)
+{
+	lx_irq_stat_add(chip, stat, 1);
+}
+
+static inline void lx_irq_hist_add(struct lx_chip *chip,
+		enum lx_irq_hist hist, u64 ns)
+{
+	struct lx_irq_stats *stats;
+	unsigned int bucket = 0;
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	if (!static_branch_likely(&lx_irq_stats_enabled))
+		return;
+	if (us > 1)
+		bucket = min_t(unsigned int, ilog2(us),
+				LX_IRQ_HIST_BUCKETS - 1);
+	stats = get_cpu_ptr(chip->irq_stats);
+	local64_add(1, &stats->hist[hist][bucket]);
+	put_cpu_ptr(chip->irq_stats);
+}
+
+static inline void lx_irq_stat_max(struct lx_chip *chip,
+		enum lx_irq_stat stat, u64 value)
+{
+	struct lx_irq_stats *stats;
+	u64 old, prev;
+
+	if (!static_branch_likely(&lx_irq_stats_enabled))
+		return;
+	stats = get_cpu_ptr(chip->irq_stats);
+	/* the hard irq may raise the maximum between the read and the set */
+	old = local64_read(&stats->v[stat]);
+	while (value > old) {
+		prev = local64_cmpxchg(&stats->v[stat], old, value);
+		if (prev == old)
+			break;
+		old = prev;
 	}
+	put_cpu_ptr(chip->irq_stats);
+}
 
-	if (irqsrc & MASK_SYS_STATUS_CMD_DONE) {
-		chip->debug_irq.irq_handled++;
-		atomic_inc(&chip->debug_irq.atomic_irq_handled);
-		if (atomic_read(&chip->message_pending) == 1)
-			atomic_set(&chip->message_pending, 0);
+/* counter of one cpu since the last reset, irq_stats_lock held */
+static u64 lx_irq_stats_cpu(struct lx_chip *chip, int cpu,
+		enum lx_irq_stat stat)
+{
+	struct lx_irq_stats *stats = per_cpu_ptr(chip->irq_stats, cpu);
+	u64 value = local64_read(&stats->v[stat]);
+
+	if (stat < LX_IRQ_STAT_SUMS)
+		value -= stats->base[stat];
+	return value;
+}
+
+/* fold the per cpu counters, the cpus keep counting while we read */
+void lx_irq_stats_snapshot(struct lx_chip *chip,
+		struct lx_irq_stats_snapshot *snap)
+{
+	struct lx_irq_stats *stats;
+	int cpu, stat, hist, bucket;
+
+	memset(snap, 0, sizeof(*snap));
+	spin_lock(&chip->irq_stats_lock);
+	for_each_possible_cpu(cpu) {
+		for (stat = 0; stat < LX_IRQ_STAT_SUMS; stat++)
+			snap->v[stat] += lx_irq_stats_cpu(chip, cpu, stat);
+		for (; stat < LX_IRQ_STAT_COUNT; stat++)
+			snap->v[stat] = max(snap->v[stat],
+					lx_irq_stats_cpu(chip, cpu, stat));
+		stats = per_cpu_ptr(chip->irq_stats, cpu);
+		for (hist = 0; hist < LX_IRQ_HIST_COUNT; hist++)
+			for (bucket = 0; bucket < LX_IRQ_HIST_BUCKETS; bucket++)
+				snap->hist[hist][bucket] +=
+					local64_read(&stats->hist[hist][bucket]) -
+					stats->hist_base[hist][bucket];
 	}
-	if (irqsrc & MASK_SYS_STATUS_URUN)
-		dev_err(chip->card->dev, "interrupt: URUN\n");
-	if (irqsrc & MASK_SYS_STATUS_ORUN)
-		dev_err(chip->card->dev, "interrupt: ORUN\n");
+	spin_unlock(&chip->irq_stats_lock);
+}
 
-	if (irqsrc & MASK_SYS_STATUS_EOBI) {
-		struct lx_stream *lx_stream = &(chip->capture_stream);
-		struct snd_pcm_substream *substream = lx_stream->stream;
-		u32 pos = lx_stream->frame_pos;
+/* sums restart from a base so the irq cpus never see a remote write to
+ * their counters, maxima are cleared in place.
+ */
+void lx_irq_stats_reset(struct lx_chip *chip)
+{
+	struct lx_irq_stats *stats;
+	int cpu, stat, hist, bucket;
+
+	spin_lock(&chip->irq_stats_lock);
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(chip->irq_stats, cpu);
+		for (stat = 0; stat < LX_IRQ_STAT_SUMS; stat++)
+			stats->base[stat] = local64_read(&stats->v[stat]);
+		for (; stat < LX_IRQ_STAT_COUNT; stat++)
+			local64_set(&stats->v[stat], 0);
+		for (hist = 0; hist < LX_IRQ_HIST_COUNT; hist++)
+			for (bucket = 0; bucket < LX_IRQ_HIST_BUCKETS; bucket++)
+				stats->hist_base[hist][bucket] =
+					local64_read(&stats->hist[hist][bucket]);
+	}
+	spin_unlock(&chip->irq_stats_lock);
+}
 
-		if (lx_stream->status == LX_STREAM_STATUS_RUNNING) {
-			pos = ((pos + 1) >= substream->runtime->periods) ?
-					0 : pos + 1;
-			lx_stream->frame_pos = pos;
-			snd_pcm_period_elapsed(substream);
-		} else {
-			chip->debug_irq.irq_record_unhandled++;
+/* mmio counters since the last reset of the Mmio proc file */
+void lx_mmio_stats_snapshot(struct lx_chip *chip, u64 *v)
+{
+	struct lx_irq_stats *stats;
+	int cpu, stat;
+
+	memset(v, 0, LX_MMIO_STATS * sizeof(*v));
+	spin_lock(&chip->irq_stats_lock);
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(chip->irq_stats, cpu);
+		for (stat = 0; stat < LX_MMIO_STATS; stat++)
+			v[stat] += local64_read(&stats->mmio[stat]) -
+					stats->mmio_base[stat];
+	}
+	spin_unlock(&chip->irq_stats_lock);
+}
+
+static void lx_mmio_stats_reset(struct lx_chip *chip)
+{
+	struct lx_irq_stats *stats;
+	int cpu, stat;
+
+	spin_lock(&chip->irq_stats_lock);
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(chip->irq_stats, cpu);
+		for (stat = 0; stat < LX_MMIO_STATS; stat++)
+			stats->mmio_base[stat] =
+					local64_read(&stats->mmio[stat]);
+	}
+	spin_unlock(&chip->irq_stats_lock);
+}
+
+/* distance of a period irq to the expected one, irq_pending_lock held.
+ * The first period since prepare is skipped, the pipe start delays it.
+ */
+static void lx_interrupt_jitter(struct lx_chip *chip,
+		struct lx_stream *lx_stream)
+{
+	s64 ns;
+
+	if (!static_branch_likely(&lx_irq_stats_enabled) ||
+			lx_stream->periods_elapsed == 0 ||
+			lx_stream->period_ns == 0)
+		return;
+
+	ns = ktime_to_ns(ktime_sub(chip->irq_time, lx_stream->period_time)) -
+			lx_stream->period_ns;
+	if (ns < 0)
+		ns = -ns;
+	if (lx_stream->is_capture) {
+		lx_irq_stat_add(chip, LX_IRQ_STAT_RECORD_JITTER_NS, ns);
+		lx_irq_stat_max(chip, LX_IRQ_STAT_RECORD_JITTER_MAX_NS, ns);
+		lx_irq_hist_add(chip, LX_IRQ_HIST_RECORD_JITTER, ns);
+	} else {
+		lx_irq_stat_add(chip, LX_IRQ_STAT_PLAY_JITTER_NS, ns);
+		lx_irq_stat_max(chip, LX_IRQ_STAT_PLAY_JITTER_MAX_NS, ns);
+		lx_irq_hist_add(chip, LX_IRQ_HIST_PLAY_JITTER, ns);
+	}
+}
+
+/* advance the period position of a running stream, irq_pending_lock held */
+static void lx_interrupt_advance(struct lx_chip *chip,
+		struct lx_stream *lx_stream, unsigned int periods)
+{
+	lx_stream->frame_pos = (lx_stream->frame_pos + periods) %
+			lx_stream->stream->runtime->periods;
+	lx_stream->periods_elapsed += periods;
+	lx_stream->period_time = chip->irq_time;
+}
+
+/* advance the granule counter expected for a stream by the periods seen
+ * since the last check and compare it with the 16 bit counter the card
+ * reported. The caller reports the period with period_elapsed.
+ * A missed irq shows up as the counter being whole periods ahead. With
+ * irq_resync the position catches up and alsa decides from the pointer
+ * whether the buffer really ran over, as long as less than a buffer was
+ * missed. Otherwise the counter is taken over and an xrun is advertised,
+ * userspace SW has to stop and restart audio.
+ */
+static void lx_interrupt_check_granules(struct lx_chip *chip,
+		struct lx_stream *lx_stream, unsigned int periods,
+		u32 audio_irq_cpt)
+{
+	unsigned int *cpt = &lx_stream->irq_audio_cpt;
+	unsigned char multiple_gran = lx_stream->period_multiple_gran;
+	unsigned int missed;
+
+	if (*cpt == (unsigned int)-1) {
+		/* first period since start */
+		*cpt = audio_irq_cpt;
+		return;
+	}
+
+	*cpt = (*cpt + periods * multiple_gran) & 0x0000ffff;
+	if (*cpt == audio_irq_cpt)
+		return;
+
+	if (irq_resync && multiple_gran &&
+			lx_stream->status == LX_STREAM_STATUS_RUNNING) {
+		missed = (audio_irq_cpt - *cpt) & 0x0000ffff;
+		if (missed % multiple_gran == 0 &&
+				missed / multiple_gran <
+				lx_stream->stream->runtime->periods) {
+			missed /= multiple_gran;
+			lx_interrupt_advance(chip, lx_stream, missed);
+			lx_irq_stat_add(chip, LX_IRQ_STAT_RESYNC, missed);
+			*cpt = audio_irq_cpt;
+			return;
 		}
 	}
 
-	if (irqsrc & MASK_SYS_STATUS_EOBO) {
-		struct lx_stream *lx_stream = &(chip->playback_stream);
-		struct snd_pcm_substream *substream = lx_stream->stream;
-		u32 pos = lx_stream->frame_pos;
+	atomic_inc(&lx_stream->xrun_advertise);
+	lx_irq_stat_inc(chip, lx_stream->is_capture ?
+			LX_IRQ_STAT_ORUN : LX_IRQ_STAT_URUN);
+	*cpt = audio_irq_cpt;
+}
 
-		if (lx_stream->status == LX_STREAM_STATUS_RUNNING) {
-			pos = ((pos + 1) >= substream->runtime->periods) ?
-					0 : pos + 1;
-			lx_stream->frame_pos = pos;
-			snd_pcm_period_elapsed(substream);
+/* called before a pipe start, the next period irq takes the counter over */
+void lx_interrupt_reset_granules(struct lx_chip *chip,
+		struct lx_stream *lx_stream)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->irq_pending_lock, flags);
+	lx_stream->irq_audio_cpt = (unsigned int)-1;
+	lx_stream->irq_timer_cpt = (unsigned int)-1;
+	spin_unlock_irqrestore(&chip->irq_pending_lock, flags);
+}
+
+/* timer tick for a moderated stream, irq_pending_lock held. The granules
+ * since the previous tick advance the position by whole periods, the rest
+ * is carried over. Returns 1 when the stream needs a period_elapsed.
+ */
+static int lx_interrupt_timer(struct lx_chip *chip,
+		struct lx_stream *lx_stream, u32 audio_irq_cpt)
+{
+	unsigned char multiple_gran = lx_stream->period_multiple_gran;
+	unsigned int *cpt = &lx_stream->irq_timer_cpt;
+	unsigned int *carry = &lx_stream->irq_timer_carry;
+	unsigned int periods;
+
+	if (!lx_stream->irq_moderated || multiple_gran == 0 ||
+			lx_stream->status != LX_STREAM_STATUS_RUNNING)
+		return 0;
+
+	if (*cpt == (unsigned int)-1) {
+		/* first tick since start */
+		*cpt = audio_irq_cpt;
+		*carry = 0;
+		return 0;
+	}
+
+	*carry += (audio_irq_cpt - *cpt) & MASK_SYS_TIMER_COUNT;
+	*cpt = audio_irq_cpt;
+	periods = *carry / multiple_gran;
+	*carry %= multiple_gran;
+	if (periods == 0)
+		return 0;
+
+	if (periods >= lx_stream->stream->runtime->periods)
+		/* a whole buffer went by, the position means nothing */
+		atomic_inc(&lx_stream->xrun_advertise);
+	else
+		lx_interrupt_advance(chip, lx_stream, periods);
+	return 1;
+}
+
+/* number of running streams of one direction, the index of the last one
+ * found is returned in *r_idx
+ */
+static unsigned int lx_interrupt_running(struct lx_chip *chip,
+		int is_capture, unsigned int *r_idx)
+{
+	unsigned int i, running = 0;
+
+	*r_idx = 0;
+	for (i = 0; i < chip->substreams; i++) {
+		if (lx_chip_stream(chip, is_capture, i)->status !=
+				LX_STREAM_STATUS_RUNNING)
+			continue;
+		*r_idx = i;
+		running++;
+	}
+	return running;
+}
+
+/* period irq with several streams of the direction running, the source
+ * does not say which one ended a period. Each stream has a period every
+ * period_multiple_gran granules from its counter reference, the counter
+ * of the irq gives the whole periods since. Streams without a reference,
+ * just started, are left to lx_interrupt_eob_events(), returns true if
+ * there are some. irq_pending_lock held.
+ */
+static bool lx_interrupt_eob_shared(struct lx_chip *chip, int is_capture,
+		u32 audio_irq_cpt, unsigned long *tick)
+{
+	struct lx_stream *lx_stream;
+	unsigned char multiple_gran;
+	unsigned int i, periods;
+	bool unknown = false;
+
+	for (i = 0; i < chip->substreams; i++) {
+		lx_stream = lx_chip_stream(chip, is_capture, i);
+		multiple_gran = lx_stream->period_multiple_gran;
+		/* the moderated ones move on the timer irq */
+		if (lx_stream->status != LX_STREAM_STATUS_RUNNING ||
+				lx_stream->irq_moderated || multiple_gran == 0)
+			continue;
+		if (lx_stream->irq_audio_cpt == (unsigned int)-1) {
+			unknown = true;
+			continue;
+		}
+
+		periods = ((audio_irq_cpt - lx_stream->irq_audio_cpt) &
+				0x0000ffff) / multiple_gran;
+		if (periods == 0)
+			continue;
+		lx_stream->irq_audio_cpt = (lx_stream->irq_audio_cpt +
+				periods * multiple_gran) & 0x0000ffff;
+
+		if (periods == 1) {
+			lx_interrupt_jitter(chip, lx_stream);
+			lx_interrupt_advance(chip, lx_stream, 1);
+		} else if (irq_resync &&
+				periods < lx_stream->stream->runtime->periods) {
+			lx_interrupt_advance(chip, lx_stream, periods);
+			lx_irq_stat_add(chip, LX_IRQ_STAT_RESYNC, periods - 1);
 		} else {
-			chip->debug_irq.irq_play_unhandled++;
+			atomic_inc(&lx_stream->xrun_advertise);
+			lx_irq_stat_inc(chip, is_capture ?
+					LX_IRQ_STAT_ORUN : LX_IRQ_STAT_URUN);
+		}
+		*tick |= BIT(i);
+	}
+	return unknown;
+}
+
+/* first period of streams started next to running ones: they have no
+ * counter reference yet for lx_interrupt_eob_shared(). The firmware keeps
+ * one bit per pipe, read them once with CMD_04 and take the counter of the
+ * irq as the reference of the streams the bits are set for.
+ * Thread context, the mailbox is taken.
+ */
+static void lx_interrupt_eob_events(struct lx_chip *chip, u32 eob_shared,
+		u32 eob_cpt)
+{
+	struct lx_stream *lx_stream;
+	unsigned long flags;
+	u64 eob[2], xrun[2];
+	u32 stat[10];
+	unsigned int i;
+	int is_capture, err;
+	bool is_xrun;
 
+	err = lx_dsp_read_async_events(chip, stat);
+	if (err) {
+		dev_err(chip->card->dev,
+				"%s: read events failed %d\n", __func__, err);
+		return;
+	}
+	eob[0] = ((u64)stat[1] << 32) | stat[2];
+	eob[1] = ((u64)stat[3] << 32) | stat[4];
+	xrun[0] = ((u64)stat[5] << 32) | stat[6];
+	xrun[1] = ((u64)stat[7] << 32) | stat[8];
+
+	for (is_capture = 0; is_capture < 2; is_capture++) {
+		if (!(eob_shared & (is_capture ? MASK_SYS_STATUS_EOBI :
+				MASK_SYS_STATUS_EOBO)))
+			continue;
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->status != LX_STREAM_STATUS_RUNNING ||
+					lx_stream->irq_moderated)
+				continue;
+			is_xrun = xrun[is_capture] & BIT_ULL(lx_stream->pipe);
+			if (!is_xrun &&
+			    !(eob[is_capture] & BIT_ULL(lx_stream->pipe)))
+				continue;
+
+			/* the hard irq may have taken it meanwhile */
+			spin_lock_irqsave(&chip->irq_pending_lock, flags);
+			if (lx_stream->irq_audio_cpt != (unsigned int)-1) {
+				spin_unlock_irqrestore(&chip->irq_pending_lock,
+						flags);
+				continue;
+			}
+			lx_stream->irq_audio_cpt = eob_cpt;
+			if (!is_xrun)
+				lx_interrupt_advance(chip, lx_stream, 1);
+			spin_unlock_irqrestore(&chip->irq_pending_lock, flags);
+
+			if (is_xrun) {
+				atomic_inc(&lx_stream->xrun_advertise);
+				lx_irq_stat_inc(chip, is_capture ?
+						LX_IRQ_STAT_ORUN :
+						LX_IRQ_STAT_URUN);
+			}
+			snd_pcm_period_elapsed(lx_stream->stream);
 		}
 	}
+}
+
+/* the sources the irq thread is woken for, the period and timer irqs
+ * are served by the hard handler alone
+ */
+#define LX_IRQ_THREAD_EVENTS	(MASK_SYS_STATUS_URUN | MASK_SYS_STATUS_ORUN)
+
+/* statistics of one hard irq, eob[] are the period irqs of running
+ * directions
+ */
+static void lx_interrupt_count(struct lx_chip *chip, u32 irqsrc,
+		const bool *eob)
+{
+	/*in order to calculate start duration*/
+	if ((eob[0] || eob[1]) && chip->jiffies_1st_irq == (unsigned long)-1)
+		chip->jiffies_1st_irq = jiffies;
+	if (eob[0] && eob[1])
+		chip->irq_duplex_seen = true;
+
+	if (!static_branch_likely(&lx_irq_stats_enabled))
+		return;
+
+	if ((irqsrc & MASK_SYS_STATUS_EOBI) && !eob[1])
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_RECORD_UNHANDLED);
+	if ((irqsrc & MASK_SYS_STATUS_EOBO) && !eob[0])
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_PLAY_UNHANDLED);
 
 	if (irqsrc & MASK_SYS_STATUS_FREQ)
-		chip->debug_irq.irq_freq++;
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_FREQ);
 	if (irqsrc & MASK_SYS_STATUS_ESA)
-		chip->debug_irq.irq_esa++;
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_ESA);
 	if (irqsrc & MASK_SYS_STATUS_TIMER)
-		chip->debug_irq.irq_timer++;
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_TIMER);
 	if (irqsrc & MASK_SYS_STATUS_EOT_PLX)
-		chip->debug_irq.irq_eot++;
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_EOT);
 	if (irqsrc & MASK_SYS_STATUS_XES)
-		chip->debug_irq.irq_xes++;
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_XES);
 	if (irqsrc & MASK_SYS_STATUS_URUN)
-		chip->debug_irq.irq_urun++;
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_URUN);
 	if (irqsrc & MASK_SYS_STATUS_ORUN)
-		chip->debug_irq.irq_orun++;
-
-	audio_irq_cpt = (irqsrc & 0x0000ffff);
-	if ((irqsrc & MASK_SYS_STATUS_EOBI) && (irqsrc & MASK_SYS_STATUS_EOBO)
-			&& (chip->capture_stream.status
-					== LX_STREAM_STATUS_RUNNING)
-			&& (chip->playback_stream.status
-					== LX_STREAM_STATUS_RUNNING)) {
-		/*in order to calculate start duration*/
-		if (chip->debug_irq.irq_play_and_record == 0)
-			chip->jiffies_1st_irq = jiffies;
-
-		chip->debug_irq.irq_play_and_record++;
-		if (chip->irq_audio_cpt_play == (unsigned int)-1) {
-			chip->irq_audio_cpt_play = audio_irq_cpt;
-		} else {
-			chip->irq_audio_cpt_play +=
-					chip->play_period_multiple_gran;
-			chip->irq_audio_cpt_play &= 0x0000ffff;
-			if (chip->irq_audio_cpt_play != audio_irq_cpt) {
-				atomic_inc(&chip->play_xrun_advertise);
-				chip->debug_irq.irq_urun++;
-				/* this is a awful stuff...
-				 * if driver miss irq today there is no way to
-				 * know how many irq had been missed so
-				 * there is no way to resync audio to IRQ...
-				 * userspace SW has to stop and restart audio
-				 */
-				chip->irq_audio_cpt_play = audio_irq_cpt;
-			}
-		}
-		if (chip->irq_audio_cpt_record == (unsigned int)-1) {
-			chip->irq_audio_cpt_record = audio_irq_cpt;
-		} else {
-			chip->irq_audio_cpt_record +=
-					chip->capture_period_multiple_gran;
-			chip->irq_audio_cpt_record &= 0x0000ffff;
-			if (chip->irq_audio_cpt_record != audio_irq_cpt) {
-				atomic_inc(&chip->capture_xrun_advertise);
-				chip->debug_irq.irq_orun++;
-				/* this is a awful stuff...
-				 * if driver miss irq today there is no way to
-				 * know how many irq had been missed so
-				 * there is no way to resync audio to IRQ...
-				 * userspace SW has to stop and restart audio
-				 */
-				chip->irq_audio_cpt_record = audio_irq_cpt;
-			}
-		}
-	} else if ((irqsrc & MASK_SYS_STATUS_EOBO) &&
-		(chip->playback_stream.status == LX_STREAM_STATUS_RUNNING)) {
-		if (chip->debug_irq.irq_play == 0)
-			chip->jiffies_1st_irq = jiffies;
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_ORUN);
+
+	if (eob[0] && eob[1]) {
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_PLAY_AND_RECORD);
+	} else if (eob[0]) {
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_PLAY);
+		if (!chip->irq_duplex_seen)
+			lx_irq_stat_inc(chip, LX_IRQ_STAT_PLAY_BEGIN);
+	} else if (eob[1]) {
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_RECORD);
+	}
+}
 
-		chip->debug_irq.irq_play++;
-		if (chip->debug_irq.irq_play_and_record == 0)
-			chip->debug_irq.irq_play_begin++;
+/*
+ * hard irq part: ack, command completion, period advance and statistics.
+ * The granule counter of the irq checks the lone running stream of a
+ * direction, and tells which streams ended a period when several run, see
+ * lx_interrupt_eob_shared(). lx_interrupt_thread() is only woken for the
+ * LX_IRQ_THREAD_EVENTS to log and for the streams that need the mailbox,
+ * several irqs may be folded into one thread run.
+ */
+irqreturn_t lx_interrupt(int irq, void *dev_id)
+{
+	struct lx_chip *chip = dev_id;
+	struct lx_irq_pending *pending = &chip->irq_pending;
+	struct lx_stream *lx_stream;
+	unsigned int running[2], idx[2];
+	unsigned long tick[2] = { 0, 0 };
+	ktime_t start;
+	bool eob[2];
+	u32 irqsrc, audio_irq_cpt, shared = 0, thread;
+	unsigned int i;
+	int is_capture;
+	u64 ns;
+
+	/* also dates the period positions for the audio timestamps */
+	start = ktime_get();
+	lx_irq_stat_inc(chip, LX_IRQ_STAT_ALL);
+	irqsrc = lx_interrupt_test_ack(chip);
+	if (irqsrc == PCX_IRQ_NONE) {
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_NONE);
+		return IRQ_NONE; /* this device did not cause the interrupt */
+	}
 
-		if (chip->irq_audio_cpt_play == (unsigned int)-1) {
-			chip->irq_audio_cpt_play = audio_irq_cpt;
-		} else {
-			chip->irq_audio_cpt_play +=
-					chip->play_period_multiple_gran;
-			chip->irq_audio_cpt_play &= 0x0000ffff;
-			if (chip->irq_audio_cpt_play != audio_irq_cpt) {
-				atomic_inc(&chip->play_xrun_advertise);
-				atomic_inc(&chip->capture_xrun_advertise);
-				/* this is a awful stuff...
-				 * if driver miss irq today there is no way to
-				 * know how many irq had been missed so
-				 * there is no way to resync audio to IRQ...
-				 * userspace SW has to stop and restart audio
-				 */
-				chip->irq_audio_cpt_play = audio_irq_cpt;
-			}
+	chip->irq_last_cpu = smp_processor_id();
+
+	if (irqsrc & MASK_SYS_STATUS_CMD_DONE) {
+		lx_irq_stat_inc(chip, LX_IRQ_STAT_CMD_DONE);
+		lx_cmdq_process(chip);
+	}
+	/* the clock config may have changed, do not serve the shadow */
+	if (irqsrc & MASK_SYS_STATUS_FREQ)
+		lx_dsp_reg_invalidate(chip, REG_MADI_RAVENNA_CLOCK_CFG);
+
+	running[0] = lx_interrupt_running(chip, 0, &idx[0]);
+	running[1] = lx_interrupt_running(chip, 1, &idx[1]);
+	eob[0] = (irqsrc & MASK_SYS_STATUS_EOBO) && running[0];
+	eob[1] = (irqsrc & MASK_SYS_STATUS_EOBI) && running[1];
+	audio_irq_cpt = irqsrc & 0x0000ffff;
+
+	spin_lock(&chip->irq_pending_lock);
+	chip->irq_time = start;
+	/* under the lock, a pipe start may reset the counters */
+	for (is_capture = 0; is_capture < 2; is_capture++) {
+		if (!eob[is_capture])
+			continue;
+		if (running[is_capture] > 1) {
+			if (lx_interrupt_eob_shared(chip, is_capture,
+					audio_irq_cpt, &tick[is_capture]))
+				shared |= is_capture ? MASK_SYS_STATUS_EOBI :
+						MASK_SYS_STATUS_EOBO;
+			continue;
 		}
-	} else if ((irqsrc & MASK_SYS_STATUS_EOBI) &&
-		(chip->capture_stream.status == LX_STREAM_STATUS_RUNNING)) {
-		if (chip->debug_irq.irq_record == 0)
-			chip->jiffies_1st_irq = jiffies;
-
-		chip->debug_irq.irq_record++;
-		if (chip->irq_audio_cpt_record == (unsigned int)-1) {
-			chip->irq_audio_cpt_record = audio_irq_cpt;
-		} else {
-			chip->irq_audio_cpt_record +=
-					chip->capture_period_multiple_gran;
-			chip->irq_audio_cpt_record &= 0x0000ffff;
-			if (chip->irq_audio_cpt_record != audio_irq_cpt) {
-				atomic_inc(&chip->capture_xrun_advertise);
-				/* this is a awful stuff...
-				 * if driver miss irq today there is no way to
-				 * know how many irq had been missed so
-				 * there is no way to resync audio to IRQ...
-				 * userspace SW has to stop and restart audio
-				 */
-				chip->irq_audio_cpt_record = audio_irq_cpt;
-			}
+		lx_stream = lx_chip_stream(chip, is_capture, idx[is_capture]);
+		lx_interrupt_jitter(chip, lx_stream);
+		lx_interrupt_advance(chip, lx_stream, 1);
+		lx_interrupt_check_granules(chip, lx_stream, 1, audio_irq_cpt);
+		tick[is_capture] |= BIT(idx[is_capture]);
+	}
+	if (irqsrc & MASK_SYS_STATUS_TIMER) {
+		atomic_inc(&chip->irq_timer_ticks);
+		for (is_capture = 0; is_capture < 2; is_capture++)
+			for (i = 0; i < chip->substreams; i++)
+				if (lx_interrupt_timer(chip,
+						lx_chip_stream(chip, is_capture, i),
+						irqsrc & MASK_SYS_TIMER_COUNT))
+					tick[is_capture] |= BIT(i);
+	}
+	thread = (irqsrc & LX_IRQ_THREAD_EVENTS) | shared;
+	if (thread) {
+		if (!pending->irqsrc && !pending->eob_shared)
+			pending->time = start;
+		pending->irqsrc |= irqsrc & LX_IRQ_THREAD_EVENTS;
+		if (shared) {
+			pending->eob_shared |= shared;
+			pending->eob_cpt = audio_irq_cpt;
 		}
 	}
+	spin_unlock(&chip->irq_pending_lock);
+
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for_each_set_bit(i, &tick[is_capture], LX_SUBSTREAMS_MAX)
+			snd_pcm_period_elapsed(
+				lx_chip_stream(chip, is_capture, i)->stream);
+
+	lx_interrupt_count(chip, irqsrc, eob);
+
+	/* hard irq residency, including the period_elapsed callbacks */
+	if (static_branch_likely(&lx_irq_stats_enabled)) {
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		lx_irq_stat_add(chip, LX_IRQ_STAT_HANDLER_NS, ns);
+		lx_irq_stat_max(chip, LX_IRQ_STAT_HANDLER_MAX_NS, ns);
+		lx_irq_hist_add(chip, LX_IRQ_HIST_HANDLER, ns);
+	}
+
+	if (!thread)
+		return IRQ_HANDLED;
+	lx_irq_stat_inc(chip, LX_IRQ_STAT_WAKEUP_THREAD);
+	return IRQ_WAKE_THREAD;
+}
+
+irqreturn_t lx_interrupt_thread(int irq, void *dev_id)
+{
+	struct lx_chip *chip = dev_id;
+	struct lx_irq_pending p;
+	ktime_t start = 0;
+	unsigned long flags;
+	u32 irqsrc;
+	u64 ns;
+
+	if (static_branch_likely(&lx_irq_stats_enabled))
+		start = ktime_get();
+	lx_irq_stat_inc(chip, LX_IRQ_STAT_THREAD);
+
+	spin_lock_irqsave(&chip->irq_pending_lock, flags);
+	p = chip->irq_pending;
+	memset(&chip->irq_pending, 0, sizeof(chip->irq_pending));
+	spin_unlock_irqrestore(&chip->irq_pending_lock, flags);
+	irqsrc = p.irqsrc;
+
+	if (p.eob_shared)
+		lx_interrupt_eob_events(chip, p.eob_shared, p.eob_cpt);
+
+	if (irqsrc & MASK_SYS_STATUS_URUN)
+		dev_err(chip->card->dev, "interrupt: URUN\n");
+	if (irqsrc & MASK_SYS_STATUS_ORUN)
+		dev_err(chip->card->dev, "interrupt: ORUN\n");
+
+	if (!static_branch_likely(&lx_irq_stats_enabled))
+		return IRQ_HANDLED;
+
+	/* an earlier run may have taken the irqs that woke us */
+	if (irqsrc || p.eob_shared) {
+		ns = ktime_to_ns(ktime_sub(start, p.time));
+		lx_irq_stat_add(chip, LX_IRQ_STAT_WAKEUP_NS, ns);
+		lx_irq_stat_max(chip, LX_IRQ_STAT_WAKEUP_MAX_NS, ns);
+		lx_irq_hist_add(chip, LX_IRQ_HIST_WAKEUP, ns);
+	}
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	lx_irq_stat_add(chip, LX_IRQ_STAT_THREAD_NS, ns);
+	lx_irq_stat_max(chip, LX_IRQ_STAT_THREAD_MAX_NS, ns);
 
 	return IRQ_HANDLED;
 }
 
+static const char * const lx_irq_stat_names[LX_IRQ_STAT_COUNT] = {
+	[LX_IRQ_STAT_ALL] =		"irq_all :",
+	[LX_IRQ_STAT_NONE] =		"irq_none :",
+	[LX_IRQ_STAT_CMD_DONE] =	"irq_cmd_done :",
+	[LX_IRQ_STAT_WAKEUP_THREAD] =	"irq_wakeup_thread :",
+	[LX_IRQ_STAT_THREAD] =		"thread_runs :",
+	[LX_IRQ_STAT_PLAY_BEGIN] =	"irq_play_begin :",
+	[LX_IRQ_STAT_PLAY] =		"irq_play :",
+	[LX_IRQ_STAT_PLAY_UNHANDLED] =	"irq_play_unhandled :",
+	[LX_IRQ_STAT_RECORD] =		"irq_record :",
+	[LX_IRQ_STAT_RECORD_UNHANDLED] = "irq_record_unhandled :",
+	[LX_IRQ_STAT_PLAY_AND_RECORD] =	"irq_play_and_record :",
+	[LX_IRQ_STAT_URUN] =		"irq_urun :",
+	[LX_IRQ_STAT_ORUN] =		"irq_orun :",
+	[LX_IRQ_STAT_RESYNC] =		"irq_resync_periods :",
+	[LX_IRQ_STAT_FREQ] =		"irq_freq :",
+	[LX_IRQ_STAT_ESA] =		"irq_esa :",
+	[LX_IRQ_STAT_TIMER] =		"irq_timer :",
+	[LX_IRQ_STAT_EOT] =		"irq_eot :",
+	[LX_IRQ_STAT_XES] =		"irq_xes :",
+	[LX_IRQ_STAT_HANDLER_NS] =	"irq_handler_total_ns :",
+	[LX_IRQ_STAT_THREAD_NS] =	"irq_thread_total_ns :",
+	[LX_IRQ_STAT_WAKEUP_NS] =	"irq_wakeup_total_ns :",
+	[LX_IRQ_STAT_PLAY_JITTER_NS] =	"irq_play_jitter_total_ns :",
+	[LX_IRQ_STAT_RECORD_JITTER_NS] = "irq_record_jitter_total_ns :",
+	[LX_IRQ_STAT_HANDLER_MAX_NS] =	"irq_handler_max_ns :",
+	[LX_IRQ_STAT_THREAD_MAX_NS] =	"irq_thread_max_ns :",
+	[LX_IRQ_STAT_WAKEUP_MAX_NS] =	"irq_wakeup_max_ns :",
+	[LX_IRQ_STAT_PLAY_JITTER_MAX_NS] = "irq_play_jitter_max_ns :",
+	[LX_IRQ_STAT_RECORD_JITTER_MAX_NS] = "irq_record_jitter_max_ns :",
+};
+
+static const char * const lx_irq_hist_names[LX_IRQ_HIST_COUNT] = {
+	[LX_IRQ_HIST_HANDLER] =		"handler :",
+	[LX_IRQ_HIST_WAKEUP] =		"wakeup :",
+	[LX_IRQ_HIST_PLAY_JITTER] =	"play_jitter :",
+	[LX_IRQ_HIST_RECORD_JITTER] =	"record_jitter :",
+};
+
 /*Debug file.*/
 /*use to check interruptions*/
 void lx_proc_get_irq_counter(struct snd_info_entry *entry,
 		struct snd_info_buffer *buffer)
 {
 	struct lx_chip *chip = entry->private_data;
+	struct lx_irq_stats_snapshot snap;
+	struct debug_irq_counters dbg;
+	u64 count[LX_IRQ_HIST_COUNT];
+	unsigned int cmd_wait_avg_us;
+	unsigned long flags;
+	u64 handled;
+	int cpu, stat, hist, bucket;
+
+	lx_irq_stats_snapshot(chip, &snap);
+	spin_lock_irqsave(&chip->cmdq_lock, flags);
+	dbg = chip->debug_irq;
+	cmd_wait_avg_us = chip->cmd_wait_avg_us;
+	spin_unlock_irqrestore(&chip->cmdq_lock, flags);
+	handled = snap.v[LX_IRQ_STAT_ALL] - snap.v[LX_IRQ_STAT_NONE];
+	for (hist = 0; hist < LX_IRQ_HIST_COUNT; hist++) {
+		count[hist] = 0;
+		for (bucket = 0; bucket < LX_IRQ_HIST_BUCKETS; bucket++)
+			count[hist] += snap.hist[hist][bucket];
+	}
+
+	snd_iprintf(buffer, "IRQ (write \"reset\" to clear, irq_stats %s) :\n",
+			READ_ONCE(irq_stats) ? "on" : "off");
+	for (stat = 0; stat < LX_IRQ_STAT_COUNT; stat++)
+		snd_iprintf(buffer, "\t%-32s%llu\n",
+				lx_irq_stat_names[stat], snap.v[stat]);
+	snd_iprintf(buffer, "\t%-32s%llu\n"
+			"\t%-32s%llu\n"
+			"\t%-32s%llu\n"
+			"\t%-32s%llu\n"
+			"\t%-32s%llu\n",
+			"irq_handler_avg_ns :", handled ?
+				div64_u64(snap.v[LX_IRQ_STAT_HANDLER_NS],
+					handled) : 0,
+			"irq_thread_avg_ns :", snap.v[LX_IRQ_STAT_THREAD] ?
+				div64_u64(snap.v[LX_IRQ_STAT_THREAD_NS],
+					snap.v[LX_IRQ_STAT_THREAD]) : 0,
+			"irq_wakeup_avg_ns :", count[LX_IRQ_HIST_WAKEUP] ?
+				div64_u64(snap.v[LX_IRQ_STAT_WAKEUP_NS],
+					count[LX_IRQ_HIST_WAKEUP]) : 0,
+			"irq_play_jitter_avg_ns :",
+				count[LX_IRQ_HIST_PLAY_JITTER] ?
+				div64_u64(snap.v[LX_IRQ_STAT_PLAY_JITTER_NS],
+					count[LX_IRQ_HIST_PLAY_JITTER]) : 0,
+			"irq_record_jitter_avg_ns :",
+				count[LX_IRQ_HIST_RECORD_JITTER] ?
+				div64_u64(snap.v[LX_IRQ_STAT_RECORD_JITTER_NS],
+					count[LX_IRQ_HIST_RECORD_JITTER]) : 0);
+
+	/* jitter is the distance of a period irq interval to the period */
+	snd_iprintf(buffer, "IRQ HISTOGRAMS (substream 0 play period %u ns, " \
+			"record period %u ns) :\n"
+			"\thistogram buckets: <2us <4us <8us ... >=32ms\n",
+			chip->playback_streams[0].period_ns,
+			chip->capture_streams[0].period_ns);
+	for (hist = 0; hist < LX_IRQ_HIST_COUNT; hist++) {
+		snd_iprintf(buffer, "\t%-16s", lx_irq_hist_names[hist]);
+		for (bucket = 0; bucket < LX_IRQ_HIST_BUCKETS; bucket++)
+			snd_iprintf(buffer, " %llu", snap.hist[hist][bucket]);
+		snd_iprintf(buffer, "\n");
+	}
 
-	snd_iprintf(buffer, "IRQ HANDLER :\n"
-			"\tirq_all :                   %d\n"
-			"\tirq_wakeup_thread :         %d\n"
-			"\tirq_play_begin :            %d\n"
-			"\tirq_play :                  %d\n"
-			"\tirq_play_unhandled :        %d\n"
-			"\tirq_record :                %d\n"
-			"\tirq_record_unhandled :      %d\n"
-			"\tirq_play_and_record :       %d\n"
-			"\tirq_none :                  %d\n"
-			"\tirq_handled :               %d\n"
-			"\tatomic_irq_handled :        %d\n"
-			"\tirq_urun :                  %d\n"
-			"\tirq_orun :                  %d\n"
-			"\tirq_freq :                  %d\n"
-			"\tirq_esa :                   %d\n"
-			"\tirq_timer :                 %d\n"
-			"\tirq_eot :                   %d\n"
-			"\tirq_xes :                   %d\n"
-			"THREAD IRQ :\n"
-			"\twakeup_thread :             %d\n"
-			"\tthread_play :               %d\n"
-			"\thread_record_but_stop :     %d\n"
-			"\tthread_record :             %d\n"
-			"\tthread_record_but_stop :    %d\n"
-			"\tthread_play_and_record :    %d\n"
-			"\tasync_event_eobi :          %llu\n"
-			"\tasync_event_eobo :          %llu\n"
-			"\tasync_urun :                %llu\n"
-			"\tasync_orun :                %llu\n"
-			"commands :\n"
+	snd_iprintf(buffer, "commands :\n"
 			"\tcmd_irq_waiting:            %d\n"
-			"MISC : \n"
+			"\tcmd_event:                  %d\n"
+			"\tcmd_event_spin:             %d\n"
+			"\tcmd_event_polled:           %d\n"
+			"\tcmd_wait_total_us:          %llu\n"
+			"\tcmd_wait_max_us:            %d\n"
+			"\tcmd_wait_avg_us:            %d\n"
+			"\tcmd_transactions:           %d\n"
+			"\tcmd_transaction_cmds:       %d\n"
+			"\tcmd_transaction_total_us:   %llu\n"
+			"\tcmd_transaction_max_us:     %d\n"
+			"recovery :\n"
+			"\trecoveries:                 %d\n"
+			"\trecovery_failed:            %d\n"
+			"\trecovery_last_us:           %d\n"
+			"\trecovery_max_us:            %d\n"
+			"stop latency :\n"
+			"\tplay_last_us:               %d\n"
+			"\tplay_max_us:                %d\n"
+			"\trecord_last_us:             %d\n"
+			"\trecord_max_us:              %d\n"
+			"MISC : \n"
 			"\tstart time :                %d\n"
 			"\tirq time :                %d\n"
 			"\tstart delay :               %d\n",
-			chip->debug_irq.irq_all,
-			chip->debug_irq.irq_wakeup_thread,
-			chip->debug_irq.irq_play_begin,
-			chip->debug_irq.irq_play,
-			chip->debug_irq.irq_play_unhandled,
-			chip->debug_irq.irq_record,
-			chip->debug_irq.irq_record_unhandled,
-			chip->debug_irq.irq_play_and_record,
-			chip->debug_irq.irq_none, chip->debug_irq.irq_handled,
-			atomic_read(&chip->debug_irq.atomic_irq_handled),
-			chip->debug_irq.irq_urun, chip->debug_irq.irq_orun,
-			chip->debug_irq.irq_freq, chip->debug_irq.irq_esa,
-			chip->debug_irq.irq_timer, chip->debug_irq.irq_eot,
-			chip->debug_irq.irq_xes, chip->debug_irq.wakeup_thread,
-			chip->debug_irq.thread_play,
-			chip->debug_irq.thread_record_but_stop,
-			chip->debug_irq.thread_record,
-			chip->debug_irq.thread_play_but_stop,
-			chip->debug_irq.thread_play_and_record,
-			chip->debug_irq.async_event_eobi,
-			chip->debug_irq.async_event_eobo,
-			chip->debug_irq.async_urun,
-			chip->debug_irq.async_event_eobo,
-			chip->debug_irq.cmd_irq_waiting,
+			dbg.cmd_irq_waiting,
+			dbg.cmd_event,
+			dbg.cmd_event_spin,
+			dbg.cmd_event_polled,
+			dbg.cmd_wait_total_us,
+			dbg.cmd_wait_max_us,
+			cmd_wait_avg_us,
+			dbg.cmd_transactions,
+			dbg.cmd_transaction_cmds,
+			dbg.cmd_transaction_total_us,
+			dbg.cmd_transaction_max_us,
+			dbg.recoveries,
+			dbg.recovery_failed,
+			dbg.recovery_last_us,
+			dbg.recovery_max_us,
+			dbg.stop_last_us[0],
+			dbg.stop_max_us[0],
+			dbg.stop_last_us[1],
+			dbg.stop_max_us[1],
 			(unsigned int)chip->jiffies_start,
 			(unsigned int)chip->jiffies_1st_irq,
 			(unsigned int)(chip->jiffies_1st_irq
 					- chip->jiffies_start));
 
+	snd_iprintf(buffer, "IRQ AFFINITY (write \"cpu N\", -1 unpins) :\n"
+			"\tirq :                       %d\n"
+			"\tpinned cpu :                %d\n"
+			"\tlast cpu :                  %d\n",
+			chip->irq, READ_ONCE(chip->irq_cpu),
+			chip->irq_last_cpu);
+	/* snd_iprintf() may sleep, only the read takes the lock */
+	for_each_possible_cpu(cpu) {
+		spin_lock(&chip->irq_stats_lock);
+		handled = lx_irq_stats_cpu(chip, cpu, LX_IRQ_STAT_ALL) -
+			lx_irq_stats_cpu(chip, cpu, LX_IRQ_STAT_NONE);
+		spin_unlock(&chip->irq_stats_lock);
+		if (handled)
+			snd_iprintf(buffer, "\tcpu%-3d :                    %llu\n",
+					cpu, handled);
+	}
+}
+
+void lx_proc_set_irq_counter(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer)
+{
+	struct lx_chip *chip = entry->private_data;
+	char line[64];
+	int cpu, err;
+
+	while (!snd_info_get_line(buffer, line, sizeof(line))) {
+		if (!strncmp(line, "reset", 5)) {
+			lx_irq_stats_reset(chip);
+			continue;
+		}
+		if (sscanf(line, "cpu %d", &cpu) != 1)
+			continue;
+		err = lx_irq_set_cpu(chip, cpu);
+		if (err < 0)
+			dev_err(chip->card->dev,
+				"%s, irq affinity to cpu %d failed (%d)\n",
+				__func__, cpu, err);
+	}
+}
+
+/* pin the card interrupt, and so its irq thread, on one cpu. -1 drops the
+ * hint and leaves the interrupt to irqbalance.
+ */
+int lx_irq_set_cpu(struct lx_chip *chip, int cpu)
+{
+	const struct cpumask *mask = NULL;
+	int err;
+
+	if (chip->irq < 0)
+		return -ENODEV;
+	if (cpu >= (int)nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu)))
+		return -EINVAL;
+	if (cpu >= 0)
+		mask = cpumask_of(cpu);
+	else
+		cpu = -1;
+
+#if KERNEL_VERSION(5, 17, 0) <= LINUX_VERSION_CODE
+	err = irq_set_affinity_and_hint(chip->irq, mask);
+#else
+	err = irq_set_affinity_hint(chip->irq, mask);
+#endif
+	if (err < 0)
+		return err;
+	WRITE_ONCE(chip->irq_cpu, cpu);
+	return 0;
+}
+
+/* apply indexcpu once the interrupt is requested, a missing cpu is not fatal */
+void lx_irq_affinity_init(struct lx_chip *chip)
+{
+	int cpu = -1;
+	int err;
+
+	chip->irq_cpu = -1;
+	if (chip->lx_chip_index < SNDRV_CARDS)
+		cpu = indexcpu[chip->lx_chip_index];
+	if (cpu < 0)
+		return;
+
+	err = lx_irq_set_cpu(chip, cpu);
+	if (err < 0)
+		dev_err(chip->card->dev,
+			"%s, irq affinity to cpu %d failed (%d), left to irqbalance\n",
+			__func__, cpu, err);
+}
+
+/* the hint must be gone before free_irq() */
+void lx_irq_affinity_release(struct lx_chip *chip)
+{
+	if (chip->irq >= 0 && chip->irq_cpu >= 0)
+		lx_irq_set_cpu(chip, -1);
+}
+/* on-card benchmark of the command path, see lx_bench_run() */
+static int lx_bench_sys_cfg_event(struct lx_chip *chip)
+{
+	struct lx_rmh rmh;
+	int ret;
+
+	ret = lx_message_init_rmh(chip, &rmh, CMD_01_GET_SYS_CFG);
+	if (ret < 0)
+		return ret;
+	return lx_message_send_atomic_generic(chip, &rmh,
+			ATOMIC_RESPONSE_BY_EVENT);
+}
+
+static int lx_bench_sys_cfg_polling(struct lx_chip *chip)
+{
+	struct lx_rmh rmh;
+	int ret;
+
+	ret = lx_message_init_rmh(chip, &rmh, CMD_01_GET_SYS_CFG);
+	if (ret < 0)
+		return ret;
+	return lx_message_send_atomic_generic(chip, &rmh,
+			ATOMIC_RESPONSE_BY_POLLING);
 }
+
+static int lx_bench_pipe_state(struct lx_chip *chip)
+{
+	u16 state;
+
+	return lx_pipe_state(chip, chip->first_channel_selector, 0, &state);
+}
+
+static int lx_bench_level_peaks(struct lx_chip *chip)
+{
+	u32 levels[MICROBLAZE_CHANNELS_MAX];
+
+	return lx_level_peaks(chip, 0, MICROBLAZE_CHANNELS_MAX, levels);
+}
+
+static const struct {
+	const char *name;
+	int (*run)(struct lx_chip *chip);
+} lx_bench_ops[LX_BENCH_OPS] = {
+	{ "get_sys_cfg (event)", lx_bench_sys_cfg_event },
+	{ "get_sys_cfg (polling)", lx_bench_sys_cfg_polling },
+	{ "pipe_state", lx_bench_pipe_state },
+	{ "level_peaks 64ch", lx_bench_level_peaks },
+};
+
+static void lx_mmio_count(struct lx_chip *chip, unsigned long *reads,
+		unsigned long *writes)
+{
+	u64 v[LX_MMIO_STATS];
+	int port;
+
+	lx_mmio_stats_snapshot(chip, v);
+	*reads = 0;
+	*writes = 0;
+	for (port = 0; port < REG_MAX_PORT; port++) {
+		*reads += v[LX_MMIO_DSP_READS(port)];
+		*writes += v[LX_MMIO_DSP_WRITES(port)];
+	}
+	for (port = 0; port < PLX_MAX_PORT; port++) {
+		*reads += v[LX_MMIO_PLX_READS(port)];
+		*writes += v[LX_MMIO_PLX_WRITES(port)];
+	}
+}
+
+/* run every benchmark operation count times, process context only.
+ * The card must be idle, interrupts of running streams would show in the
+ * mmio counts.
+ */
+static void lx_bench_run(struct lx_chip *chip, unsigned int count)
+{
+	struct lx_bench_result *result;
+	unsigned long reads, writes;
+	ktime_t start, op_start;
+	u64 ns;
+	unsigned int i;
+	int op;
+	int err;
+
+	for (op = 0; op < LX_BENCH_OPS; op++) {
+		result = &chip->bench[op];
+		memset(result, 0, sizeof(*result));
+
+		lx_mmio_count(chip, &reads, &writes);
+		result->mmio_reads = reads;
+		result->mmio_writes = writes;
+
+		start = ktime_get();
+		for (i = 0; i < count; i++) {
+			op_start = ktime_get();
+			err = lx_bench_ops[op].run(chip);
+			ns = ktime_to_ns(ktime_sub(ktime_get(), op_start));
+			if (err != 0)
+				result->errors++;
+			if (ns > result->max_ns)
+				result->max_ns = ns;
+			result->runs++;
+		}
+		result->total_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		lx_mmio_count(chip, &reads, &writes);
+		result->mmio_reads = reads - result->mmio_reads;
+		result->mmio_writes = writes - result->mmio_writes;
+	}
+}
+
+static void lx_bench_print(struct lx_chip *chip,
+		struct snd_info_buffer *buffer)
+{
+	struct lx_bench_result *result;
+	int op;
+
+	for (op = 0; op < LX_BENCH_OPS; op++) {
+		result = &chip->bench[op];
+		if (result->runs == 0)
+			continue;
+		snd_iprintf(buffer, "bench %s:\n"
+			"\truns:         %u\n"
+			"\terrors:       %u\n"
+			"\tops_per_s:    %llu\n"
+			"\tavg_us:       %llu\n"
+			"\tmax_us:       %llu\n"
+			"\tmmio_reads:   %lu.%02lu per op\n"
+			"\tmmio_writes:  %lu.%02lu per op\n",
+			lx_bench_ops[op].name, result->runs, result->errors,
+			result->total_ns ?
+				div64_u64((u64)result->runs * NSEC_PER_SEC,
+					result->total_ns) : 0,
+			div_u64(div_u64(result->total_ns, result->runs),
+				NSEC_PER_USEC),
+			div_u64(result->max_ns, NSEC_PER_USEC),
+			result->mmio_reads / result->runs,
+			(result->mmio_reads * 100 / result->runs) % 100,
+			result->mmio_writes / result->runs,
+			(result->mmio_writes * 100 / result->runs) % 100);
+	}
+}
+
+void lx_proc_get_cmd_stats(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer)
+{
+	struct lx_chip *chip = entry->private_data;
+	static const char * const response_names[] = { "event", "polling" };
+	struct lx_cmd_stats stats;
+	unsigned long flags;
+	int idx, response, bucket;
+
+	snd_iprintf(buffer, "commands (write \"reset\" to clear, " \
+			"\"inject_timeout N\" to drop the next N commands, " \
+			"\"recover\" to reset the DSP, " \
+			"\"bench N\" to time N runs of each test command):\n"
+			"histogram buckets: <2us <4us <8us ... >=32ms\n");
+
+	for (idx = 0; idx < CMD_INVALID; idx++) {
+		for (response = 0; response < LX_CMD_STATS_RESPONSES;
+		     response++) {
+			spin_lock_irqsave(&chip->cmd_stats_lock, flags);
+			stats = chip->cmd_stats[idx][response];
+			spin_unlock_irqrestore(&chip->cmd_stats_lock, flags);
+
+			if (stats.count == 0)
+				continue;
+
+			if (dsp_commands[idx].dcOpName)
+				snd_iprintf(buffer, "%s", dsp_commands[idx].dcOpName);
+			else
+				snd_iprintf(buffer, "CMD_%02X", idx);
+			snd_iprintf(buffer, " (%s):\n"
+				"\tcount:    %u\n"
+				"\ttimeouts: %u\n"
+				"\tmin_us:   %llu\n"
+				"\tavg_us:   %llu\n"
+				"\tmax_us:   %llu\n"
+				"\thist:    ",
+				response_names[response],
+				stats.count, stats.timeouts,
+				div_u64(stats.min_ns, NSEC_PER_USEC),
+				div_u64(div_u64(stats.total_ns, stats.count),
+					NSEC_PER_USEC),
+				div_u64(stats.max_ns, NSEC_PER_USEC));
+			for (bucket = 0; bucket < LX_CMD_STATS_BUCKETS; bucket++)
+				snd_iprintf(buffer, " %u", stats.hist[bucket]);
+			snd_iprintf(buffer, "\n");
+		}
+	}
+
+	lx_bench_print(chip, buffer);
+}
+
+void lx_proc_set_cmd_stats(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer)
+{
+	struct lx_chip *chip = entry->private_data;
+	char line[64];
+	unsigned int count;
+
+	while (!snd_info_get_line(buffer, line, sizeof(line))) {
+		if (!strncmp(line, "reset", 5))
+			lx_cmd_stats_reset(chip);
+		else if (sscanf(line, "inject_timeout %u", &count) == 1)
+			atomic_set(&chip->cmdq_inject_timeouts, count);
+		else if (!strncmp(line, "recover", 7))
+			lx_recovery_schedule(chip);
+		else if (sscanf(line, "bench %u", &count) == 1)
+			lx_bench_run(chip, min_t(unsigned int, count,
+					LX_BENCH_RUNS_MAX));
+	}
+}
+
+void lx_proc_get_mmio_stats(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer)
+{
+	struct lx_chip *chip = entry->private_data;
+	u64 v[LX_MMIO_STATS];
+	int port;
+
+	if (!static_branch_likely(&lx_irq_stats_enabled))
+		snd_iprintf(buffer, "irq_stats is off, the counts are frozen\n");
+	lx_mmio_stats_snapshot(chip, v);
+	snd_iprintf(buffer, "mmio (write \"reset\" to clear):\n"
+			"\tshadow_hits:       %llu\n"
+			"\tcsm_reads_saved:   %llu\n"
+			"dsp port : reads writes\n",
+			v[LX_MMIO_SHADOW_HITS], v[LX_MMIO_CSM_READS_SAVED]);
+	for (port = 0; port < REG_MAX_PORT; port++) {
+		if (v[LX_MMIO_DSP_READS(port)] || v[LX_MMIO_DSP_WRITES(port)])
+			snd_iprintf(buffer, "\t0x%03lx : %llu %llu\n",
+					dsp_port_offsets[port],
+					v[LX_MMIO_DSP_READS(port)],
+					v[LX_MMIO_DSP_WRITES(port)]);
+	}
+	snd_iprintf(buffer, "plx port : reads writes\n");
+	for (port = 0; port < PLX_MAX_PORT; port++) {
+		if (v[LX_MMIO_PLX_READS(port)] || v[LX_MMIO_PLX_WRITES(port)])
+			snd_iprintf(buffer, "\t0x%02lx : %llu %llu\n",
+					plx_port_offsets[port],
+					v[LX_MMIO_PLX_READS(port)],
+					v[LX_MMIO_PLX_WRITES(port)]);
+	}
+}
+
+void lx_proc_set_mmio_stats(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer)
+{
+	struct lx_chip *chip = entry->private_data;
+	char line[64];
+
+	while (!snd_info_get_line(buffer, line, sizeof(line))) {
+		if (!strncmp(line, "reset", 5))
+			lx_mmio_stats_reset(chip);
+	}
+}
+
 static void lx_irq_set(struct lx_chip *chip, bool enable)
 {
 	u32 reg = lx_plx_reg_read(chip, PLX_IRQCS);
@@ -22,6 +22,9 @@
 #define LX_CORE_H
 
 #include <linux/interrupt.h>
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
 #include <sound/info.h>
 
 #include "lx_defs.h"
@@ -35,6 +38,8 @@
 #define REG_CRM_NUMBER                12
 
 struct lx_chip;
+struct lx_stream;
+struct lx_irq_stats_snapshot;
 
 /* low-level register access */
 
@@ -102,6 +107,25 @@ enum {
 unsigned int lx_plx_reg_read(struct lx_chip *chip, int port);
 void lx_plx_reg_write(struct lx_chip *chip, int port, u32 data);
 
+/* register shadows, see lx_dsp_reg_update(). The mmio counters are kept
+ * per cpu with the irq statistics, indexed as below.
+ */
+#define LX_MMIO_DSP_READS(port)		(port)
+#define LX_MMIO_DSP_WRITES(port)	(REG_MAX_PORT + (port))
+#define LX_MMIO_PLX_READS(port)		(2 * REG_MAX_PORT + (port))
+#define LX_MMIO_PLX_WRITES(port)	\
+		(2 * REG_MAX_PORT + PLX_MAX_PORT + (port))
+/* reads avoided by a shadow */
+#define LX_MMIO_SHADOW_HITS		(2 * REG_MAX_PORT + 2 * PLX_MAX_PORT)
+/* mailbox known to be free */
+#define LX_MMIO_CSM_READS_SAVED		(LX_MMIO_SHADOW_HITS + 1)
+#define LX_MMIO_STATS			(LX_MMIO_CSM_READS_SAVED + 1)
+
+void lx_mmio_init(struct lx_chip *chip);
+void lx_mmio_stats_snapshot(struct lx_chip *chip, u64 *v);
+void lx_dsp_reg_update(struct lx_chip *chip, int port, u32 mask, u32 value);
+void lx_dsp_reg_invalidate(struct lx_chip *chip, int port);
+
 /* rhm */
 struct lx_rmh {
 	u16 cmd_len; /* length of the command to send (WORDs) */
@@ -112,11 +136,96 @@ struct lx_rmh {
 	u32 stat[REG_CRM_NUMBER];
 };
 
+/* command queue */
+enum lx_cmd_prio {
+	LX_CMD_PRIO_TRANSPORT = 0,	/* pipe/stream/buffer handling */
+	LX_CMD_PRIO_CONTROL,		/* configuration, state queries */
+	LX_CMD_PRIO_STATUS,		/* metering and monitoring */
+	LX_CMD_PRIO_COUNT,
+};
+
+enum lx_cmd_state {
+	LX_CMD_QUEUED,
+	LX_CMD_ACTIVE,
+	LX_CMD_DONE,
+};
+
+struct lx_cmd_req;
+typedef void (*lx_cmd_callback_t)(struct lx_chip *chip,
+		struct lx_cmd_req *req);
+
+struct lx_cmd_req {
+	struct list_head list;
+	struct lx_rmh *rmh;	/* command in, status out */
+	enum lx_cmd_prio prio;
+	enum lx_cmd_state state;
+	int status;		/* same values as lx_message_send_atomic */
+	unsigned long deadline;	/* jiffies, while on the mailbox */
+	lx_cmd_callback_t callback;	/* NULL: synchronous, see done */
+	void *private_data;
+	struct completion done;
+};
+
+void lx_cmdq_init(struct lx_chip *chip);
+void lx_cmdq_flush(struct lx_chip *chip);
+void lx_cmd_req_init(struct lx_cmd_req *req, struct lx_rmh *rmh,
+		lx_cmd_callback_t callback, void *private_data);
+int lx_cmd_submit(struct lx_chip *chip, struct lx_cmd_req *req);
+int lx_message_init_rmh(struct lx_chip *chip, struct lx_rmh *rmh,
+		enum cmd_mb_opcodes cmd);
+
+/* per command latency statistics, see lx_proc_get_cmd_stats() */
+#define LX_CMD_STATS_BUCKETS	16	/* log2(us): <2us ... >=32ms */
+#define LX_CMD_STATS_RESPONSES	2	/* by event, by polling */
+
+struct lx_cmd_stats {
+	u32 count;
+	u32 timeouts;
+	u64 min_ns;
+	u64 max_ns;
+	u64 total_ns;
+	u32 hist[LX_CMD_STATS_BUCKETS];
+};
+
+void lx_cmd_stats_reset(struct lx_chip *chip);
+
+/* command path benchmark, "bench N" in the Commands proc file */
+#define LX_BENCH_OPS		4
+#define LX_BENCH_RUNS_MAX	10000
+
+struct lx_bench_result {
+	unsigned int runs;
+	unsigned int errors;
+	u64 total_ns;
+	u64 max_ns;
+	unsigned long mmio_reads;	/* over all runs */
+	unsigned long mmio_writes;
+};
+
+/* command transactions, see lx_transaction_begin() */
+#define LX_TRANSACTION_MAX	8
+
+struct lx_transaction {
+	struct lx_chip *chip;
+	unsigned int count;	/* commands added */
+	unsigned int cur;	/* command on its way */
+	int failed;		/* index of the failing command or -1 */
+	int err;
+	bool aborted;
+	unsigned char ignore_error[LX_TRANSACTION_MAX];
+	struct lx_rmh rmh[LX_TRANSACTION_MAX];
+	struct lx_cmd_req req[LX_TRANSACTION_MAX];
+	struct completion done;
+};
+
 /* low-level dsp access */
 int lx_message_send_atomic(struct lx_chip *chip, struct lx_rmh *rmh);
 int lx_dsp_get_version(struct lx_chip *chip, u32 *rdsp_version);
 int lx_dsp_get_clock_frequency(struct lx_chip *chip, u32 *rfreq);
 int lx_dsp_set_granularity(struct lx_chip *chip, u32 gran);
+int lx_dsp_set_timer_irq(struct lx_chip *chip, u32 granules);
+int lx_irq_moderation_set(struct lx_chip *chip, struct lx_stream *lx_stream,
+		struct snd_pcm_runtime *runtime);
 int lx_dsp_read_async_events(struct lx_chip *chip, u32 *data);
 int lx_dsp_get_mac(struct lx_chip *chip);
 
@@ -133,14 +242,21 @@ int lx_pipe_stop_single(struct lx_chip *chip, u32 pipe, int is_capture);
 int lx_pipe_start_single(struct lx_chip *chip, u32 pipe, int is_capture);
 int lx_pipe_pause_single(struct lx_chip *chip, u32 pipe, int is_capture);
 
-int lx_pipe_start_multiple(struct lx_chip *chip);
-int lx_pipe_pause_multiple(struct lx_chip *chip);
+/* masks of pipes, bit n for pipe n */
+int lx_pipe_start_multiple(struct lx_chip *chip, u64 play_mask,
+		u64 record_mask);
+int lx_pipe_pause_multiple(struct lx_chip *chip, u64 play_mask,
+		u64 record_mask);
 
 int lx_pipe_start_pause_play_and_record_dual(struct lx_chip *master_chip,
 		struct lx_chip *slave_chip);
 
+int lx_pipe_wait_for_state(struct lx_chip *chip, u32 pipe, int is_capture,
+		u16 state, unsigned int *rwait_us);
 int lx_pipe_wait_for_start(struct lx_chip *chip, u32 pipe, int is_capture);
 int lx_pipe_wait_for_idle(struct lx_chip *chip, u32 pipe, int is_capture);
+int lx_stream_wait_for_state(struct lx_chip *chip, u32 pipe, int is_capture,
+		u16 state, unsigned int *rwait_us);
 int lx_stream_wait_for_start(struct lx_chip *chip, u32 pipe, int is_capture);
 int lx_stream_wait_for_idle(struct lx_chip *chip, u32 pipe, int is_capture);
 
@@ -150,9 +266,14 @@ int lx_stream_def(struct lx_chip *chip, struct snd_pcm_runtime *runtime,
 
 int lx_stream_sample_position(struct lx_chip *chip, u32 pipe, int is_capture,
 		u64 *r_bytepos);
+int lx_stream_sample_count(struct lx_chip *chip, u32 pipe, int is_capture,
+		unsigned int frame_bytes, u64 *r_count, ktime_t *r_time,
+		u64 *r_round_trip_ns);
 
 int lx_stream_set_state(struct lx_chip *chip, u32 pipe, int is_capture,
 		enum stream_state_t state);
+int lx_stream_state(struct lx_chip *chip, u32 pipe, int is_capture,
+		int *rstate);
 
 int lx_madi_set_madi_state(struct lx_chip *chip);
 
@@ -184,6 +305,30 @@ int lx_buffer_give(struct lx_chip *chip, u32 pipe, int is_capture,
 int lx_buffer_cancel(struct lx_chip *chip, u32 pipe, int is_capture,
 		u32 buffer_index);
 
+/* command transactions: the transaction lives in the chip and
+ * lx_transaction_begin() holds msg_lock until lx_transaction_end().
+ * The add functions return the command index or a negative error.
+ */
+struct lx_transaction *lx_transaction_begin(struct lx_chip *chip);
+void lx_transaction_end(struct lx_transaction *trans);
+int lx_transaction_commit(struct lx_transaction *trans);
+int lx_transaction_pipe_allocate(struct lx_transaction *trans, u32 pipe,
+		int is_capture, int channels);
+int lx_transaction_pipe_stop(struct lx_transaction *trans, u32 pipe,
+		int is_capture, bool ignore_error);
+int lx_transaction_pipe_release(struct lx_transaction *trans, u32 pipe,
+		int is_capture);
+int lx_transaction_stream_def(struct lx_transaction *trans,
+		struct snd_pcm_runtime *runtime, u32 pipe, int is_capture);
+int lx_transaction_stream_set_state(struct lx_transaction *trans, u32 pipe,
+		int is_capture, enum stream_state_t state, bool ignore_error);
+int lx_transaction_buffer_give(struct lx_transaction *trans, u32 pipe,
+		int is_capture, u32 buffer_size, u32 buf_address_lo,
+		u32 buf_address_hi, unsigned char period_multiple_gran,
+		bool notify_eob);
+int lx_transaction_buffer_cancel(struct lx_transaction *trans, u32 pipe,
+		int is_capture, u32 buffer_index, bool ignore_error);
+
 /* low-level gain/peak handling */
 int lx_level_unmute(struct lx_chip *chip, int is_capture, int unmute);
 int lx_level_peaks(struct lx_chip *chip, int is_capture, int channels,
@@ -191,6 +336,15 @@ int lx_level_peaks(struct lx_chip *chip, int is_capture, int channels,
 
 /* interrupt handling */
 irqreturn_t lx_interrupt(int irq, void *dev_id);
+irqreturn_t lx_interrupt_thread(int irq, void *dev_id);
+void lx_interrupt_reset_granules(struct lx_chip *chip,
+		struct lx_stream *lx_stream);
+int lx_irq_set_cpu(struct lx_chip *chip, int cpu);
+void lx_irq_stats_snapshot(struct lx_chip *chip,
+		struct lx_irq_stats_snapshot *snap);
+void lx_irq_stats_reset(struct lx_chip *chip);
+void lx_irq_affinity_init(struct lx_chip *chip);
+void lx_irq_affinity_release(struct lx_chip *chip);
 
 void lx_irq_enable(struct lx_chip *chip);
 void lx_irq_disable(struct lx_chip *chip);
@@ -198,8 +352,20 @@ void lx_irq_disable(struct lx_chip *chip);
 /* debug */
 void lx_proc_get_irq_counter(struct snd_info_entry *entry,
 		struct snd_info_buffer *buffer);
+void lx_proc_get_cmd_stats(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer);
+void lx_proc_get_mmio_stats(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer);
+void lx_proc_set_irq_counter(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer);
+void lx_proc_set_mmio_stats(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer);
+void lx_proc_set_cmd_stats(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer);
 
-/* Stream Format Header Defines (for LIN and IEEE754) */
+/* Stream Format Header Defines (for LIN and IEEE754)
+ * not used by CMD_0C_DEF_STREAM, see STREAM_FMT_OFFSET
+ */
 #define HEADER_FMT_BASE         HEADER_FMT_BASE_LIN
 #define HEADER_FMT_BASE_LIN     0xFED00000
 #define HEADER_FMT_BASE_FLOAT   0xFAD00000
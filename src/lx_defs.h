@@ -216,6 +216,11 @@ enum stream_flags {
 
 #define STREAM_FMT_16b     0x02
 #define STREAM_FMT_intel   0x01
+/* two bits only, bit 12 is MASK_STREAM_HAS_MAPPING: the lx firmware takes
+ * linear samples, there is no encoding for the IEEE754 streams of the
+ * HEADER_FMT_BASE_FLOAT headers, and CMD_01_GET_SYS_CFG reports no such
+ * feature. Float samples are converted by lx_pcm_copy_generic().
+ */
 /* offset of the freq field in the response word */
 #define FREQ_FIELD_OFFSET  15
 /*  offset of the buffer flags in the response word. */
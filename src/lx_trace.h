@@ -0,0 +1,154 @@
+/*
+  * ALSA driver for the digigram lx audio interface
+  *
+  * Copyright (c) 2016 by Digigram / Jubier Sylvain <alsa@digigram.com>
+  *
+  *   This program is free software; you can redistribute it and/or modify
+  *   it under the terms of the GNU General Public License as published by
+  *   the Free Software Foundation; either version 2 of the License, or
+  *   (at your option) any later version.
+  *
+  *   This program is distributed in the hope that it will be useful,
+  *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+  *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  *   GNU General Public License for more details.
+  *
+  *   You should have received a copy of the GNU General Public License
+  *   along with this program; if not, write to the Free Software
+  *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+  */
+
+/* mailbox command tracepoints, see lx_message_send_atomic_generic() */
+
+/* one system per module, see the Makefile */
+#undef TRACE_SYSTEM
+#ifdef LX_TRACE_SYSTEM
+#define TRACE_SYSTEM LX_TRACE_SYSTEM
+#else
+#define TRACE_SYSTEM snd_lx
+#endif
+
+#if !defined(LX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LX_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "lx_defs.h"
+
+/* object field of the first command word, see PIPE_INFO_TO_CMD */
+#define LX_TRACE_OBJECT(cmd0)	(((cmd0) >> ID_OFFSET) & 0x7FF)
+
+#define LX_TRACE_OPCODES					\
+	{ CMD_00_INFO_DEBUG,		"INFO_DEBUG" },		\
+	{ CMD_01_GET_SYS_CFG,		"GET_SYS_CFG" },	\
+	{ CMD_02_SET_GRANULARITY,	"SET_GRANULARITY" },	\
+	{ CMD_03_SET_TIMER_IRQ,		"SET_TIMER_IRQ" },	\
+	{ CMD_04_GET_EVENT,		"GET_EVENT" },		\
+	{ CMD_05_GET_PIPES,		"GET_PIPES" },		\
+	{ CMD_06_ALLOCATE_PIPE,		"ALLOCATE_PIPE" },	\
+	{ CMD_07_RELEASE_PIPE,		"RELEASE_PIPE" },	\
+	{ CMD_08_ASK_BUFFERS,		"ASK_BUFFERS" },	\
+	{ CMD_09_STOP_PIPE,		"STOP_PIPE" },		\
+	{ CMD_0A_GET_PIPE_SPL_COUNT,	"GET_PIPE_SPL_COUNT" },	\
+	{ CMD_0B_TOGGLE_PIPE_STATE,	"TOGGLE_PIPE_STATE" },	\
+	{ CMD_0C_DEF_STREAM,		"DEF_STREAM" },		\
+	{ CMD_0D_SET_MUTE,		"SET_MUTE" },		\
+	{ CMD_0E_GET_STREAM_SPL_COUNT,	"GET_STREAM_SPL_COUNT" }, \
+	{ CMD_0F_UPDATE_BUFFER,		"UPDATE_BUFFER" },	\
+	{ CMD_10_GET_BUFFER,		"GET_BUFFER" },		\
+	{ CMD_11_CANCEL_BUFFER,		"CANCEL_BUFFER" },	\
+	{ CMD_12_GET_PEAK,		"GET_PEAK" },		\
+	{ CMD_13_SET_STREAM_STATE,	"SET_STREAM_STATE" },	\
+	{ CMD_14_GET_MADI_STATE,	"GET_MADI_STATE" },	\
+	{ CMD_15_SET_MADI_STATE,	"SET_MADI_STATE" }
+
+/* ATOMIC_RESPONSE_BY_EVENT, ATOMIC_RESPONSE_BY_POLLING */
+#define LX_TRACE_RESPONSES	{ 0, "event" }, { 1, "polling" }
+
+#define LX_TRACE_CLASSES						\
+	{ E_CLASS_GENERAL,			"general" },		\
+	{ E_CLASS_INVALID_CMD,			"invalid_cmd" },	\
+	{ E_CLASS_INVALID_STD_OBJECT,		"invalid_object" },	\
+	{ E_CLASS_RSRC_IMPOSSIBLE,		"rsrc_impossible" },	\
+	{ E_CLASS_WRONG_CONTEXT,		"wrong_context" },	\
+	{ E_CLASS_BAD_SPECIFIC_PARAMETER,	"bad_parameter" },	\
+	{ E_CLASS_REAL_TIME_ERROR,		"real_time" },		\
+	{ E_CLASS_DIRECTSHOW,			"directshow" }
+
+TRACE_EVENT(lx_cmd_send,
+	TP_PROTO(int card, u16 opcode, u32 cmd0, unsigned char response),
+	TP_ARGS(card, opcode, cmd0, response),
+
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(u16, opcode)
+		__field(u16, object)
+		__field(unsigned char, response)
+	),
+
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->opcode = opcode;
+		__entry->object = LX_TRACE_OBJECT(cmd0);
+		__entry->response = response;
+	),
+
+	TP_printk("card=%d cmd=%s pipe=%u%s response=%s",
+		__entry->card,
+		__print_symbolic(__entry->opcode, LX_TRACE_OPCODES),
+		__entry->object & ID_CH_MASK,
+		(__entry->object & ID_IS_CAPTURE) ? " capture" : "",
+		__print_symbolic(__entry->response, LX_TRACE_RESPONSES))
+);
+
+/* status is the value lx_message_send_atomic_generic() returns: 0, a
+ * negative errno or the firmware error word, whose class is decoded
+ */
+TRACE_EVENT(lx_cmd_done,
+	TP_PROTO(int card, u16 opcode, u32 cmd0, unsigned char response,
+		u64 duration_ns, int status),
+	TP_ARGS(card, opcode, cmd0, response, duration_ns, status),
+
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(u16, opcode)
+		__field(u16, object)
+		__field(unsigned char, response)
+		__field(u64, duration_ns)
+		__field(int, status)
+		__field(u16, error_class)
+	),
+
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->opcode = opcode;
+		__entry->object = LX_TRACE_OBJECT(cmd0);
+		__entry->response = response;
+		__entry->duration_ns = duration_ns;
+		__entry->status = status;
+		__entry->error_class = status > 0 ? status & CLASS_MASK : 0;
+	),
+
+	TP_printk("card=%d cmd=%s pipe=%u%s response=%s duration_ns=%llu " \
+		  "status=%d (0x%x) class=%s",
+		__entry->card,
+		__print_symbolic(__entry->opcode, LX_TRACE_OPCODES),
+		__entry->object & ID_CH_MASK,
+		(__entry->object & ID_IS_CAPTURE) ? " capture" : "",
+		__print_symbolic(__entry->response, LX_TRACE_RESPONSES),
+		(unsigned long long)__entry->duration_ns,
+		__entry->status, __entry->status,
+		__entry->status > 0 ?
+			__print_symbolic(__entry->error_class,
+					LX_TRACE_CLASSES) :
+			(__entry->status < 0 ? "errno" : "none"))
+);
+
+#endif /* LX_TRACE_H */
+
+/* this part must be outside the protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lx_trace
+#include <trace/define_trace.h>
@@ -19,14 +19,19 @@
   */
 
 //#include <linux/printk.h>
+#include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/delay.h>
 #include <linux/list.h>
 #include <linux/version.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
 
 #include <sound/core.h>
 #include <sound/pcm.h>
+#include <sound/pcm_params.h>
 #include <sound/control.h>
+#include <sound/tlv.h>
 
 #include "lxcommon.h"
 #include "lxmadi.h"
@@ -76,6 +81,26 @@ int snd_first_channel_selector_iobox_put(struct snd_kcontrol *kcontrol,
 	return 1;
 }
 
+static unsigned int substreams = 1;
+module_param(substreams, uint, 0444);
+MODULE_PARM_DESC(substreams,
+	"Substreams per direction, each on its own pipe (1-8).");
+
+/* channels of a substream, the ones from the 1st channel on are shared out
+ * between the substreams of a direction
+ */
+static unsigned int lx_substream_channels(struct lx_chip *chip)
+{
+	return (chip->max_channels - chip->first_channel_selector) /
+			chip->substreams;
+}
+
+/* a pipe is named after its first channel */
+static unsigned int lx_substream_pipe(struct lx_chip *chip, unsigned int idx)
+{
+	return chip->first_channel_selector + idx * lx_substream_channels(chip);
+}
+
 int lx_set_granularity(struct lx_chip *chip, u32 gran)
 {
 	int err = 0;
@@ -114,7 +139,8 @@ int lx_set_granularity(struct lx_chip *chip, u32 gran)
 	return err;
 }
 
-int lx_pipe_open(struct lx_chip *chip, int is_capture, int channels)
+int lx_pipe_open(struct lx_chip *chip, struct lx_stream *lx_stream,
+		int channels)
 {
 	int err = 0;
 /*        printk(KERN_DEBUG "\t%s, allocating pipe for %d channels\n",
@@ -122,7 +148,8 @@ int lx_pipe_open(struct lx_chip *chip, int is_capture, int channels)
 *                        channels);
 */
 
-	err = lx_pipe_allocate(chip, chip->first_channel_selector, is_capture, channels);
+	err = lx_pipe_allocate(chip, lx_stream->pipe, lx_stream->is_capture,
+			channels);
 	if (err < 0) {
 		dev_err(chip->card->dev, "allocating pipe failed\n");
 		return err;
@@ -136,40 +163,42 @@ int lx_stream_create_and_start(struct lx_chip *chip,
 	int err = 0;
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	int is_capture = (substream->stream == SNDRV_PCM_STREAM_CAPTURE);
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
 
 /*        printk(KERN_DEBUG  "\t%s is_capture : %d\n", __func__, is_capture); */
 	/* setting stream format */
-	err = lx_stream_def(chip, runtime, chip->first_channel_selector, is_capture);
+	err = lx_stream_def(chip, runtime, lx_stream->pipe, is_capture);
 	if (err < 0) {
 		dev_err(chip->card->dev,
 			"%s : setting lx stream format failed\n",
 			__func__);
 		return err;
 	}
-	err = lx_stream_start(chip, chip->first_channel_selector, is_capture);
+	err = lx_stream_start(chip, lx_stream->pipe, is_capture);
 	if (err < 0) {
 		dev_err(chip->card->dev,
 			"%s, couldn't start lxstream\n",
 			__func__);
 	}
-	chip->hardware_running[is_capture]++;
+	lx_stream->hardware_running++;
 
 	return err;
 }
 
-int lx_pipe_stop(struct lx_chip *chip, int is_capture)
+int lx_pipe_stop(struct lx_chip *chip, struct lx_stream *lx_stream)
 {
 	int err = 0;
         /*printk(KERN_DEBUG  "\t%s\n", __func__);*/
 
-	err = lx_pipe_wait_for_idle(chip, chip->first_channel_selector, is_capture);
+	err = lx_pipe_wait_for_idle(chip, lx_stream->pipe,
+			lx_stream->is_capture);
 	if (err < 0) {
 		dev_err(chip->card->dev,
 			"%s, waiting for pipe failed\n", __func__);
 		return err;
 	}
 
-	err = lx_pipe_stop_single(chip, chip->first_channel_selector, is_capture);
+	err = lx_pipe_stop_single(chip, lx_stream->pipe, lx_stream->is_capture);
 	if (err < 0) {
 		dev_err(chip->card->dev,
 			"%s, stopping pipe failed\n", __func__);
@@ -178,12 +207,13 @@ int lx_pipe_stop(struct lx_chip *chip, int is_capture)
 	return err;
 }
 
-int lx_pipe_close(struct lx_chip *chip, int is_capture)
+int lx_pipe_close(struct lx_chip *chip, struct lx_stream *lx_stream)
 {
 	int err = 0;
         /*printk(KERN_DEBUG  "\t%s\n", __func__);*/
 
-	err = lx_pipe_wait_for_idle(chip, chip->first_channel_selector, is_capture);
+	err = lx_pipe_wait_for_idle(chip, lx_stream->pipe,
+			lx_stream->is_capture);
 	if (err < 0) {
 		dev_err(chip->card->dev,
 			"%s, lx_pipe_wait_for_idle failed\n", __func__);
@@ -197,7 +227,7 @@ int lx_pipe_close(struct lx_chip *chip, int is_capture)
 //		return err;
 //	}
 
-	err = lx_pipe_release(chip, chip->first_channel_selector, is_capture);
+	err = lx_pipe_release(chip, lx_stream->pipe, lx_stream->is_capture);
 	if (err < 0) {
 		dev_err(chip->card->dev,
 			"%s, releasing pipe failed\n", __func__);
@@ -206,10 +236,132 @@ int lx_pipe_close(struct lx_chip *chip, int is_capture)
 	return err;
 }
 
+/* wait for the pipe to be idle, then stop it if asked and release it with
+ * a single transaction
+ */
+int lx_pipe_stop_and_close(struct lx_chip *chip, struct lx_stream *lx_stream,
+		int stop)
+{
+	struct lx_transaction *trans;
+	int stop_idx = -1;
+	int err;
+
+	err = lx_pipe_wait_for_idle(chip, lx_stream->pipe,
+			lx_stream->is_capture);
+	if (err < 0) {
+		dev_err(chip->card->dev,
+			"%s, waiting for pipe failed\n", __func__);
+	}
+
+	trans = lx_transaction_begin(chip);
+	if (stop && err == 0)
+		stop_idx = lx_transaction_pipe_stop(trans,
+				lx_stream->pipe, lx_stream->is_capture, true);
+	lx_transaction_pipe_release(trans, lx_stream->pipe,
+			lx_stream->is_capture);
+	err = lx_transaction_commit(trans);
+	if (stop_idx >= 0 && trans->req[stop_idx].status != 0)
+		dev_err(chip->card->dev,
+			"%s, stopping pipe failed\n", __func__);
+	lx_transaction_end(trans);
+
+	if (err != 0) {
+		dev_err(chip->card->dev,
+			"%s, releasing pipe failed\n", __func__);
+		if (err > 0)
+			err = -EIO;
+	}
+
+	return err;
+}
+
+#if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+/* the dma ring holds interleaved samples in the formats of the card, the
+ * other formats and the non interleaved access go through the copy
+ * callbacks and cannot be mmapped
+ */
+static const snd_pcm_format_t lx_hw_formats_native[] = {
+	SNDRV_PCM_FORMAT_S16_LE,
+	SNDRV_PCM_FORMAT_S16_BE,
+	SNDRV_PCM_FORMAT_S24_3LE,
+	SNDRV_PCM_FORMAT_S24_3BE,
+};
+
+static bool lx_hw_format_native(const struct snd_mask *format)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(lx_hw_formats_native); i++)
+		if (snd_mask_test(format,
+				(__force unsigned int)lx_hw_formats_native[i]))
+			return true;
+	return false;
+}
+
+static int lx_hw_rule_access(struct snd_pcm_hw_params *params,
+		struct snd_pcm_hw_rule *rule)
+{
+	struct snd_mask *access = hw_param_mask(params,
+			SNDRV_PCM_HW_PARAM_ACCESS);
+	struct snd_mask rw;
+
+	if (lx_hw_format_native(hw_param_mask(params,
+			SNDRV_PCM_HW_PARAM_FORMAT)))
+		return 0;
+	snd_mask_none(&rw);
+	snd_mask_set(&rw, (__force unsigned int)SNDRV_PCM_ACCESS_RW_INTERLEAVED);
+	snd_mask_set(&rw,
+			(__force unsigned int)SNDRV_PCM_ACCESS_RW_NONINTERLEAVED);
+	return snd_mask_refine(access, &rw);
+}
+
+static int lx_hw_rule_format(struct snd_pcm_hw_params *params,
+		struct snd_pcm_hw_rule *rule)
+{
+	struct snd_mask *access = hw_param_mask(params,
+			SNDRV_PCM_HW_PARAM_ACCESS);
+	struct snd_mask *format = hw_param_mask(params,
+			SNDRV_PCM_HW_PARAM_FORMAT);
+	struct snd_mask native;
+	unsigned int i;
+
+	if (snd_mask_test(access,
+			(__force unsigned int)SNDRV_PCM_ACCESS_RW_INTERLEAVED) ||
+	    snd_mask_test(access,
+			(__force unsigned int)SNDRV_PCM_ACCESS_RW_NONINTERLEAVED))
+		return 0;
+	snd_mask_none(&native);
+	for (i = 0; i < ARRAY_SIZE(lx_hw_formats_native); i++)
+		snd_mask_set(&native,
+				(__force unsigned int)lx_hw_formats_native[i]);
+	return snd_mask_refine(format, &native);
+}
+
+static int lx_hw_constraint_copy(struct snd_pcm_runtime *runtime)
+{
+	int err;
+
+	/* the ring is interleaved */
+	err = snd_pcm_hw_constraint_mask(runtime, SNDRV_PCM_HW_PARAM_ACCESS,
+			~(1U << (__force int)SNDRV_PCM_ACCESS_MMAP_NONINTERLEAVED));
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_ACCESS,
+			lx_hw_rule_access, NULL,
+			SNDRV_PCM_HW_PARAM_FORMAT, -1);
+	if (err < 0)
+		return err;
+	return snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_FORMAT,
+			lx_hw_rule_format, NULL,
+			SNDRV_PCM_HW_PARAM_ACCESS, -1);
+}
+#endif
+
 int lx_pcm_open(struct snd_pcm_substream *substream)
 {
 	struct lx_chip *chip = snd_pcm_substream_chip(substream);
 	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
 	int err = 0;
 	int board_rate;
 
@@ -221,9 +373,20 @@ int lx_pcm_open(struct snd_pcm_substream *substream)
 
 	/* copy the struct snd_pcm_hardware struct */
 	runtime->hw = chip->pcm_hw;
+	if (chip->substreams > 1) {
+		runtime->hw.channels_max = min(runtime->hw.channels_max,
+				lx_substream_channels(chip));
+		if (runtime->hw.channels_max < runtime->hw.channels_min) {
+			err = -EBUSY;
+			goto exit;
+		}
+	}
+	if (lx_stream->hardware_running == 0)
+		lx_stream->pipe = lx_substream_pipe(chip, substream->number);
 
 	chip->jiffies_start = -1;
 	chip->jiffies_1st_irq = -1;
+	chip->irq_duplex_seen = false;
 
 	switch (chip->lx_type) {
 	case LX_ETHERSOUND:
@@ -279,6 +442,15 @@ int lx_pcm_open(struct snd_pcm_substream *substream)
 		err = -ENODEV;
 		goto exit;
 	}
+#if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+	err = lx_hw_constraint_copy(runtime);
+	if (err < 0) {
+		dev_err(chip->card->dev,
+			"%s, could not constrain the mmap formats\n",
+			__func__);
+		goto exit;
+	}
+#endif
 	snd_pcm_set_sync(substream);
 	if (err > 0)
 		err = 0;
@@ -289,58 +461,33 @@ exit:
 	return err;
 }
 
-static void lx_trigger_stream_stop(struct lx_chip *chip,
-		unsigned int is_capture)
-{
-	int err;
-/*        printk(KERN_DEBUG  "%s\n", __func__);*/
-
-	err = lx_stream_stop(chip, chip->first_channel_selector, is_capture);
-	if (err < 0) {
-		dev_err(chip->card->dev, LXP "couldn't stop pipe\n");
-	} else {
-		if (is_capture == 0)
-			chip->playback_stream.status = LX_STREAM_STATUS_STOPPED;
-		else
-			chip->capture_stream.status = LX_STREAM_STATUS_STOPPED;
-	}
-}
-
 int lx_pcm_close(struct snd_pcm_substream *substream)
 {
 	int err = 0;
-	int is_capture = (substream->stream == SNDRV_PCM_STREAM_CAPTURE);
 	struct lx_chip *chip = snd_pcm_substream_chip(substream);
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
 
         printk(KERN_DEBUG  "%s is_capture : %d chip -> %p\n",
                         __func__,
                         (substream->stream == SNDRV_PCM_STREAM_CAPTURE),
                         chip);
 
+	mutex_lock(&chip->setup_mutex);
 
-	if (chip->hardware_running[is_capture] > 1) {
-		err = lx_pipe_stop(chip, is_capture);
-		if (err < 0) {
-			dev_err(chip->card->dev,
-			"%s, failed to stop hardware. Error code %d\n",
-			__func__, err);
-		}
-		chip->hardware_running[is_capture] = 1;
-	}
-	if (chip->hardware_running[is_capture] == 1) {
-		err = lx_pipe_close(chip, is_capture);
+	if (lx_stream->hardware_running > 0) {
+		err = lx_pipe_stop_and_close(chip, lx_stream,
+				lx_stream->hardware_running > 1);
 		if (err < 0) {
 			dev_err(chip->card->dev,
 			"%s failed to close hardware. Error code %d\n",
 			__func__, err);
 		}
-		chip->hardware_running[is_capture] = 0;
+		lx_stream->hardware_running = 0;
 	}
 
-	if (is_capture)
-		chip->capture_stream.stream = NULL;
-	else
-		chip->playback_stream.stream = NULL;
+	lx_stream->stream = NULL;
+
+	mutex_unlock(&chip->setup_mutex);
 
 	/*        printk(KERN_DEBUG  "%s is_capture : %d end\n",
 	*                        __func__,
@@ -350,34 +497,626 @@ int lx_pcm_close(struct snd_pcm_substream *substream)
 	return err;
 }
 
+static bool pointer_interpolate = true;
+module_param(pointer_interpolate, bool, 0644);
+MODULE_PARM_DESC(pointer_interpolate,
+	"Report the position between period irqs at the dma granularity.");
+
+/* frames a running stream moved since the irq at period_time, at the dma
+ * granularity and short of what the next irq covers, a period or a
+ * moderation tick, so that the pointer never goes back when the irq comes.
+ */
+static u64 lx_stream_interpolate(struct lx_chip *chip,
+		struct lx_stream *lx_stream, struct snd_pcm_runtime *runtime,
+		ktime_t period_time, ktime_t now)
+{
+	snd_pcm_uframes_t window;
+	unsigned int tick;
+	u64 frames;
+	s64 ns;
+
+	/* the timer ticks at the shortest interval any stream asked for */
+	window = runtime->period_size;
+	tick = READ_ONCE(chip->irq_timer_gran);
+	if (lx_stream->irq_moderated && tick)
+		window = max_t(snd_pcm_uframes_t, window,
+				min_t(snd_pcm_uframes_t,
+					(snd_pcm_uframes_t)tick *
+					chip->pcm_granularity,
+					runtime->buffer_size / 2));
+
+	if (!pointer_interpolate || chip->pcm_granularity == 0 ||
+			lx_stream->status != LX_STREAM_STATUS_RUNNING ||
+			window <= chip->pcm_granularity)
+		return 0;
+
+	ns = ktime_to_ns(ktime_sub(now, period_time));
+	if (ns <= 0)
+		return 0;
+	frames = div_u64((u64)ns * runtime->rate, NSEC_PER_SEC);
+	frames = div_u64(frames, chip->pcm_granularity) *
+			chip->pcm_granularity;
+	return min_t(u64, frames, window - chip->pcm_granularity);
+}
+
+/* position of a running stream: the last period plus the frames the time
+ * since its irq stands for.
+ */
+static snd_pcm_uframes_t lx_stream_position(struct lx_chip *chip,
+		struct lx_stream *lx_stream, struct snd_pcm_runtime *runtime)
+{
+	snd_pcm_uframes_t frame_pos;
+	ktime_t period_time;
+	unsigned long flags;
+	u64 frames;
+
+	/* frame_pos and period_time change together in the irq */
+	spin_lock_irqsave(&chip->irq_pending_lock, flags);
+	frame_pos = lx_stream->frame_pos;
+	period_time = lx_stream->period_time;
+	spin_unlock_irqrestore(&chip->irq_pending_lock, flags);
+
+	frame_pos *= runtime->period_size;
+	frames = lx_stream_interpolate(chip, lx_stream, runtime, period_time,
+			ktime_get());
+	return (frame_pos + frames) % runtime->buffer_size;
+}
+
 snd_pcm_uframes_t lx_pcm_stream_pointer(struct snd_pcm_substream *substream)
 {
 	struct lx_chip *chip = snd_pcm_substream_chip(substream);
 	snd_pcm_uframes_t pos;
-	int is_capture = (substream->stream == SNDRV_PCM_STREAM_CAPTURE);
 	int xrun = 0;
-	struct lx_stream *lx_stream = is_capture ?
-			&chip->capture_stream : &chip->playback_stream;
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
 
 	/* printk(KERN_DEBUG  "%s\n", __func__); */
-	if (is_capture == 0) {
-		xrun = atomic_read(&chip->play_xrun_advertise);
-		atomic_set(&chip->play_xrun_advertise, 0);
-	} else {
-		xrun = atomic_read(&chip->capture_xrun_advertise);
-		atomic_set(&chip->capture_xrun_advertise, 0);
-	}
+	xrun = atomic_read(&lx_stream->xrun_advertise);
+	atomic_set(&lx_stream->xrun_advertise, 0);
 	if (xrun != 0) {
 		pos = SNDRV_PCM_POS_XRUN;
 		dev_err(chip->card->dev,
 			"%s advertise XRUN to userspace\n",
 			__func__);
 	} else {
-		pos = lx_stream->frame_pos * substream->runtime->period_size;
+		pos = lx_stream_position(chip, lx_stream, substream->runtime);
 	}
 	return pos;
 }
 
+/* link absolute timestamps
+ * The sample counter of the firmware, CMD_0E, is a mailbox round trip that
+ * get_time_info cannot wait for under the stream lock. A delayed work reads
+ * it for the running streams every tstamp_period_ms while somebody asked
+ * for accurate timestamps during the last LX_TSTAMP_IDLE_MS, and keeps the
+ * count with the time it was read at. get_time_info reports the last of
+ * these, or the period irq count until there is one.
+ */
+#define LX_TSTAMP_IDLE_MS	2000
+
+static bool tstamp_accurate;
+module_param(tstamp_accurate, bool, 0644);
+MODULE_PARM_DESC(tstamp_accurate,
+	"Read the sample counter of the card for link absolute timestamps.");
+
+static unsigned int tstamp_period_ms = 20;
+module_param(tstamp_period_ms, uint, 0644);
+MODULE_PARM_DESC(tstamp_period_ms,
+	"Sample counter reading period in ms for accurate timestamps.");
+
+static void lx_tstamp_kick(struct lx_chip *chip, unsigned long delay)
+{
+	int cpu = READ_ONCE(chip->irq_cpu);
+
+	if (cpu >= 0 && cpu_online(cpu))
+		schedule_delayed_work_on(cpu, &chip->tstamp_work, delay);
+	else
+		schedule_delayed_work(&chip->tstamp_work, delay);
+}
+
+static void lx_tstamp_sample(struct lx_chip *chip,
+		struct lx_stream *lx_stream)
+{
+	struct snd_pcm_runtime *runtime = lx_stream->stream->runtime;
+	unsigned long flags;
+	u64 round_trip_ns;
+	ktime_t time;
+	u64 frames;
+
+	if (lx_stream_sample_count(chip, lx_stream->pipe,
+			lx_stream->is_capture, runtime->channels *
+			lx_ring_sample_bytes(runtime->format),
+			&frames, &time, &round_trip_ns) != 0)
+		return;
+
+	spin_lock_irqsave(&chip->irq_pending_lock, flags);
+	lx_stream->hw_frames = frames;
+	lx_stream->hw_time = time;
+	lx_stream->hw_accuracy_ns = min_t(u64, round_trip_ns / 2, U32_MAX);
+	spin_unlock_irqrestore(&chip->irq_pending_lock, flags);
+}
+
+static void lx_tstamp_work(struct work_struct *work)
+{
+	struct lx_chip *chip = container_of(to_delayed_work(work),
+			struct lx_chip, tstamp_work);
+	unsigned long idle = msecs_to_jiffies(LX_TSTAMP_IDLE_MS);
+	struct lx_stream *lx_stream;
+	unsigned int i;
+	int is_capture;
+
+	if (!tstamp_accurate || tstamp_period_ms == 0 ||
+	    time_after(jiffies, READ_ONCE(chip->tstamp_last_read) + idle)) {
+		atomic_set(&chip->tstamp_active, 0);
+		smp_mb();
+		/* a reader may have come by before active was cleared */
+		if (!tstamp_accurate || tstamp_period_ms == 0 ||
+		    time_after(jiffies,
+				READ_ONCE(chip->tstamp_last_read) + idle) ||
+		    atomic_xchg(&chip->tstamp_active, 1))
+			return;
+	}
+
+	/* against close and prepare, which reset the sample */
+	mutex_lock(&chip->setup_mutex);
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->status == LX_STREAM_STATUS_RUNNING &&
+			    lx_stream->stream && lx_stream->stream->runtime)
+				lx_tstamp_sample(chip, lx_stream);
+		}
+	mutex_unlock(&chip->setup_mutex);
+
+	lx_tstamp_kick(chip, msecs_to_jiffies(tstamp_period_ms));
+}
+
+void lx_tstamp_init(struct lx_chip *chip)
+{
+	atomic_set(&chip->tstamp_active, 0);
+	INIT_DELAYED_WORK(&chip->tstamp_work, lx_tstamp_work);
+}
+
+void lx_tstamp_stop(struct lx_chip *chip)
+{
+	atomic_set(&chip->tstamp_active, 1);	/* no more kicks */
+	cancel_delayed_work_sync(&chip->tstamp_work);
+}
+
+#if KERNEL_VERSION(4, 1, 0) <= LINUX_VERSION_CODE
+/* link timestamps: the frames the card moved since prepare and the system
+ * time they stand for. By default they come from the last period irq, the
+ * absolute type with tstamp_accurate takes the last count read from the
+ * firmware, see lx_tstamp_work().
+ */
+int lx_pcm_get_time_info(struct snd_pcm_substream *substream,
+		struct lx_timespec *system_ts, struct lx_timespec *audio_ts,
+		struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+		struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct lx_chip *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
+	u32 accuracy_ns = 0;
+	unsigned long flags;
+	ktime_t time;
+	u64 frames;
+	u32 rem;
+	s64 ns;
+
+	switch (audio_tstamp_config->type_requested) {
+	case SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_ABSOLUTE:
+		if (tstamp_accurate) {
+			WRITE_ONCE(chip->tstamp_last_read, jiffies);
+			if (tstamp_period_ms &&
+			    !atomic_xchg(&chip->tstamp_active, 1))
+				lx_tstamp_kick(chip, 0);
+
+			spin_lock_irqsave(&chip->irq_pending_lock, flags);
+			frames = lx_stream->hw_frames;
+			time = lx_stream->hw_time;
+			accuracy_ns = lx_stream->hw_accuracy_ns;
+			spin_unlock_irqrestore(&chip->irq_pending_lock, flags);
+			if (ktime_to_ns(time) != 0) {
+				audio_tstamp_report->actual_type =
+				    SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_ABSOLUTE;
+				break;
+			}
+			accuracy_ns = 0;
+		}
+		/* fall through */
+	case SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK:
+		/* the count and its time change together in the irq */
+		spin_lock_irqsave(&chip->irq_pending_lock, flags);
+		frames = lx_stream->periods_elapsed;
+		time = lx_stream->period_time;
+		spin_unlock_irqrestore(&chip->irq_pending_lock, flags);
+		frames *= runtime->period_size;
+		audio_tstamp_report->actual_type =
+				SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+		break;
+	default:
+		audio_tstamp_report->actual_type =
+				SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	/* date the count on the clock the runtime uses */
+	snd_pcm_gettime(runtime, system_ts);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), time));
+	*system_ts = lx_ns_to_timespec(lx_timespec_to_ns(system_ts) - ns);
+
+	ns = div_u64_rem(frames, runtime->rate, &rem) * NSEC_PER_SEC;
+	ns += div_u64((u64)rem * NSEC_PER_SEC, runtime->rate);
+	*audio_ts = lx_ns_to_timespec(ns);
+
+	if (accuracy_ns) {
+		audio_tstamp_report->accuracy_report = 1;
+		audio_tstamp_report->accuracy = accuracy_ns;
+	}
+	return 0;
+}
+#endif
+
+#if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+/*
+ * copy callbacks: the card plays and records 16 bit or packed 24 bit
+ * interleaved samples, the ring in dma_area keeps that layout whatever the
+ * format and access of the application. S32_LE, S24_LE and FLOAT_LE
+ * samples and the non interleaved buffers are converted here rather than
+ * by the plug layer of alsa-lib. Integer only, the float samples are converted from their
+ * bits so that the fpu state is never touched.
+ */
+#define LX_COPY_CHUNK	64	/* samples through the bounce buffer */
+
+enum lx_copy_fmt {
+	LX_COPY_NATIVE,		/* the ring format, S16 or S24_3 */
+	LX_COPY_S32,
+	LX_COPY_S24,		/* 24 bit in the low bytes of 32 */
+	LX_COPY_FLOAT,
+};
+
+static enum lx_copy_fmt lx_copy_fmt(snd_pcm_format_t format)
+{
+	if (format == SNDRV_PCM_FORMAT_S32_LE)
+		return LX_COPY_S32;
+	if (format == SNDRV_PCM_FORMAT_S24_LE)
+		return LX_COPY_S24;
+	if (format == SNDRV_PCM_FORMAT_FLOAT_LE)
+		return LX_COPY_FLOAT;
+	return LX_COPY_NATIVE;
+}
+
+static inline u32 lx_s32_to_s24(u32 v)
+{
+	return v >> 8;
+}
+
+static inline u32 lx_s24_to_s24(u32 v)
+{
+	return v;
+}
+
+/* rounded to the nearest and clipped, +1.0 and above give the max */
+static inline u32 lx_float_to_s24(u32 f)
+{
+	const int exp = (f >> 23) & 0xff;
+	unsigned int shift;
+	u32 v;
+
+	if (exp < 127 - 24)
+		return 0;	/* below half a step */
+	if (exp >= 127) {
+		v = 0x800000;	/* 1.0 and above, inf and nan too */
+	} else {
+		shift = 127 - exp;
+		v = (((f & 0x7fffff) | 0x800000) + (1U << (shift - 1))) >>
+				shift;
+	}
+	if (f & 0x80000000)
+		return -v;
+	return min_t(u32, v, 0x7fffff);
+}
+
+static inline u32 lx_s24_to_s32(u32 v)
+{
+	return v << 8;
+}
+
+static inline u32 lx_s24_to_s24_sext(u32 v)
+{
+	return (u32)((s32)(v << 8) >> 8);
+}
+
+/* exact, a 24 bit value fits the mantissa */
+static inline u32 lx_s24_to_float(u32 v)
+{
+	u32 sign = (v & 0x800000) << 8;
+	u32 mag;
+	int bit;
+
+	mag = sign ? (0x1000000 - (v & 0xffffff)) : (v & 0xffffff);
+	if (mag == 0)
+		return 0;
+	bit = fls(mag) - 1;
+	return sign | ((u32)(bit - 23 + 127) << 23) |
+			((mag << (23 - bit)) & 0x7fffff);
+}
+
+/* the converted formats go to a 24 bit ring, stride is 3 for the
+ * interleaved one. 4 samples then fill 3 words, the
+ * first samples go one by one until the ring is word aligned
+ */
+static __always_inline void lx_ring_pack(u8 *ring, unsigned int stride,
+		const u32 *src, unsigned int n, u32 (*conv)(u32))
+{
+	__le32 *w;
+	u32 a, b, c, d;
+
+	if (stride == 3) {
+		for (; n && !IS_ALIGNED((unsigned long)ring, 4);
+				n--, src++, ring += 3) {
+			a = conv(*src);
+			ring[0] = a;
+			ring[1] = a >> 8;
+			ring[2] = a >> 16;
+		}
+		w = (__le32 *)ring;
+		for (; n >= 4; n -= 4, src += 4, w += 3) {
+			a = conv(src[0]) & 0xffffff;
+			b = conv(src[1]) & 0xffffff;
+			c = conv(src[2]) & 0xffffff;
+			d = conv(src[3]);
+			w[0] = cpu_to_le32(a | b << 24);
+			w[1] = cpu_to_le32(b >> 8 | c << 16);
+			w[2] = cpu_to_le32(c >> 16 | d << 8);
+		}
+		ring = (u8 *)w;
+	}
+	for (; n; n--, src++, ring += stride) {
+		a = conv(*src);
+		ring[0] = a;
+		ring[1] = a >> 8;
+		ring[2] = a >> 16;
+	}
+}
+
+static __always_inline void lx_ring_unpack(u32 *dst, const u8 *ring,
+		unsigned int stride, unsigned int n, u32 (*conv)(u32))
+{
+	const __le32 *w;
+	u32 w0, w1, w2;
+
+	if (stride == 3) {
+		for (; n && !IS_ALIGNED((unsigned long)ring, 4);
+				n--, dst++, ring += 3)
+			*dst = conv(ring[0] | ring[1] << 8 | ring[2] << 16);
+		w = (const __le32 *)ring;
+		for (; n >= 4; n -= 4, dst += 4, w += 3) {
+			w0 = le32_to_cpu(w[0]);
+			w1 = le32_to_cpu(w[1]);
+			w2 = le32_to_cpu(w[2]);
+			dst[0] = conv(w0 & 0xffffff);
+			dst[1] = conv(w0 >> 24 | (w1 & 0xffff) << 8);
+			dst[2] = conv(w1 >> 16 | (w2 & 0xff) << 16);
+			dst[3] = conv(w2 >> 8);
+		}
+		ring = (const u8 *)w;
+	}
+	for (; n; n--, dst++, ring += stride)
+		*dst = conv(ring[0] | ring[1] << 8 | ring[2] << 16);
+}
+
+static void lx_ring_write(u8 *ring, unsigned int stride, const void *src,
+		unsigned int n, enum lx_copy_fmt fmt, unsigned int ring_bytes)
+{
+	const u8 *s = src;
+
+	switch (fmt) {
+	case LX_COPY_S32:
+		lx_ring_pack(ring, stride, src, n, lx_s32_to_s24);
+		break;
+	case LX_COPY_S24:
+		lx_ring_pack(ring, stride, src, n, lx_s24_to_s24);
+		break;
+	case LX_COPY_FLOAT:
+		lx_ring_pack(ring, stride, src, n, lx_float_to_s24);
+		break;
+	case LX_COPY_NATIVE:
+		for (; n; n--, s += ring_bytes, ring += stride)
+			memcpy(ring, s, ring_bytes);
+		break;
+	}
+}
+
+static void lx_ring_read(void *dst, const u8 *ring, unsigned int stride,
+		unsigned int n, enum lx_copy_fmt fmt, unsigned int ring_bytes)
+{
+	u8 *d = dst;
+
+	switch (fmt) {
+	case LX_COPY_S32:
+		lx_ring_unpack(dst, ring, stride, n, lx_s24_to_s32);
+		break;
+	case LX_COPY_S24:
+		lx_ring_unpack(dst, ring, stride, n, lx_s24_to_s24_sext);
+		break;
+	case LX_COPY_FLOAT:
+		lx_ring_unpack(dst, ring, stride, n, lx_s24_to_float);
+		break;
+	case LX_COPY_NATIVE:
+		for (; n; n--, d += ring_bytes, ring += stride)
+			memcpy(d, ring, ring_bytes);
+		break;
+	}
+}
+
+/* ring address of the sample at the byte position alsa gives in the format
+ * of the application, the position is in the buffer of one channel when
+ * the access is non interleaved
+ */
+static u8 *lx_ring_addr(struct snd_pcm_runtime *runtime, int channel,
+		unsigned long pos, unsigned int *stride)
+{
+	const unsigned int ring_bytes = lx_ring_sample_bytes(runtime->format);
+	unsigned long sample = pos /
+			(snd_pcm_format_physical_width(runtime->format) / 8);
+
+	if (runtime->access == SNDRV_PCM_ACCESS_RW_NONINTERLEAVED) {
+		*stride = runtime->channels * ring_bytes;
+		return runtime->dma_area +
+			(sample * runtime->channels + channel) * ring_bytes;
+	}
+	*stride = ring_bytes;
+	return runtime->dma_area + sample * ring_bytes;
+}
+
+/* moves bytes between the buffer of the application and a kernel one, in
+ * the direction of the stream, and advances in the application buffer
+ */
+struct lx_copy_io {
+	int (*move)(struct lx_copy_io *io, void *buf, unsigned long bytes);
+	int is_capture;
+	union {
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+		struct iov_iter *iter;
+#else
+		void __user *ubuf;
+		void *kbuf;
+#endif
+	};
+};
+
+static int lx_pcm_copy_generic(struct snd_pcm_substream *substream,
+		int channel, unsigned long pos, struct lx_copy_io *io,
+		unsigned long bytes)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	const enum lx_copy_fmt fmt = lx_copy_fmt(runtime->format);
+	const unsigned int sample_bytes =
+			snd_pcm_format_physical_width(runtime->format) / 8;
+	const unsigned int ring_bytes = lx_ring_sample_bytes(runtime->format);
+	unsigned int n = bytes / sample_bytes;
+	unsigned int stride, chunk;
+	u32 buf[LX_COPY_CHUNK];
+	u8 *ring;
+	int err;
+
+	ring = lx_ring_addr(runtime, channel, pos, &stride);
+
+	/* the ring format as is */
+	if (fmt == LX_COPY_NATIVE && stride == ring_bytes)
+		return io->move(io, ring, bytes);
+
+	for (; n; n -= chunk, ring += chunk * stride) {
+		chunk = min_t(unsigned int, n, LX_COPY_CHUNK);
+		if (io->is_capture) {
+			lx_ring_read(buf, ring, stride, chunk, fmt,
+					ring_bytes);
+			err = io->move(io, buf, chunk * sample_bytes);
+		} else {
+			err = io->move(io, buf, chunk * sample_bytes);
+			if (err == 0)
+				lx_ring_write(ring, stride, buf, chunk, fmt,
+						ring_bytes);
+		}
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+static int lx_copy_move_iter(struct lx_copy_io *io, void *buf,
+		unsigned long bytes)
+{
+	size_t done = io->is_capture ? copy_to_iter(buf, bytes, io->iter) :
+			copy_from_iter(buf, bytes, io->iter);
+
+	return done == bytes ? 0 : -EFAULT;
+}
+
+int lx_pcm_copy(struct snd_pcm_substream *substream, int channel,
+		unsigned long pos, struct iov_iter *iter, unsigned long bytes)
+{
+	struct lx_copy_io io = {
+		.move = lx_copy_move_iter,
+		.is_capture = substream->stream == SNDRV_PCM_STREAM_CAPTURE,
+		.iter = iter,
+	};
+
+	return lx_pcm_copy_generic(substream, channel, pos, &io, bytes);
+}
+#else
+static int lx_copy_move_user(struct lx_copy_io *io, void *buf,
+		unsigned long bytes)
+{
+	unsigned long left = io->is_capture ?
+			copy_to_user(io->ubuf, buf, bytes) :
+			copy_from_user(buf, io->ubuf, bytes);
+
+	if (left)
+		return -EFAULT;
+	io->ubuf += bytes;
+	return 0;
+}
+
+static int lx_copy_move_kernel(struct lx_copy_io *io, void *buf,
+		unsigned long bytes)
+{
+	if (io->is_capture)
+		memcpy(io->kbuf, buf, bytes);
+	else
+		memcpy(buf, io->kbuf, bytes);
+	io->kbuf += bytes;
+	return 0;
+}
+
+int lx_pcm_copy_user(struct snd_pcm_substream *substream, int channel,
+		unsigned long pos, void __user *buf, unsigned long bytes)
+{
+	struct lx_copy_io io = {
+		.move = lx_copy_move_user,
+		.is_capture = substream->stream == SNDRV_PCM_STREAM_CAPTURE,
+		.ubuf = buf,
+	};
+
+	return lx_pcm_copy_generic(substream, channel, pos, &io, bytes);
+}
+
+int lx_pcm_copy_kernel(struct snd_pcm_substream *substream, int channel,
+		unsigned long pos, void *buf, unsigned long bytes)
+{
+	struct lx_copy_io io = {
+		.move = lx_copy_move_kernel,
+		.is_capture = substream->stream == SNDRV_PCM_STREAM_CAPTURE,
+		.kbuf = buf,
+	};
+
+	return lx_pcm_copy_generic(substream, channel, pos, &io, bytes);
+}
+#endif
+
+int lx_pcm_fill_silence(struct snd_pcm_substream *substream, int channel,
+		unsigned long pos, unsigned long bytes)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	const unsigned int ring_bytes = lx_ring_sample_bytes(runtime->format);
+	unsigned int n = bytes /
+			(snd_pcm_format_physical_width(runtime->format) / 8);
+	unsigned int stride;
+	u8 *ring;
+
+	ring = lx_ring_addr(runtime, channel, pos, &stride);
+	if (stride == ring_bytes) {
+		memset(ring, 0, n * ring_bytes);
+		return 0;
+	}
+	for (; n; n--, ring += stride)
+		memset(ring, 0, ring_bytes);
+	return 0;
+}
+#endif
+
 int lx_pcm_prepare(struct snd_pcm_substream *substream)
 {
 	struct lx_chip *chip = snd_pcm_substream_chip(substream);
@@ -387,11 +1126,15 @@ int lx_pcm_prepare(struct snd_pcm_substream *substream)
 	const u32 channels = substream->runtime->channels;
 	dma_addr_t buf;
 	u32 buffer_size = 0;
-	u32 buffer_index = 0;
 	unsigned char period_multiple_gran = 0;
+	struct lx_transaction *trans;
+	int alloc_idx = -1;
+	int def_idx;
+	int start_idx;
+	int failed;
+	bool moderated;
 	unsigned int loop = 40000; /* for 40ms timeout */
-	struct lx_stream *lx_stream = is_capture ?
-			&chip->capture_stream : &chip->playback_stream;
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
 
 /*        printk(KERN_DEBUG
 *        "%s chip %p,  is_capture : %d, nb period : %d, nb channels : %d\n",
@@ -441,71 +1184,91 @@ int lx_pcm_prepare(struct snd_pcm_substream *substream)
 		}
 		period_multiple_gran = substream->runtime->period_size
 				/ chip->pcm_granularity;
-		if (is_capture == 0)
-			chip->play_period_multiple_gran = period_multiple_gran;
-		else
-			chip->capture_period_multiple_gran =
-					period_multiple_gran;
+		lx_stream->period_multiple_gran = period_multiple_gran;
 	}
 /*        printk(KERN_DEBUG "%s, %d %d %d\n",
 *                        __func__,
 *                        period_multiple_gran,
-*                        chip->play_period_multiple_gran,
-*                        chip->capture_period_multiple_gran);
+*                        chip->playback_streams[0].period_multiple_gran,
+*                        chip->capture_streams[0].period_multiple_gran);
 */
-	if(chip->hardware_running[is_capture] == 0){
+	if(lx_stream->hardware_running == 0){
 	    /*
 	     * printk("%s, expected channels %d 1st channel %d  max_channels %d\n",
 	     * __func__, channels,  chip->first_channel_selector, chip->max_channels);
 	     */
-	    if((channels + chip->first_channel_selector) > chip->max_channels){
+	    if(channels > lx_substream_channels(chip)){
 		    dev_err(chip->card->dev, "Impossible 1st channel + nb channel > max channel supported by hw\n");
 		    err = -EPERM;
 		    goto exit;
 	    }
-
-	    err = lx_pipe_open(chip, is_capture, channels);
-	    if (err < 0) {
-		    dev_err(chip->card->dev, "setting lx_pipe_open failed\n");
-		    goto exit;
-	    }
-	    chip->hardware_running[is_capture] = 1;
+	    /* the 1st channel may have changed since the open */
+	    lx_stream->pipe = lx_substream_pipe(chip, substream->number);
 	}
 
-
-
-	err = lx_stream_create_and_start(chip, substream);
-	if (err < 0) {
-/*	dev_err(chip->card->dev, "setting granularity to %ld failed\n",
-*		period_size);
-*/
-		dev_err(chip->card->dev, "setting lx_pipe_start failed\n");
-		goto exit;
-	}
-
-	if (chip->board_sample_rate != substream->runtime->rate)
-		if (!err)
-			chip->board_sample_rate = substream->runtime->rate;
-
 	/* prepare lx buffer */
-	buf = substream->dma_buffer.addr;
+	buf = substream->runtime->dma_addr;
 
-	if (is_capture == 0)
-		chip->playback_stream.frame_pos = 0;
-	else
-		chip->capture_stream.frame_pos = 0;
+	lx_stream->frame_pos = 0;
+	lx_stream->periods_elapsed = 0;
+	lx_stream->hw_time = ktime_set(0, 0);
+	lx_stream->period_ns = div_u64((u64)NSEC_PER_SEC *
+			substream->runtime->period_size, substream->runtime->rate);
 
-	buffer_size =	/* 24 bit samples | frame size  */
-			channels * 3 *
+	buffer_size =	/* 16 or 24 bit samples | frame size  */
+			channels *
+			lx_ring_sample_bytes(substream->runtime->format) *
 			/* frames per channels | gran */
 			periods * substream->runtime->period_size;
 
-	err = lx_buffer_give(chip, chip->first_channel_selector, is_capture, buffer_size,
-			lower_32_bits(buf), upper_32_bits(buf), &buffer_index,
-			period_multiple_gran);
-	if (err < 0)
-		dev_err(chip->card->dev,
-			"%s, lx_buffer_give err = %d\n", __func__, err);
+	/* per period irqs or the card timer, before the buffer is given */
+	lx_irq_moderation_set(chip, lx_stream, substream->runtime);
+	moderated = lx_stream->irq_moderated;
+
+	/* allocate the pipe if needed, define and start the stream and give
+	 * the buffer in one go
+	 */
+	trans = lx_transaction_begin(chip);
+	if (lx_stream->hardware_running == 0)
+		alloc_idx = lx_transaction_pipe_allocate(trans,
+				lx_stream->pipe, is_capture, channels);
+	def_idx = lx_transaction_stream_def(trans, substream->runtime,
+			lx_stream->pipe, is_capture);
+	start_idx = lx_transaction_stream_set_state(trans,
+			lx_stream->pipe, is_capture, SSTATE_RUN, false);
+	lx_transaction_buffer_give(trans, lx_stream->pipe,
+			is_capture, buffer_size, lower_32_bits(buf),
+			upper_32_bits(buf), period_multiple_gran, !moderated);
+	err = lx_transaction_commit(trans);
+	failed = (err != 0) ? trans->failed : trans->count;
+	lx_transaction_end(trans);
+
+	if (alloc_idx >= 0 && failed > alloc_idx)
+		lx_stream->hardware_running = 1;
+	if (failed > def_idx)
+		lx_stream->hardware_running++;
+
+	if (err != 0) {
+		if (failed == alloc_idx)
+			dev_err(chip->card->dev,
+				"setting lx_pipe_open failed\n");
+		else if (failed == def_idx)
+			dev_err(chip->card->dev,
+				"%s : setting lx stream format failed\n",
+				__func__);
+		else if (failed == start_idx)
+			dev_err(chip->card->dev,
+				"%s, couldn't start lxstream\n", __func__);
+		else
+			dev_err(chip->card->dev,
+				"%s, lx_buffer_give err = %d\n", __func__, err);
+		if (err > 0)
+			err = -EIO;
+		goto exit;
+	}
+
+	if (chip->board_sample_rate != substream->runtime->rate)
+		chip->board_sample_rate = substream->runtime->rate;
 
 exit:
 	mutex_unlock(&chip->setup_mutex);
@@ -530,14 +1293,15 @@ int lx_pcm_hw_params(struct snd_pcm_substream *substream,
 		struct snd_pcm_hw_params *hw_params)
 {
 	struct lx_chip *chip = snd_pcm_substream_chip(substream);
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
 	int err = 0;
-	int is_capture = (substream->stream == SNDRV_PCM_STREAM_CAPTURE);
 /*        printk(KERN_DEBUG  "\t%s is_capture : %d\n",
 *                        __func__,
 *                     (substream->stream == SNDRV_PCM_STREAM_CAPTURE));
 */
 	mutex_lock(&chip->setup_mutex);
 
+#if !HAVE_SND_PCM_MANAGED_BUFFER
 	/* set dma buffer */
 	err = snd_pcm_lib_malloc_pages(substream,
 			params_buffer_bytes(hw_params));
@@ -547,12 +1311,17 @@ int lx_pcm_hw_params(struct snd_pcm_substream *substream,
 			__func__, err);
 		goto exit;
 	}
-	if (is_capture)
-		chip->capture_stream.stream = substream;
+#endif
+	lx_stream->stream = substream;
+	/* the reserve is used when it is large enough, see lx_proc_get_dma() */
+	if (substream->runtime->dma_buffer_p != &substream->dma_buffer)
+		lx_stream->dma_bytes = substream->runtime->dma_buffer_p->bytes;
 	else
-		chip->playback_stream.stream = substream;
+		lx_stream->dma_bytes = 0;
 
+#if !HAVE_SND_PCM_MANAGED_BUFFER
 exit:
+#endif
 	mutex_unlock(&chip->setup_mutex);
 	return err;
 }
@@ -564,8 +1333,9 @@ int lx_pcm_hw_free(struct snd_pcm_substream *substream)
 	int is_capture = (substream->stream == SNDRV_PCM_STREAM_CAPTURE);
 	int loop = 40000;
 	int i;
-	struct lx_stream *lx_stream = is_capture ?
-			&chip->capture_stream : &chip->playback_stream;
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
+	struct lx_transaction *trans;
+	int stop_idx;
 
 /*        printk(KERN_DEBUG  "%s\n", __func__); */
 /*        printk(KERN_DEBUG
@@ -576,38 +1346,50 @@ int lx_pcm_hw_free(struct snd_pcm_substream *substream)
 */
 	/* if command pending */
 	while ((lx_stream->status == LX_STREAM_STATUS_SCHEDULE_STOP)
-			&& (loop > 0)) {
+			&& (loop-- > 0)) {
 		udelay(1);
 	}
 	if (loop <= 0) {
 		dev_err(chip->card->dev, "%s TIMEOUT\n", __func__);
-		err = -EIO;
-		goto exit;
+		return -EIO;
 	}
-	lx_trigger_stream_stop(chip, is_capture);
 
 	mutex_lock(&chip->setup_mutex);
+
+	/* stop the stream and cancel all its buffers in one go */
+	trans = lx_transaction_begin(chip);
+	stop_idx = lx_transaction_stream_set_state(trans,
+			lx_stream->pipe, is_capture, SSTATE_STOP, true);
 	for (i = 0; i < MICROBLAZE_LX_PCI_PERIODS_MAX; i++)
-		lx_buffer_cancel(chip, chip->first_channel_selector, is_capture, i);
+		lx_transaction_buffer_cancel(trans,
+				lx_stream->pipe, is_capture, i, true);
+	lx_transaction_commit(trans);
+	if (stop_idx < 0 || trans->req[stop_idx].status < 0)
+		dev_err(chip->card->dev, LXP "couldn't stop pipe\n");
+	else
+		lx_stream->status = LX_STREAM_STATUS_STOPPED;
+	lx_transaction_end(trans);
+
+	lx_irq_moderation_set(chip, lx_stream, NULL);
 
+#if !HAVE_SND_PCM_MANAGED_BUFFER
 	err = snd_pcm_lib_free_pages(substream);
-exit:
+#endif
+	lx_stream->dma_bytes = 0;
+
 	mutex_unlock(&chip->setup_mutex);
 /*        printk(KERN_DEBUG  "%s  err %d\n", __func__, err); */
 
 	return err;
 }
 
-void lx_trigger_pipe_start(struct lx_chip *chip, unsigned int is_capture)
+void lx_trigger_pipe_start(struct lx_chip *chip, struct lx_stream *lx_stream)
 {
 	int err;
-/*        printk(KERN_DEBUG  "%s %d\n", __func__, is_capture); */
-	if (is_capture == 0)
-		chip->irq_audio_cpt_play = (unsigned int)-1;
-	else
-		chip->irq_audio_cpt_record = (unsigned int)-1;
+/*        printk(KERN_DEBUG  "%s %d\n", __func__, lx_stream->is_capture); */
+	lx_interrupt_reset_granules(chip, lx_stream);
 
-	err = lx_pipe_start_single(chip, chip->first_channel_selector, is_capture);
+	err = lx_pipe_start_single(chip, lx_stream->pipe, lx_stream->is_capture);
 	chip->jiffies_start = jiffies;
 
 	if (err < 0) {
@@ -616,85 +1398,155 @@ void lx_trigger_pipe_start(struct lx_chip *chip, unsigned int is_capture)
 		dev_err(chip->card->dev,
 			"%s, couldn't start alsa stream\n", __func__);
 	} else {
-		chip->hardware_running[is_capture] = 2;
-		if (is_capture == 0)
-			chip->playback_stream.status = LX_STREAM_STATUS_RUNNING;
-		else
-			chip->capture_stream.status = LX_STREAM_STATUS_RUNNING;
+		lx_stream->hardware_running = 2;
+		lx_stream->period_time = ktime_get();
+		lx_stream->status = LX_STREAM_STATUS_RUNNING;
+	}
+}
+
+/* pipes of the streams of a chip in the given status, one mask per
+ * direction as CMD_0B_TOGGLE_PIPE_STATE takes them
+ */
+static void lx_trigger_pipes_mask(struct lx_chip *chip,
+		enum lx_stream_status status, u64 *mask)
+{
+	struct lx_stream *lx_stream;
+	unsigned int i;
+	int is_capture;
+
+	for (is_capture = 0; is_capture < 2; is_capture++) {
+		mask[is_capture] = 0;
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->status == status)
+				mask[is_capture] |= BIT_ULL(lx_stream->pipe);
+		}
 	}
 }
 
 /*for linked streams*/
 void lx_trigger_pipes_start(struct lx_chip *chip)
 {
+	struct lx_stream *lx_stream;
+	u64 mask[2];
+	ktime_t now;
+	unsigned int i;
+	int is_capture;
 	int err;
 
 /*        printk(KERN_DEBUG  "%s %p\n", __func__, chip);*/
-	chip->irq_audio_cpt_play = (unsigned int)-1;
-	chip->irq_audio_cpt_record = (unsigned int)-1;
-	err = lx_pipe_start_multiple(chip);
+	lx_trigger_pipes_mask(chip, LX_STREAM_STATUS_SCHEDULE_RUN, mask);
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->status == LX_STREAM_STATUS_SCHEDULE_RUN)
+				lx_interrupt_reset_granules(chip, lx_stream);
+		}
+	err = lx_pipe_start_multiple(chip, mask[0], mask[1]);
 	chip->jiffies_start = jiffies;
 	if (err < 0) {
-		chip->capture_stream.status = LX_STREAM_STATUS_STOPPED;
-		chip->playback_stream.status = LX_STREAM_STATUS_STOPPED;
 		dev_err(chip->card->dev,
 			"%s : starting lx pipe failed\n", __func__);
 		dev_err(chip->card->dev,
 			"%s, couldn't start alsa stream\n", __func__);
-	} else {
-		chip->hardware_running[0] = 2;
-		chip->hardware_running[1] = 2;
-		chip->capture_stream.status = LX_STREAM_STATUS_RUNNING;
-		chip->playback_stream.status = LX_STREAM_STATUS_RUNNING;
 	}
+
+	now = ktime_get();
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->status != LX_STREAM_STATUS_SCHEDULE_RUN)
+				continue;
+			if (err < 0) {
+				lx_stream->status = LX_STREAM_STATUS_STOPPED;
+				continue;
+			}
+			lx_stream->hardware_running = 2;
+			lx_stream->period_time = now;
+			lx_stream->status = LX_STREAM_STATUS_RUNNING;
+		}
 }
 
 /*for linked stream*/
 void lx_trigger_pipes_stop(struct lx_chip *chip)
 {
+	struct lx_stream *lx_stream;
+	u64 mask[2] = { 0, 0 };
+	unsigned int i;
+	int is_capture;
 	int err;
         /*printk(KERN_DEBUG  "\t%s %p\n", __func__, chip);*/
 
-	err = lx_pipe_pause_multiple(chip);
+	/* no stream on the dsp any more, e.g. after a recovery */
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->status != LX_STREAM_STATUS_SCHEDULE_STOP)
+				continue;
+			atomic_set(&lx_stream->xrun_advertise, 0);
+			if (lx_stream->hardware_running < 2)
+				lx_stream->status = LX_STREAM_STATUS_STOPPED;
+			else
+				mask[is_capture] |= BIT_ULL(lx_stream->pipe);
+		}
+	if (mask[0] == 0 && mask[1] == 0)
+		return;
+
+	err = lx_pipe_pause_multiple(chip, mask[0], mask[1]);
 	/*hack: if we loose external clock, cmd failed -> we shift to internal clock to stop properly embedded*/
 	if( err == -ETIMEDOUT && chip->lx_type == LX_MADI ) {
 		dev_err(chip->card->dev,
 			"%s : seems we loose external clock... try to shift to internal to stop card\n", __func__);
 		err = (int)chip->set_internal_clock(chip);
-		if(err >= 0 ){
-			err = lx_pipe_wait_for_idle(chip, chip->first_channel_selector, 0);
-			if (err < 0)
-				dev_err(chip->card->dev,
-					"\t%s error wait for play idle %d\n",
-					__func__, err);
-
-			err += lx_pipe_wait_for_idle(chip, chip->first_channel_selector, 1);
-			if (err < 0)
-				dev_err(chip->card->dev,
-					"\t%s error wait for capture idle %d\n",
-					__func__, err);
-		}
+		for (is_capture = 0; err >= 0 && is_capture < 2; is_capture++)
+			for (; mask[is_capture] && err >= 0;
+					mask[is_capture] &= mask[is_capture] - 1) {
+				err = lx_pipe_wait_for_idle(chip,
+						__ffs64(mask[is_capture]),
+						is_capture);
+				if (err < 0)
+					dev_err(chip->card->dev,
+						"\t%s error wait for %s idle %d\n",
+						__func__, is_capture ?
+						"capture" : "play", err);
+			}
 	}
 	if (err < 0) {
-		chip->capture_stream.status = LX_STREAM_STATUS_RUNNING;
-		chip->playback_stream.status = LX_STREAM_STATUS_RUNNING;
 		dev_err(chip->card->dev,
 			"%s : pause lx pipe failed\n", __func__);
 		dev_err(chip->card->dev,
 			"%s, couldn't pause alsa stream\n", __func__);
-	} else {
-		chip->hardware_running[0] = 1;
-		chip->hardware_running[1] = 1;
-		chip->capture_stream.status = LX_STREAM_STATUS_STOPPED;
-		chip->playback_stream.status = LX_STREAM_STATUS_STOPPED;
 	}
+
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->status != LX_STREAM_STATUS_SCHEDULE_STOP)
+				continue;
+			if (err < 0) {
+				lx_stream->status = LX_STREAM_STATUS_RUNNING;
+				continue;
+			}
+			lx_stream->hardware_running = 1;
+			lx_stream->status = LX_STREAM_STATUS_STOPPED;
+		}
 }
-static void lx_trigger_pipe_stop(struct lx_chip *chip, unsigned int is_capture)
+static void lx_trigger_pipe_stop(struct lx_chip *chip,
+		struct lx_stream *lx_stream)
 {
+	const int is_capture = lx_stream->is_capture;
 	int err;
         /*printk(KERN_DEBUG  "%s\n", __func__);*/
 
-	err = lx_pipe_pause_single(chip, chip->first_channel_selector, is_capture);
+	atomic_set(&lx_stream->xrun_advertise, 0);
+
+	/* no stream on the dsp any more, e.g. after a recovery */
+	if (lx_stream->hardware_running < 2) {
+		lx_stream->status = LX_STREAM_STATUS_STOPPED;
+		return;
+	}
+
+	err = lx_pipe_pause_single(chip, lx_stream->pipe, is_capture);
 
 
 	/*hack: if we loose external clock, cmd failed -> we shift to internal clock to stop properly embedded*/
@@ -703,7 +1555,7 @@ static void lx_trigger_pipe_stop(struct lx_chip *chip, unsigned int is_capture)
 			"%s : seems we loose external clock... try to shift to internal to stop card\n", __func__);
 		err = (int)chip->set_internal_clock(chip);
 		if(err >= 0 ){
-			err = lx_pipe_wait_for_idle(chip, chip->first_channel_selector, is_capture);
+			err = lx_pipe_wait_for_idle(chip, lx_stream->pipe, is_capture);
 			if (err < 0) {
 				dev_err(chip->card->dev,
 					"\t%s error wait for idle %d\n",
@@ -715,35 +1567,61 @@ static void lx_trigger_pipe_stop(struct lx_chip *chip, unsigned int is_capture)
 	if (err < 0)
 		dev_err(chip->card->dev, LXP "couldn't stop pipe\n");
 	else {
-		err = lx_pipe_wait_for_idle(chip, chip->first_channel_selector, is_capture);
+		err = lx_pipe_wait_for_idle(chip, lx_stream->pipe, is_capture);
 		if (err < 0)
 			dev_err(chip->card->dev, "%s : wait for idle failed for %d\n",
 					__func__, is_capture);
-		if (is_capture == 0)
-			chip->playback_stream.status = LX_STREAM_STATUS_STOPPED;
-		else
-			chip->capture_stream.status = LX_STREAM_STATUS_STOPPED;
+		lx_stream->status = LX_STREAM_STATUS_STOPPED;
 	}
 }
 
+/* true while a stream of the chip has its pipe started */
+static bool lx_chip_running(struct lx_chip *chip)
+{
+	unsigned int i;
+
+	for (i = 0; i < chip->substreams; i++)
+		if (chip->playback_streams[i].hardware_running > 1 ||
+				chip->capture_streams[i].hardware_running > 1)
+			return true;
+	return false;
+}
+
+/* the streams scheduled on a chip of the group are started or stopped
+ * together when there are several of them
+ */
 static void lx_trigger_finalize(struct lx_chip *chip,
 		struct snd_pcm_substream *substream)
 {
 	struct lx_chip *link_chip = NULL;
 	struct snd_pcm_substream *s;
-	struct lx_stream *link_lx_stream_play, *link_lx_stream_record;
+	struct lx_stream *lx_stream, *run, *stop;
+	unsigned int i, to_run, to_stop;
+	int is_capture;
 
 	unsigned long j1;
 /*        printk(KERN_DEBUG  "%s\n", __func__);*/
 
 	snd_pcm_group_for_each_entry(s, substream) {
 		link_chip = snd_pcm_substream_chip(s);
-		link_lx_stream_record = &link_chip->capture_stream;
-		link_lx_stream_play = &link_chip->playback_stream;
-		if ((link_lx_stream_record->status ==
-					LX_STREAM_STATUS_SCHEDULE_RUN) &&
-			(link_lx_stream_play->status ==
-					LX_STREAM_STATUS_SCHEDULE_RUN)) {
+		run = stop = NULL;
+		to_run = to_stop = 0;
+		for (is_capture = 0; is_capture < 2; is_capture++)
+			for (i = 0; i < link_chip->substreams; i++) {
+				lx_stream = lx_chip_stream(link_chip,
+						is_capture, i);
+				if (lx_stream->status ==
+						LX_STREAM_STATUS_SCHEDULE_RUN) {
+					run = lx_stream;
+					to_run++;
+				} else if (lx_stream->status ==
+						LX_STREAM_STATUS_SCHEDULE_STOP) {
+					stop = lx_stream;
+					to_stop++;
+				}
+			}
+
+		if (to_run > 1) {
 			lx_interrupt_debug_events(link_chip);
 			lx_trigger_pipes_start(link_chip);
 /*                      printk (KERN_DEBUG "%s, "
@@ -752,37 +1630,19 @@ static void lx_trigger_finalize(struct lx_chip *chip,
 *                              chip,
 *                              link_chip);
 */
-		} else if (link_lx_stream_record->status ==
-				LX_STREAM_STATUS_SCHEDULE_RUN) {
-			lx_interrupt_debug_events(chip);
-			lx_trigger_pipe_start(chip, 1);
-		} else if (link_lx_stream_play->status ==
-				LX_STREAM_STATUS_SCHEDULE_RUN) {
-			lx_interrupt_debug_events(chip);
-			lx_trigger_pipe_start(chip, 0);
-		} else if ((link_lx_stream_record->status ==
-					LX_STREAM_STATUS_SCHEDULE_STOP) &&
-				(link_lx_stream_play->status ==
-					LX_STREAM_STATUS_SCHEDULE_STOP)) {
-
+		} else if (to_run) {
+			lx_interrupt_debug_events(link_chip);
+			lx_trigger_pipe_start(link_chip, run);
+		} else if (to_stop > 1) {
 			lx_trigger_pipes_stop(link_chip);
-			atomic_set(&chip->play_xrun_advertise, 0);
-			atomic_set(&chip->capture_xrun_advertise, 0);
-
 /*                        printk (KERN_DEBUG
 *                        "%s, lx_trigger_pipes_stop chip %p link_chip %p\n",
 *                        __func__,
 *                        chip,
 *                        link_chip);
 */
-		} else if (link_lx_stream_record->status ==
-				LX_STREAM_STATUS_SCHEDULE_STOP) {
-			lx_trigger_pipe_stop(chip, 1);
-			atomic_set(&chip->capture_xrun_advertise, 0);
-		} else if (link_lx_stream_play->status ==
-				LX_STREAM_STATUS_SCHEDULE_STOP) {
-			lx_trigger_pipe_stop(chip, 0);
-			atomic_set(&chip->play_xrun_advertise, 0);
+		} else if (to_stop) {
+			lx_trigger_pipe_stop(link_chip, stop);
 		}
 	}
 	j1 = jiffies;
@@ -794,9 +1654,7 @@ int lx_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 	int err = 0;
 	struct lx_chip *chip = snd_pcm_substream_chip(substream);
 	struct lx_chip *link_chip;
-	const int is_capture = (substream->stream == SNDRV_PCM_STREAM_CAPTURE);
-	struct lx_stream *lx_stream = is_capture ?
-			&chip->capture_stream : &chip->playback_stream;
+	struct lx_stream *lx_stream = lx_substream_stream(substream);
 	struct lx_stream *link_lx_stream;
 	struct snd_pcm_substream *s;
 
@@ -807,13 +1665,7 @@ int lx_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 		if (snd_pcm_stream_linked(substream)) {
 			snd_pcm_group_for_each_entry(s, substream) {
 				link_chip = snd_pcm_substream_chip(s);
-				if (s == link_chip->capture_stream.stream) {
-					link_lx_stream =
-					&link_chip->capture_stream;
-				} else {
-					link_lx_stream =
-					&link_chip->playback_stream;
-				}
+				link_lx_stream = lx_substream_stream(s);
 
 				/* if command pending */
 /*
@@ -859,14 +1711,7 @@ int lx_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 		if (snd_pcm_stream_linked(substream)) {
 			snd_pcm_group_for_each_entry(s, substream) {
 				link_chip = snd_pcm_substream_chip(s);
-
-				if (s == link_chip->capture_stream.stream) {
-					link_lx_stream =
-					&link_chip->capture_stream;
-				} else {
-					link_lx_stream =
-					&link_chip->playback_stream;
-				}
+				link_lx_stream = lx_substream_stream(s);
 				if (link_lx_stream->status ==
 						LX_STREAM_STATUS_SCHEDULE_RUN)
 					dev_err(link_chip->card->dev,
@@ -892,8 +1737,9 @@ int lx_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 		}
 		/*change 1st channel during play is forbidden otherwise
 		 * we ll have problem to stop*/
-		chip->mixer_first_channel_selector_ctl->vd[0].access &=
-			~SNDRV_CTL_ELEM_ACCESS_INACTIVE;
+		if (!lx_chip_running(chip))
+			chip->mixer_first_channel_selector_ctl->vd[0].access &=
+				~SNDRV_CTL_ELEM_ACCESS_INACTIVE;
 		break;
 	default:
 		err = -EINVAL;
@@ -910,13 +1756,19 @@ int snd_lx_dev_free(struct snd_device *device)
 	struct lx_chip *chip = device->device_data;
 
 /*        printk(KERN_DEBUG  "%s\n", __func__); */
+	lx_recovery_stop(chip);
+	lx_meter_stop(chip);
+	lx_tstamp_stop(chip);
 	lx_irq_disable(chip);
+	lx_irq_affinity_release(chip);
 	if (chip->irq >= 0)
 		free_irq(chip->irq, chip);
+	lx_cmdq_flush(chip);
 	iounmap(chip->port_dsp_bar);
 	ioport_unmap(chip->port_plx_remapped);
 	pci_release_regions(chip->pci);
 	pci_disable_device(chip->pci);
+	free_percpu(chip->irq_stats);
 	kfree(chip);
 
 	return 0;
@@ -1236,6 +2088,37 @@ static struct snd_pcm_ops lx_ops_capture_generic = {
 };
 
 
+static unsigned int dma_reserve_kb;
+module_param(dma_reserve_kb, uint, 0444);
+MODULE_PARM_DESC(dma_reserve_kb,
+	"Kbytes of dma buffer kept per substream from the probe on (0 = none).");
+
+/* the dma buffers are allocated by hw_params to the size asked for, up to
+ * max per substream. dma_reserve_kb is allocated at the probe so that the
+ * small buffers of the low latency opens never wait for contiguous memory.
+ */
+static int lx_pcm_buffers_init(struct lx_chip *chip, struct snd_pcm *pcm,
+		size_t max)
+{
+	size_t reserve = min_t(size_t, max,
+			PAGE_ALIGN((size_t)dma_reserve_kb * 1024));
+	int err = 0;
+
+#if HAVE_SND_PCM_MANAGED_BUFFER
+	snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_DEV,
+			&chip->pci->dev, reserve, max);
+#elif PREALLOCATE_PAGES_FOR_ALL_RETURNS_NO_ERR
+	snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_DEV,
+			snd_dma_pci_data(chip->pci), reserve, max);
+#else
+	err = snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_DEV,
+			snd_dma_pci_data(chip->pci), reserve, max);
+	if (err < 0)
+		dev_err(chip->card->dev,
+		"%s, snd_pcm_lib_preallocate_pages_for_all failed", __func__);
+#endif
+	return err;
+}
 
 int lx_pcm_create(struct lx_chip *chip)
 {
@@ -1243,7 +2126,8 @@ int lx_pcm_create(struct lx_chip *chip)
 	struct snd_pcm *pcm;
 	u32 size;
 
-	size =	MICROBLAZE_CHANNELS_MAX *	/* channels */
+	size =	DIV_ROUND_UP(MICROBLAZE_CHANNELS_MAX,	/* channels */
+			chip->substreams) *
 		3 *				/* 24 bit samples */
 		MAX_STREAM_BUFFER *		/* periods */
 		MICROBLAZE_IBL_MAX *		/* frames per period */
@@ -1253,7 +2137,8 @@ int lx_pcm_create(struct lx_chip *chip)
 	size = PAGE_ALIGN(size);
 
 	/* hardcoded device name & channel count */
-	err = snd_pcm_new(chip->card, (char *)card_name, 0, 1, 1, &pcm);
+	err = snd_pcm_new(chip->card, (char *)card_name, 0, chip->substreams,
+			chip->substreams, &pcm);
 	if (err < 0)
 		return err;
 
@@ -1271,74 +2156,391 @@ int lx_pcm_create(struct lx_chip *chip)
 	/*pcm->nonatomic = true; TODO SJR check if use*/
 	strcpy(pcm->name, card_name);
 
-#if PREALLOCATE_PAGES_FOR_ALL_RETURNS_NO_ERR
-	snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_DEV,
-			snd_dma_pci_data(chip->pci), size, size);
-#else
-	err = snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_DEV,
-			snd_dma_pci_data(chip->pci), size, size);
-	if (err < 0) {
-		dev_err(chip->card->dev,
-		"%s, snd_pcm_lib_preallocate_pages_for_all failed", __func__);
+	err = lx_pcm_buffers_init(chip, pcm, size);
+	if (err < 0)
 		return err;
-	}
-#endif
 
 	chip->pcm = pcm;
-	chip->capture_stream.is_capture = 1;
 
 	return 0;
 }
 
+/* dsp recovery
+ * A crashed or mute MicroBlaze used to need a module reload. The command
+ * queue calls lx_recovery_schedule() when the firmware reports a crash or
+ * stops answering, and this work resets and initializes the board again,
+ * restores the granularity and the card settings, allocates the pipes
+ * that were open and reports an XRUN on the streams. Their prepare then
+ * defines the streams and gives the DMA buffers again.
+ */
+static bool auto_recover = true;
+module_param(auto_recover, bool, 0644);
+MODULE_PARM_DESC(auto_recover,
+	"Reset and restore the DSP when it crashes or stops answering.");
+
+static void lx_recovery_work(struct work_struct *work)
+{
+	struct lx_chip *chip = container_of(work, struct lx_chip,
+			recovery_work);
+	struct lx_stream *lx_stream;
+	ktime_t start = ktime_get();
+	u16 granularity;
+	unsigned int elapsed_us;
+	unsigned int i;
+	bool quiesced;
+	int is_capture;
+	int err;
+
+	dev_warn(chip->card->dev, "%s, DSP not answering, resetting it\n",
+			__func__);
+
+	mutex_lock(&chip->setup_mutex);
+
+	/* quiesce: nothing may reach the mailbox while the board resets */
+	lx_irq_disable(chip);
+	lx_cmdq_flush(chip);
+	lx_dsp_reg_invalidate(chip, REG_MADI_RAVENNA_CLOCK_CFG);
+
+	granularity = chip->pcm_granularity;
+	chip->pcm_granularity = 0;
+	/* the reset stopped the timer, streams choose again at prepare */
+	chip->irq_timer_gran = 0;
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			lx_stream->irq_timer_wanted = 0;
+			lx_stream->irq_moderated = false;
+		}
+	err = lx_init_dsp(chip);
+	if (err == 0 && granularity != 0)
+		err = lx_set_granularity(chip, granularity);
+	if (err == 0 && chip->restore_config)
+		err = chip->restore_config(chip);
+	/* lx_init_dsp may have failed before or after enabling the irqs of a
+	 * board that does not answer, keep them off until the module is reloaded
+	 */
+	quiesced = err != 0;
+	if (quiesced)
+		lx_irq_disable(chip);
+
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->hardware_running == 0)
+				continue;
+
+			/* the reset dropped the pipe and its stream */
+			lx_stream->hardware_running = 0;
+			lx_stream->status = LX_STREAM_STATUS_STOPPED;
+			if (err == 0 && lx_stream->stream &&
+			    lx_stream->stream->runtime) {
+				err = lx_pipe_open(chip, lx_stream,
+					lx_stream->stream->runtime->channels);
+				if (err == 0)
+					lx_stream->hardware_running = 1;
+			}
+		}
+
+	/* let the clients know, they prepare and restart */
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		for (i = 0; i < chip->substreams; i++) {
+			lx_stream = lx_chip_stream(chip, is_capture, i);
+			if (lx_stream->stream == NULL)
+				continue;
+			atomic_inc(&lx_stream->xrun_advertise);
+			snd_pcm_period_elapsed(lx_stream->stream);
+		}
+
+	mutex_unlock(&chip->setup_mutex);
+
+	elapsed_us = (unsigned int)ktime_us_delta(ktime_get(), start);
+	if (quiesced) {
+		chip->debug_irq.recovery_failed++;
+		dev_err(chip->card->dev,
+			"%s, DSP recovery failed %d, card left quiesced\n",
+			__func__, err);
+	} else if (err != 0) {
+		chip->debug_irq.recovery_failed++;
+		dev_err(chip->card->dev, "%s, DSP recovery failed %d\n",
+				__func__, err);
+	} else {
+		chip->debug_irq.recoveries++;
+		chip->debug_irq.recovery_last_us = elapsed_us;
+		if (elapsed_us > chip->debug_irq.recovery_max_us)
+			chip->debug_irq.recovery_max_us = elapsed_us;
+		dev_warn(chip->card->dev, "%s, DSP recovered in %u us\n",
+				__func__, elapsed_us);
+	}
+
+	atomic_set(&chip->recovery_pending, 0);
+}
+
+void lx_recovery_init(struct lx_chip *chip)
+{
+	atomic_set(&chip->recovery_pending, 0);
+	INIT_WORK(&chip->recovery_work, lx_recovery_work);
+}
+
+/* may be called from any context, also while a recovery is running */
+void lx_recovery_schedule(struct lx_chip *chip)
+{
+	if (!auto_recover)
+		return;
+	if (atomic_xchg(&chip->recovery_pending, 1))
+		return;
+	schedule_work(&chip->recovery_work);
+}
+
+void lx_recovery_stop(struct lx_chip *chip)
+{
+	atomic_set(&chip->recovery_pending, 1);	/* no more schedules */
+	cancel_work_sync(&chip->recovery_work);
+}
+
+/* peak meters
+ * Reading the peaks takes one CMD_12_GET_PEAK per 4 channels. Instead of
+ * letting every reader send them, a delayed work samples both directions
+ * every meter_period_ms and publishes the result through a latch: readers
+ * copy levels[seq & 1] and retry if seq moved meanwhile, they never block
+ * nor talk to the firmware. The sampler only runs while somebody read the
+ * meters during the last LX_METER_IDLE_MS, so the first read after a pause
+ * returns the last values seen.
+ */
+#define LX_METER_IDLE_MS	2000
+
+static unsigned int meter_period_ms = 50;
+module_param(meter_period_ms, uint, 0644);
+MODULE_PARM_DESC(meter_period_ms,
+	"Peak meter refresh period in ms, 0 disables the sampler.");
+
+static void lx_meter_publish(struct lx_meter *meter)
+{
+	int copy;
+
+	/* seq is even between publishes: odd sends the readers to copy 1
+	 * while copy 0 is updated, even back to copy 0 while copy 1 is
+	 */
+	for (copy = 0; copy < 2; copy++) {
+		WRITE_ONCE(meter->seq, meter->seq + 1);
+		smp_wmb();
+		memcpy(meter->levels[copy], meter->scratch,
+				sizeof(meter->scratch));
+		smp_wmb();
+	}
+}
+
+/* run the sampling next to the interrupt when the card is pinned */
+static void lx_meter_kick(struct lx_meter *meter, unsigned long delay)
+{
+	struct lx_chip *chip = container_of(meter, struct lx_chip, meter);
+	int cpu = READ_ONCE(chip->irq_cpu);
+
+	if (cpu >= 0 && cpu_online(cpu))
+		schedule_delayed_work_on(cpu, &meter->work, delay);
+	else
+		schedule_delayed_work(&meter->work, delay);
+}
+
+static void lx_meter_work(struct work_struct *work)
+{
+	struct lx_meter *meter = container_of(to_delayed_work(work),
+			struct lx_meter, work);
+	struct lx_chip *chip = container_of(meter, struct lx_chip, meter);
+	unsigned long idle = msecs_to_jiffies(LX_METER_IDLE_MS);
+	int is_capture;
+
+	if (meter_period_ms == 0 ||
+	    time_after(jiffies, READ_ONCE(meter->last_read) + idle)) {
+		atomic_set(&meter->active, 0);
+		smp_mb();
+		/* a reader may have come by before active was cleared */
+		if (meter_period_ms == 0 ||
+		    time_after(jiffies, READ_ONCE(meter->last_read) + idle) ||
+		    atomic_xchg(&meter->active, 1))
+			return;
+	}
+
+	for (is_capture = 0; is_capture < 2; is_capture++)
+		lx_level_peaks(chip, is_capture, meter->channels,
+				meter->scratch[is_capture]);
+	lx_meter_publish(meter);
+	meter->samples++;
+
+	lx_meter_kick(meter, msecs_to_jiffies(meter_period_ms));
+}
+
+void lx_meter_init(struct lx_chip *chip)
+{
+	struct lx_meter *meter = &chip->meter;
+
+	memset(meter, 0, sizeof(*meter));
+	meter->channels = min_t(unsigned int, chip->max_channels,
+			LX_METER_CHANNELS_MAX);
+	atomic_set(&meter->active, 0);
+	INIT_DELAYED_WORK(&meter->work, lx_meter_work);
+}
+
+void lx_meter_stop(struct lx_chip *chip)
+{
+	atomic_set(&chip->meter.active, 1);	/* no more kicks */
+	cancel_delayed_work_sync(&chip->meter.work);
+}
+
+/* copy the last published peaks of one direction, meter.channels values */
+void lx_meter_read(struct lx_chip *chip, int is_capture, u32 *levels)
+{
+	struct lx_meter *meter = &chip->meter;
+	unsigned int seq;
+
+	WRITE_ONCE(meter->last_read, jiffies);
+	if (meter_period_ms && !atomic_xchg(&meter->active, 1))
+		lx_meter_kick(meter, 0);
+
+	do {
+		seq = READ_ONCE(meter->seq);
+		smp_rmb();
+		memcpy(levels, meter->levels[seq & 1][is_capture],
+				meter->channels * sizeof(u32));
+		smp_rmb();
+	} while (seq != READ_ONCE(meter->seq));
+}
+
+static const DECLARE_TLV_DB_LINEAR(lx_meter_db_scale, TLV_DB_GAIN_MUTE, 0);
+
+static int lx_meter_info(struct snd_kcontrol *kcontrol,
+		struct snd_ctl_elem_info *info)
+{
+	struct lx_chip *chip = snd_kcontrol_chip(kcontrol);
+
+	info->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	info->count = chip->meter.channels;
+	info->value.integer.min = 0;
+	info->value.integer.max = 0x7FFFFF;
+	return 0;
+}
+
+static int lx_meter_get(struct snd_kcontrol *kcontrol,
+		struct snd_ctl_elem_value *value)
+{
+	struct lx_chip *chip = snd_kcontrol_chip(kcontrol);
+	u32 levels[LX_METER_CHANNELS_MAX];
+	unsigned int i;
+
+	lx_meter_read(chip, kcontrol->private_value, levels);
+	for (i = 0; i < chip->meter.channels; i++)
+		value->value.integer.value[i] = levels[i];
+	return 0;
+}
+
+static struct snd_kcontrol_new lx_meter_controls[] = {
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Playback Peak Volume",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			SNDRV_CTL_ELEM_ACCESS_VOLATILE |
+			SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = lx_meter_info,
+		.get = lx_meter_get,
+		.tlv = { .p = lx_meter_db_scale },
+		.private_value = 0,
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "Capture Peak Volume",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			SNDRV_CTL_ELEM_ACCESS_VOLATILE |
+			SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+		.info = lx_meter_info,
+		.get = lx_meter_get,
+		.tlv = { .p = lx_meter_db_scale },
+		.private_value = 1,
+	},
+};
+
 void lx_proc_levels_read(struct snd_info_entry *entry,
 		struct snd_info_buffer *buffer)
 {
-	u32 levels[64];
-	int err;
-	int i, j;
+	u32 levels[LX_METER_CHANNELS_MAX];
 	struct lx_chip *chip = entry->private_data;
-	/*printk(KERN_DEBUG  "%s\n", __func__);*/
+	int is_capture;
+	unsigned int i;
+
+	snd_iprintf(buffer, "samples: %u, period: %u ms\n",
+			chip->meter.samples, meter_period_ms);
+
+	for (is_capture = 1; is_capture >= 0; is_capture--) {
+		snd_iprintf(buffer, "\n%s levels:\n",
+				is_capture ? "capture" : "playback");
+		lx_meter_read(chip, is_capture, levels);
+		for (i = 0; i < chip->meter.channels; i++)
+			snd_iprintf(buffer, "%08x%s", levels[i],
+					(i % 8) == 7 ? "\n" : " ");
+	}
+	snd_iprintf(buffer, "\n");
+}
 
-	snd_iprintf(buffer, "capture levels:\n");
-	err = lx_level_peaks(chip, 1, 64, levels);
-	if (err < 0)
-		return;
+int lx_meter_create(struct snd_card *card, struct lx_chip *chip)
+{
+	struct snd_info_entry *entry;
+	unsigned int idx;
+	int err;
 
-	for (i = 0; i != 8; ++i) {
-		for (j = 0; j != 8; ++j)
-			snd_iprintf(buffer, "%08x ", levels[i * 8 + j]);
-		snd_iprintf(buffer, "\n");
+	err = snd_card_proc_new(card, "levels", &entry);
+	if (err < 0) {
+		dev_err(chip->card->dev,
+			"%s, snd_card_proc_new levels\n", __func__);
+		return err;
 	}
+	snd_info_set_text_ops(entry, chip, lx_proc_levels_read);
 
-	snd_iprintf(buffer, "\nplayback levels:\n");
+	for (idx = 0; idx < ARRAY_SIZE(lx_meter_controls); idx++) {
+		err = snd_ctl_add(card,
+				snd_ctl_new1(&lx_meter_controls[idx], chip));
+		if (err < 0) {
+			dev_err(chip->card->dev,
+				"%s, snd_ctl_add failed\n", __func__);
+			return err;
+		}
+	}
 
-	err = lx_level_peaks(chip, chip->first_channel_selector, 64, levels);
-	if (err < 0)
+	return 0;
+}
+
+void lx_proc_get_dma(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer)
+{
+	struct lx_chip *chip = entry->private_data;
+	struct snd_pcm_substream *substream;
+	size_t reserved = 0;
+	size_t allocated = 0;
+	int is_capture;
+	unsigned int i;
+
+	if (!chip->pcm)
 		return;
 
-	for (i = 0; i != 8; ++i) {
-		for (j = 0; j != 8; ++j)
-			snd_iprintf(buffer, "%08x ", levels[i * 8 + j]);
-		snd_iprintf(buffer, "\n");
+	mutex_lock(&chip->setup_mutex);
+	for (is_capture = 0; is_capture <= 1; is_capture++) {
+		for (substream = chip->pcm->streams[is_capture].substream;
+				substream; substream = substream->next)
+			reserved += substream->dma_buffer.bytes;
+		for (i = 0; i < chip->substreams; i++)
+			allocated +=
+				lx_chip_stream(chip, is_capture, i)->dma_bytes;
 	}
-	snd_iprintf(buffer, "\n");
+	mutex_unlock(&chip->setup_mutex);
+
+	snd_iprintf(buffer, "dma buffers (bytes):\n"
+			"\treserved:  %zu\n"
+			"\tallocated: %zu\n"
+			"\ttotal:     %zu\n",
+			reserved, allocated, reserved + allocated);
 }
 
 int lx_proc_create(struct snd_card *card, struct lx_chip *chip)
 {
 	struct snd_info_entry *entry;
 	int err = 0;
-/*	still have bugs
-*        err = snd_card_proc_new(card, "levels", &entry);
-*        printk(KERN_DEBUG "%s\n", __func__);
-*        if (err < 0) {
-*                dev_err(chip->card->dev, "%s, snd_card_proc_new\n", __func__);
-*                return err;
-*        }
-*
-*        snd_info_set_text_ops(entry, chip, lx_proc_levels_read);
-*/
-
 	err = snd_card_proc_new(card, "Irqs", &entry);
 	/*dev_err(chip->card->dev, "%s\n", __func__);*/
 	if (err < 0) {
@@ -1349,6 +2551,42 @@ int lx_proc_create(struct snd_card *card, struct lx_chip *chip)
 	}
 
 	snd_info_set_text_ops(entry, chip, lx_proc_get_irq_counter);
+	entry->c.text.write = lx_proc_set_irq_counter;
+	entry->mode |= 0200;
+
+	err = snd_card_proc_new(card, "Commands", &entry);
+	if (err < 0) {
+		dev_err(chip->card->dev,
+			"%s, snd_card_proc_new Commands\n",
+			__func__);
+		return err;
+	}
+
+	snd_info_set_text_ops(entry, chip, lx_proc_get_cmd_stats);
+	entry->c.text.write = lx_proc_set_cmd_stats;
+	entry->mode |= 0200;
+
+	err = snd_card_proc_new(card, "Mmio", &entry);
+	if (err < 0) {
+		dev_err(chip->card->dev,
+			"%s, snd_card_proc_new Mmio\n",
+			__func__);
+		return err;
+	}
+
+	snd_info_set_text_ops(entry, chip, lx_proc_get_mmio_stats);
+	entry->c.text.write = lx_proc_set_mmio_stats;
+	entry->mode |= 0200;
+
+	err = snd_card_proc_new(card, "Dma", &entry);
+	if (err < 0) {
+		dev_err(chip->card->dev,
+			"%s, snd_card_proc_new Dma\n",
+			__func__);
+		return err;
+	}
+
+	snd_info_set_text_ops(entry, chip, lx_proc_get_dma);
 
 	return 0;
 }
@@ -1358,7 +2596,22 @@ int lx_proc_create(struct snd_card *card, struct lx_chip *chip)
  * driver generic inits
  */
 
-
+/* the period irq blocks of struct lx_chip start a cache line each, and the
+ * irq fields of a stream fit in its first one
+ */
+static inline void lx_chip_check_layout(void)
+{
+#ifdef CONFIG_SMP
+	BUILD_BUG_ON(offsetof(struct lx_chip, playback_streams) %
+			SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct lx_chip, capture_streams) %
+			SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetofend(struct lx_stream, irq_timer_carry) >
+			SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct lx_chip, irq_pending_lock) %
+			SMP_CACHE_BYTES);
+#endif
+}
 
 int snd_create_generic(struct snd_card *card, struct pci_dev *pci,
 		struct lx_chip **rchip, unsigned char lx_type,
@@ -1367,14 +2620,15 @@ int snd_create_generic(struct snd_card *card, struct pci_dev *pci,
 		struct snd_pcm_ops *lx_ops_capture)
 {
 	struct lx_chip *chip;
+	unsigned int idx;
 	int err;
-//	unsigned int idx;
 //	struct snd_kcontrol *kcontrol;
 	static struct snd_device_ops ops = {
 			.dev_free = snd_lx_dev_free,
 	};
 /*	printk(KERN_DEBUG "%s\n", __func__);*/
 
+	lx_chip_check_layout();
 	*rchip = NULL;
 
 	/* enable PCI device */
@@ -1420,11 +2674,14 @@ int snd_create_generic(struct snd_card *card, struct pci_dev *pci,
 	}
 	*rchip = chip;
 
-	atomic_set(&chip->irq_pending, 0);
-	atomic_set(&chip->play_xrun_advertise, 0);
-	atomic_set(&chip->capture_xrun_advertise, 0);
-	atomic_set(&chip->debug_irq.atomic_irq_handled, 0);
-
+	spin_lock_init(&chip->irq_pending_lock);
+	spin_lock_init(&chip->irq_stats_lock);
+	chip->irq_cpu = -1;
+	chip->irq_stats = alloc_percpu(struct lx_irq_stats);
+	if (chip->irq_stats == NULL) {
+		err = -ENOMEM;
+		goto request_regions_failed;
+	}
 	chip->card = card;
 	chip->pci = pci;
 	chip->irq = -1;
@@ -1446,6 +2703,11 @@ int snd_create_generic(struct snd_card *card, struct pci_dev *pci,
 	/* initialize synchronization structs */
 	mutex_init(&chip->msg_lock);
 	mutex_init(&chip->setup_mutex);
+	lx_mmio_init(chip);
+	lx_cmdq_init(chip);
+	lx_recovery_init(chip);
+	lx_meter_init(chip);
+	lx_tstamp_init(chip);
 	chip->lx_chip_index = lx_chips_count;
 
 	/* initialize synchronization structs */
@@ -1473,51 +2735,46 @@ int snd_create_generic(struct snd_card *card, struct pci_dev *pci,
 	/* dsp port */
 	chip->port_dsp_bar = pci_ioremap_bar(pci, 2);
 
-	chip->capture_stream.status = LX_STREAM_STATUS_STOPPED;
-	chip->playback_stream.status = LX_STREAM_STATUS_STOPPED;
-
-	chip->debug_irq.irq_all = 0;
-	chip->debug_irq.irq_wakeup_thread = 0;
-	chip->debug_irq.irq_play_begin = 0;
-	chip->debug_irq.irq_play = 0;
-	chip->debug_irq.irq_play_unhandled = 0;
-	chip->debug_irq.irq_record = 0;
-	chip->debug_irq.irq_record_unhandled = 0;
-	chip->debug_irq.irq_play_and_record = 0;
-	chip->debug_irq.irq_none = 0;
-	chip->debug_irq.irq_handled = 0;
-	atomic_set(&chip->debug_irq.atomic_irq_handled, 0);
-	chip->debug_irq.irq_urun = 0;
-	chip->debug_irq.irq_orun = 0;
-	chip->debug_irq.irq_freq = 0;
-	chip->debug_irq.irq_esa = 0;
-	chip->debug_irq.irq_timer = 0;
-	chip->debug_irq.irq_eot = 0;
-	chip->debug_irq.irq_xes = 0;
-	chip->debug_irq.wakeup_thread = 0;
-	chip->debug_irq.thread_play = 0;
-	chip->debug_irq.thread_record_but_stop = 0;
-	chip->debug_irq.thread_record = 0;
-	chip->debug_irq.thread_play_but_stop = 0;
-	chip->debug_irq.thread_play_and_record = 0;
-	chip->debug_irq.async_event_eobi = 0;
-	chip->debug_irq.async_event_eobo = 0;
-	chip->debug_irq.async_urun = 0;
-	chip->debug_irq.async_event_eobo = 0;
+	chip->substreams = clamp_t(unsigned int, substreams, 1,
+			LX_SUBSTREAMS_MAX);
+	for (idx = 0; idx < LX_SUBSTREAMS_MAX; idx++) {
+		chip->playback_streams[idx].status = LX_STREAM_STATUS_STOPPED;
+		atomic_set(&chip->playback_streams[idx].xrun_advertise, 0);
+		chip->capture_streams[idx].status = LX_STREAM_STATUS_STOPPED;
+		atomic_set(&chip->capture_streams[idx].xrun_advertise, 0);
+		chip->capture_streams[idx].is_capture = 1;
+	}
+
 	chip->debug_irq.cmd_irq_waiting = 0;
+	chip->debug_irq.cmd_event = 0;
+	chip->debug_irq.cmd_event_spin = 0;
+	chip->debug_irq.cmd_event_polled = 0;
+	chip->debug_irq.cmd_wait_max_us = 0;
+	chip->debug_irq.cmd_wait_total_us = 0;
+	chip->debug_irq.cmd_transactions = 0;
+	chip->debug_irq.cmd_transaction_cmds = 0;
+	chip->debug_irq.cmd_transaction_max_us = 0;
+	chip->debug_irq.cmd_transaction_total_us = 0;
+	memset(chip->debug_irq.stop_last_us, 0,
+			sizeof(chip->debug_irq.stop_last_us));
+	memset(chip->debug_irq.stop_max_us, 0,
+			sizeof(chip->debug_irq.stop_max_us));
 	chip->jiffies_start = -1;
 	chip->jiffies_1st_irq = -1;
 
 	chip->irq = -1;
 
 	if (chip->lx_type == LX_IP) {
-		err = request_threaded_irq(pci->irq, lx_interrupt, NULL,
+		err = request_threaded_irq(pci->irq, lx_interrupt,
+		lx_interrupt_thread,
 		IRQF_SHARED, "LX-IP", chip);
 	} else if (chip->lx_type == LX_IP_MADI) {
-		err = request_threaded_irq(pci->irq, lx_interrupt, NULL,
+		err = request_threaded_irq(pci->irq, lx_interrupt,
+		lx_interrupt_thread,
 		IRQF_SHARED, "LX-IP-MADI", chip);
 	} else if (chip->lx_type == LX_MADI) {
-		err = request_threaded_irq(pci->irq, lx_interrupt, NULL,
+		err = request_threaded_irq(pci->irq, lx_interrupt,
+		lx_interrupt_thread,
 		IRQF_SHARED, "LX-MADI", chip);
 	} else
 		err = -EINVAL;
@@ -1527,6 +2784,7 @@ int snd_create_generic(struct snd_card *card, struct pci_dev *pci,
 		goto request_irq_failed;
 	}
 	chip->irq = pci->irq;
+	lx_irq_affinity_init(chip);
 
 	err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, chip, &ops);
 	if (err < 0)
@@ -1557,16 +2815,29 @@ int snd_create_generic(struct snd_card *card, struct pci_dev *pci,
 		goto device_new_failed;
 	}
 
+	err = lx_meter_create(card, chip);
+	if (err < 0) {
+		dev_err(&pci->dev,
+			"%s,lx_meter_create failed\n", __func__);
+		goto device_new_failed;
+	}
+
 	return 0;
 
 device_new_failed:
+	lx_recovery_stop(chip);
+	lx_meter_stop(chip);
+	lx_tstamp_stop(chip);
+	lx_irq_affinity_release(chip);
 	if (chip->irq >= 0)
 		free_irq(pci->irq, chip);
+	lx_cmdq_flush(chip);
 
 request_irq_failed:
 	pci_release_regions(pci);
 
 request_regions_failed:
+	free_percpu(chip->irq_stats);
 	kfree(chip);
 
 alloc_failed:
@@ -1585,16 +2856,19 @@ int lx_pcm_create_generic(struct lx_chip *chip, unsigned int dma_max_size,
 
 /*        printk(KERN_DEBUG  "%s\n", __func__);*/
 
-	size = PAGE_ALIGN(size);
+	/* the substreams share the channels out */
+	size = PAGE_ALIGN(DIV_ROUND_UP(size, chip->substreams));
 
 	/* hardcoded device name & channel count */
 	if (chip->lx_type == LX_IP)
-		err = snd_pcm_new(chip->card, (char *)"LX_IP", 0, 1, 1, &pcm);
+		err = snd_pcm_new(chip->card, (char *)"LX_IP", 0,
+				chip->substreams, chip->substreams, &pcm);
 	else if (chip->lx_type == LX_IP_MADI)
-		err = snd_pcm_new(chip->card, (char *)"LX_IP_MADI", 0, 1, 1,
-				&pcm);
+		err = snd_pcm_new(chip->card, (char *)"LX_IP_MADI", 0,
+				chip->substreams, chip->substreams, &pcm);
 	else if (chip->lx_type == LX_MADI)
-		err = snd_pcm_new(chip->card, (char *)"LX_MADI", 0, 1, 1, &pcm);
+		err = snd_pcm_new(chip->card, (char *)"LX_MADI", 0,
+				chip->substreams, chip->substreams, &pcm);
 	else
 		/*unknown card*/
 		err = -EINVAL;
@@ -1618,20 +2892,10 @@ int lx_pcm_create_generic(struct lx_chip *chip, unsigned int dma_max_size,
 	if (err < 0)
 		return err;
 
-#if PREALLOCATE_PAGES_FOR_ALL_RETURNS_NO_ERR
-	snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_DEV,
-			snd_dma_pci_data(chip->pci), size, size);
-#else
-	err = snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_DEV,
-			snd_dma_pci_data(chip->pci), size, size);
-	if (err < 0) {
-		dev_err(chip->card->dev,
-		"%s, snd_pcm_lib_preallocate_pages_for_all failed", __func__);
+	err = lx_pcm_buffers_init(chip, pcm, size);
+	if (err < 0)
 		return err;
-	}
-#endif
 	chip->pcm = pcm;
-	chip->capture_stream.is_capture = 1;
 
 	return 0;
 }
@@ -1639,29 +2903,33 @@ void snd_lx_generic_remove(struct pci_dev *pci)
 {
 	struct snd_card *card = pci_get_drvdata(pci);
 	struct lx_chip *chip = card->private_data;
+	struct lx_stream *lx_stream;
+	unsigned int i;
 	int is_capture = 0;
 	int err = 0;
 
-	for (is_capture = 0; is_capture <= 1; is_capture++) {
-		if (chip->hardware_running[is_capture] > 1) {
-			err = lx_pipe_stop(chip, is_capture);
+	for (is_capture = 0; is_capture <= 1; is_capture++)
+	    for (i = 0; i < chip->substreams; i++) {
+		lx_stream = lx_chip_stream(chip, is_capture, i);
+		if (lx_stream->hardware_running > 1) {
+			err = lx_pipe_stop(chip, lx_stream);
 			if (err < 0) {
 				dev_err(&pci->dev,
 				"%s, failed to stop hardware. Error code %d\n",
 				__func__, err);
 			}
-			chip->hardware_running[is_capture] = 1;
+			lx_stream->hardware_running = 1;
 		}
-		if (chip->hardware_running[is_capture] == 1) {
-			err = lx_pipe_close(chip, is_capture);
+		if (lx_stream->hardware_running == 1) {
+			err = lx_pipe_close(chip, lx_stream);
 			if (err < 0) {
 				dev_err(&pci->dev,
 				"%s failed to close hardware. Error code %d\n",
 				__func__, err);
 			}
-			chip->hardware_running[is_capture] = 0;
+			lx_stream->hardware_running = 0;
 		}
-	}
+	    }
 
 	lx_chips_count--;
 
@@ -30,6 +30,14 @@
 #include <sound/info.h>
 #include <linux/atomic.h>
 #include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <linux/percpu.h>
+#include <asm/local64.h>
 
 #ifdef RHEL_RELEASE_CODE
 #  define HAVE_SND_CARD_NEW (RHEL_RELEASE_CODE >= RHEL_RELEASE_VERSION(7,5))
@@ -38,6 +46,8 @@
 #  define HAVE_SND_CARD_NEW (LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0))
 #  define PREALLOCATE_PAGES_FOR_ALL_RETURNS_NO_ERR (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0))
 #endif
+/* the pcm core allocates the buffer before hw_params and frees it after hw_free */
+#define HAVE_SND_PCM_MANAGED_BUFFER (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0))
 
 
 
@@ -58,13 +68,42 @@ enum lx_stream_status {
 	LX_STREAM_STATUS_STOPPED,
 };
 
+/* substreams per direction, each on its own pipe, see lx_substream_pipe() */
+#define LX_SUBSTREAMS_MAX	8
+
+/*
+ * one substream. The fields up to irq_timer_carry are written by the period
+ * irq and read by the pointer callback, each stream starts a cache line so
+ * that the streams never share one, see lx_chip_check_layout().
+ */
 struct lx_stream {
 	struct snd_pcm_substream *stream;
 	snd_pcm_uframes_t frame_pos;
+	ktime_t period_time;	/* of the last frame_pos change */
+	u64 periods_elapsed;	/* since prepare, for the link timestamps */
 	/* volatile enum lx_stream_status status; */
 	enum lx_stream_status status;
+	atomic_t xrun_advertise;
+	/* cpt in order to compare embedded cpt -> detect XRUN/ORUN.*/
+	unsigned int irq_audio_cpt;
+	unsigned int irq_timer_cpt;
+	unsigned int irq_timer_carry;	/* granules */
+
+	/* set up by prepare and the triggers */
+	u32 period_ns;		/* expected period irq interval */
+	u32 irq_timer_wanted;	/* granules, see lx_irq_moderation_set() */
+	unsigned char period_multiple_gran;
+	bool irq_moderated;	/* on the timer irq */
+	unsigned char pipe;	/* firmware pipe, also its first channel */
+	unsigned char hardware_running;	/* 1 pipe allocated, 2 started */
+	size_t dma_bytes;	/* allocated by hw_params, 0 on the reserve */
 	unsigned int is_capture :1;
-};
+
+	/* CMD_0E sample since prepare, see lx_tstamp_work() */
+	u64 hw_frames;
+	ktime_t hw_time;	/* 0 before the first one */
+	u32 hw_accuracy_ns;
+} ____cacheline_aligned_in_smp;
 
 enum lx_madi_clock_sync {
 	LXMADI_CLOCK_SYNC_MADI = 0x00,
@@ -103,47 +142,116 @@ enum lx_type {
 	LX_IP_MADI,
 };
 
-struct debug_irq_counters {
-	/*irq part*/
-	unsigned int irq_play_begin;	/* wakeup just for play*/
-	unsigned int irq_play;		/* wakeup just for play*/
-	/* irq for hw but not handled any more by alsa (stop sequence)*/
-	unsigned int irq_play_unhandled;
-	unsigned int irq_record;		/* wakeup just for record */
+/* peak meters, see lx_meter_work() */
+#define LX_METER_CHANNELS_MAX	128
+
+struct lx_meter {
+	struct delayed_work work;
+	unsigned int channels;
+	unsigned long last_read;	/* jiffies of the last reader */
+	atomic_t active;		/* sampler is scheduled */
+	/* latch: readers use levels[seq & 1], the sampler updates both */
+	unsigned int seq;
+	u32 levels[2][2][LX_METER_CHANNELS_MAX];	/* [copy][is_capture] */
+	u32 scratch[2][LX_METER_CHANNELS_MAX];		/* sampler only */
+	unsigned int samples;
+};
+
+/* interrupt sources the hard handler leaves to the irq thread */
+struct lx_irq_pending {
+	u32 irqsrc;		/* or of the LX_IRQ_THREAD_EVENTS acked */
+	ktime_t time;		/* entry of the oldest irq folded in */
+	/* EOBO/EOBI of several running streams, some just started */
+	u32 eob_shared;
+	u32 eob_cpt;		/* granule counter of the last of those irqs */
+};
+
+/* interrupt path statistics, counted per cpu, see lx_irq_stats_snapshot() */
+enum lx_irq_stat {
+	LX_IRQ_STAT_ALL,		/* handler calls */
+	LX_IRQ_STAT_NONE,		/* somebody else is on the irq line */
+	LX_IRQ_STAT_CMD_DONE,
+	LX_IRQ_STAT_WAKEUP_THREAD,
+	LX_IRQ_STAT_THREAD,		/* thread runs, irqs may be folded */
+	LX_IRQ_STAT_PLAY_BEGIN,		/* play irqs before the first duplex */
+	LX_IRQ_STAT_PLAY,		/* period irqs just for play */
 	/* irq for hw but not handled any more by alsa (stop sequence) */
-	unsigned int irq_record_unhandled;
-	unsigned int irq_play_and_record; /* wakeup for both */
-	/* wakeup for someone else. somebody else is on the irq... */
-	unsigned int irq_none;
-	/* the LX wake up us but for nothing important or for an error... */
-	unsigned int irq_handled;
-	atomic_t atomic_irq_handled;
-	unsigned int irq_urun;
-	unsigned int irq_orun;
-	unsigned int irq_freq;
-	unsigned int irq_esa;
-	unsigned int irq_timer;
-	unsigned int irq_eot;
-	unsigned int irq_xes;
-	unsigned int irq_wakeup_thread;
-
-	/*thread part*/
-	unsigned int thread_play;	/* wakeup just for play */
-	unsigned int thread_record;	/* wakeup just for record */
-	unsigned int thread_play_and_record; /* wakeup for both */
-	unsigned int wakeup_thread;
-	unsigned int irq_all;
-	/*atomic_t irq_all;*/
-	u64 async_event_eobi;
-	u64 async_event_eobo;
-	u64 async_urun;
-	u64 async_orun;
-
-	unsigned int thread_record_but_stop;
-	unsigned int thread_play_but_stop;
-
-	/*cmds*/
-	unsigned int cmd_irq_waiting;
+	LX_IRQ_STAT_PLAY_UNHANDLED,
+	LX_IRQ_STAT_RECORD,		/* period irqs just for record */
+	LX_IRQ_STAT_RECORD_UNHANDLED,
+	LX_IRQ_STAT_PLAY_AND_RECORD,	/* period irqs for both */
+	LX_IRQ_STAT_URUN,		/* flagged or granule counter mismatch */
+	LX_IRQ_STAT_ORUN,
+	LX_IRQ_STAT_RESYNC,		/* missed periods caught up, irq_resync */
+	LX_IRQ_STAT_FREQ,
+	LX_IRQ_STAT_ESA,
+	LX_IRQ_STAT_TIMER,
+	LX_IRQ_STAT_EOT,
+	LX_IRQ_STAT_XES,
+	LX_IRQ_STAT_HANDLER_NS,		/* hard irq residency */
+	LX_IRQ_STAT_THREAD_NS,
+	LX_IRQ_STAT_WAKEUP_NS,		/* hard irq entry to irq thread run */
+	LX_IRQ_STAT_PLAY_JITTER_NS,	/* period irq interval off the period */
+	LX_IRQ_STAT_RECORD_JITTER_NS,
+	/* the counters above add up across cpus, the ones below are maxima */
+	LX_IRQ_STAT_SUMS,
+	LX_IRQ_STAT_HANDLER_MAX_NS = LX_IRQ_STAT_SUMS,
+	LX_IRQ_STAT_THREAD_MAX_NS,
+	LX_IRQ_STAT_WAKEUP_MAX_NS,
+	LX_IRQ_STAT_PLAY_JITTER_MAX_NS,
+	LX_IRQ_STAT_RECORD_JITTER_MAX_NS,
+	LX_IRQ_STAT_COUNT
+};
+
+/* log2(us) histograms of the same durations, buckets as the commands' */
+enum lx_irq_hist {
+	LX_IRQ_HIST_HANDLER,
+	LX_IRQ_HIST_WAKEUP,
+	LX_IRQ_HIST_PLAY_JITTER,
+	LX_IRQ_HIST_RECORD_JITTER,
+	LX_IRQ_HIST_COUNT
+};
+
+#define LX_IRQ_HIST_BUCKETS	LX_CMD_STATS_BUCKETS
+
+/* written by the local cpu only, the bases are taken by the resets */
+struct lx_irq_stats {
+	local64_t v[LX_IRQ_STAT_COUNT];
+	local64_t hist[LX_IRQ_HIST_COUNT][LX_IRQ_HIST_BUCKETS];
+	local64_t mmio[LX_MMIO_STATS];
+	u64 base[LX_IRQ_STAT_SUMS];
+	u64 hist_base[LX_IRQ_HIST_COUNT][LX_IRQ_HIST_BUCKETS];
+	u64 mmio_base[LX_MMIO_STATS];
+};
+
+struct lx_irq_stats_snapshot {
+	u64 v[LX_IRQ_STAT_COUNT];
+	u64 hist[LX_IRQ_HIST_COUNT][LX_IRQ_HIST_BUCKETS];
+};
+
+/* process context statistics, serialized by the setup paths */
+struct debug_irq_counters {
+	/*cmds, under cmdq_lock*/
+	unsigned int cmd_irq_waiting;	/* event commands that had to sleep */
+	unsigned int cmd_event;		/* commands answered by event */
+	unsigned int cmd_event_spin;	/* answered during the spin phase */
+	unsigned int cmd_event_polled;	/* event asked from atomic context */
+	unsigned int cmd_wait_max_us;
+	u64 cmd_wait_total_us;
+	unsigned int cmd_transactions;
+	unsigned int cmd_transaction_cmds;
+	unsigned int cmd_transaction_max_us;
+	u64 cmd_transaction_total_us;
+
+	/*dsp recoveries*/
+	unsigned int recoveries;
+	unsigned int recovery_failed;
+	unsigned int recovery_last_us;
+	unsigned int recovery_max_us;
+
+	/*pipe stops, toggle to idle, indexed by is_capture*/
+	unsigned int stop_last_us[2];
+	unsigned int stop_max_us[2];
 
 };
 
@@ -170,12 +278,12 @@ struct lx_chip {
 	/* messaging */
 	struct mutex msg_lock; /* message lock */
 	struct lx_rmh rmh;
+	struct lx_transaction trans;	/* under msg_lock */
 	u32 irqsrc;
 
 	/* configuration */
 	uint freq_ratio :2;
 	uint playback_mute :1;
-	uint hardware_running[2];
 	u32 board_sample_rate;	/* sample rate read from
 				* board
 				*/
@@ -187,12 +295,7 @@ struct lx_chip {
 
 	/* pcm */
 	struct snd_pcm *pcm;
-
-	/* streams */
-	struct lx_stream capture_stream;
-	struct lx_stream playback_stream;
-	atomic_t play_xrun_advertise;
-	atomic_t capture_xrun_advertise;
+	unsigned int substreams;	/* per direction */
 
 	/*mixer for all LX*/
 	int first_channel_selector;
@@ -212,35 +315,107 @@ struct lx_chip {
 	struct snd_kcontrol *mixer_wordclock_out_ctl;
 	struct snd_kcontrol *mixer_current_clock_ctl;
 
-	atomic_t message_pending;
+	unsigned int cmd_wait_avg_us;	/* average of event waits, cmdq_lock */
+
+	/* command queue, see lx_cmd_submit() */
+	spinlock_t cmdq_lock;
+	struct list_head cmdq[LX_CMD_PRIO_COUNT];
+	struct lx_cmd_req *cmdq_active;	/* request on the mailbox */
+	struct timer_list cmdq_timer;
+	struct lx_cmd_req event_req;	/* async CMD_04_GET_EVENT */
+	struct lx_rmh event_rmh;
+	atomic_t event_req_pending;
+
+	struct lx_meter meter;
+
+	/* sample counter reader, see lx_tstamp_work() */
+	struct delayed_work tstamp_work;
+	unsigned long tstamp_last_read;	/* jiffies of the last reader */
+	atomic_t tstamp_active;		/* sampler is scheduled */
+
+	/* dsp register shadows, see lx_dsp_reg_update() */
+	spinlock_t dsp_shadow_lock;
+	u32 dsp_shadow[REG_MAX_PORT];
+	u32 dsp_shadow_valid;		/* bit per port */
+	bool cmdq_csm_clear;		/* REG_CSM known to be 0 */
+	unsigned int cmdq_timeouts;	/* in a row, under cmdq_lock */
+	atomic_t cmdq_inject_timeouts;	/* commands left to drop, testing */
+	bool cmdq_inject_busy;		/* REG_CSM_MC reads stuck, testing */
+
+	/* dsp recovery, see lx_recovery_work() */
+	struct work_struct recovery_work;
+	atomic_t recovery_pending;
+
+	/* command latencies, indexed by opcode and response type */
+	spinlock_t cmd_stats_lock;
+	struct lx_cmd_stats cmd_stats[CMD_INVALID][LX_CMD_STATS_RESPONSES];
+	struct lx_bench_result bench[LX_BENCH_OPS];
 
 	/*Kthread*/
 	unsigned int thread_wakeup;
 	struct task_struct *pThread;
 	unsigned char thread_stop;
 	unsigned char thread_stream_update;
-	/* cpt in order to compare embedded cpt -> detect XRUN/ORUN.*/
-	unsigned int irq_audio_cpt_play;
-	/* cpt in order to compare embedded cpt -> detect XRUN/ORUN.*/
-	unsigned int irq_audio_cpt_record;
-	unsigned char play_period_multiple_gran;
-	unsigned char capture_period_multiple_gran;
 
 	/*TODO DEBUG*/
 	struct debug_irq_counters debug_irq;
-	atomic_t irq_pending;
+	/* timer irq period in granules, programmed for the streams */
+	u32 irq_timer_gran;
+	atomic_t irq_timer_ticks;	/* see lx_irq_timer_check() */
+	int irq_timer_checked;		/* 0 not yet, 1 rate seen, -1 not */
+	/* irq affinity, see lx_irq_set_cpu() */
+	int irq_cpu;			/* -1 when not pinned */
+	spinlock_t irq_stats_lock;	/* snapshot against reset */
 
 	unsigned char capture_stream_prerared;
 	unsigned char playback_stream_prerared;
 
 	unsigned long jiffies_start;
-	unsigned long jiffies_1st_irq;
 
 	/*in case of external clock loose*/
 	int	(*set_internal_clock)(struct lx_chip *chip);
-
+	/*after a dsp recovery, write the card settings again*/
+	int	(*restore_config)(struct lx_chip *chip);
+
+	/*
+	 * fields of the period interrupt path, kept at the end of the chip in
+	 * blocks starting a cache line each so that the configuration, the
+	 * mailbox and the statistics written from other cpus never share a
+	 * line with them. A stream is written by the irq and read by its own
+	 * pointer callback only.
+	 * checked by lx_chip_check_layout(), see also "make layout".
+	 */
+	struct lx_stream playback_streams[LX_SUBSTREAMS_MAX];
+	struct lx_stream capture_streams[LX_SUBSTREAMS_MAX];
+
+	/* written by the hard irq and the irq thread */
+	struct {
+		/* left by lx_interrupt() to lx_interrupt_thread() */
+		spinlock_t irq_pending_lock;
+		struct lx_irq_pending irq_pending;
+		ktime_t irq_time;	/* of the last handled irq */
+		int irq_last_cpu;
+		struct lx_irq_stats __percpu *irq_stats;
+		unsigned long jiffies_1st_irq;
+		bool irq_duplex_seen;	/* since open, for PLAY_BEGIN */
+	} ____cacheline_aligned_in_smp;
 };
 
+static inline struct lx_stream *lx_chip_stream(struct lx_chip *chip,
+		int is_capture, unsigned int idx)
+{
+	return is_capture ? &chip->capture_streams[idx] :
+			&chip->playback_streams[idx];
+}
+
+static inline struct lx_stream *lx_substream_stream(
+		struct snd_pcm_substream *substream)
+{
+	return lx_chip_stream(snd_pcm_substream_chip(substream),
+			substream->stream == SNDRV_PCM_STREAM_CAPTURE,
+			substream->number);
+}
+
 extern int lx_chips_count;
 extern struct lx_chip *lx_chips[]; /*when there is several LX card*/
 
@@ -255,12 +430,17 @@ int lx_stream_create_and_start(struct lx_chip *chip,
 		struct snd_pcm_substream *substream);
 
 /*stop audio pipes*/
-int lx_pipe_stop(struct lx_chip *chip, int is_capture);
+int lx_pipe_stop(struct lx_chip *chip, struct lx_stream *lx_stream);
 
-int lx_pipe_open(struct lx_chip *chip, int is_capture, int channels);
+int lx_pipe_open(struct lx_chip *chip, struct lx_stream *lx_stream,
+		int channels);
 
 /*closes audio pipes*/
-int lx_pipe_close(struct lx_chip *chip, int is_capture);
+int lx_pipe_close(struct lx_chip *chip, struct lx_stream *lx_stream);
+
+/*stops if asked and closes audio pipes in one transaction*/
+int lx_pipe_stop_and_close(struct lx_chip *chip, struct lx_stream *lx_stream,
+		int stop);
 
 int lx_pcm_open(struct snd_pcm_substream *substream);
 
@@ -268,6 +448,62 @@ int lx_pcm_close(struct snd_pcm_substream *substream);
 
 snd_pcm_uframes_t lx_pcm_stream_pointer(struct snd_pcm_substream *substream);
 
+#if KERNEL_VERSION(4, 1, 0) <= LINUX_VERSION_CODE
+/* link audio timestamps, see lx_pcm_get_time_info() */
+#define LX_PCM_INFO_ATIME	(SNDRV_PCM_INFO_HAS_LINK_ATIME | \
+				 SNDRV_PCM_INFO_HAS_LINK_ABSOLUTE_ATIME)
+
+#if KERNEL_VERSION(5, 6, 0) <= LINUX_VERSION_CODE
+#define lx_timespec		timespec64
+#define lx_ns_to_timespec(ns)	ns_to_timespec64(ns)
+#define lx_timespec_to_ns(ts)	timespec64_to_ns(ts)
+#else
+#define lx_timespec		timespec
+#define lx_ns_to_timespec(ns)	ns_to_timespec(ns)
+#define lx_timespec_to_ns(ts)	timespec_to_ns(ts)
+#endif
+
+int lx_pcm_get_time_info(struct snd_pcm_substream *substream,
+		struct lx_timespec *system_ts, struct lx_timespec *audio_ts,
+		struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+		struct snd_pcm_audio_tstamp_report *audio_tstamp_report);
+#else
+#define LX_PCM_INFO_ATIME	0
+#endif
+
+/* bytes of a sample in the dma ring: 16 bit samples are given to the card
+ * as they are, the others are packed in 24 bit
+ */
+static inline unsigned int lx_ring_sample_bytes(snd_pcm_format_t format)
+{
+	return snd_pcm_format_width(format) == 16 ? 2 : 3;
+}
+
+#if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+/* formats and accesses the copy callbacks convert to the packed 24 bit
+ * samples of the dma ring, see lx_pcm_copy_generic()
+ */
+#define LX_PCM_INFO_COPY	SNDRV_PCM_INFO_NONINTERLEAVED
+#define LX_PCM_FMTBIT_COPY	(SNDRV_PCM_FMTBIT_S32_LE | \
+				 SNDRV_PCM_FMTBIT_S24_LE | \
+				 SNDRV_PCM_FMTBIT_FLOAT_LE)
+
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+int lx_pcm_copy(struct snd_pcm_substream *substream, int channel,
+		unsigned long pos, struct iov_iter *iter, unsigned long bytes);
+#else
+int lx_pcm_copy_user(struct snd_pcm_substream *substream, int channel,
+		unsigned long pos, void __user *buf, unsigned long bytes);
+int lx_pcm_copy_kernel(struct snd_pcm_substream *substream, int channel,
+		unsigned long pos, void *buf, unsigned long bytes);
+#endif
+int lx_pcm_fill_silence(struct snd_pcm_substream *substream, int channel,
+		unsigned long pos, unsigned long bytes);
+#else
+#define LX_PCM_INFO_COPY	0
+#define LX_PCM_FMTBIT_COPY	0
+#endif
+
 int lx_pcm_prepare(struct snd_pcm_substream *substream);
 
 int lx_pcm_hw_params(struct snd_pcm_substream *substream,
@@ -275,7 +511,7 @@ int lx_pcm_hw_params(struct snd_pcm_substream *substream,
 
 int lx_pcm_hw_free(struct snd_pcm_substream *substream);
 
-void lx_trigger_pipe_start(struct lx_chip *chip, unsigned int is_capture);
+void lx_trigger_pipe_start(struct lx_chip *chip, struct lx_stream *lx_stream);
 void lx_trigger_start_linked_stream(struct lx_chip *chip);
 
 void lx_trigger_pipes_start(struct lx_chip *chip);
@@ -304,10 +540,25 @@ int lx_init_dsp(struct lx_chip *chip);
 
 int lx_pcm_create(struct lx_chip *chip);
 
+/*dsp recovery*/
+void lx_recovery_init(struct lx_chip *chip);
+void lx_recovery_schedule(struct lx_chip *chip);
+void lx_recovery_stop(struct lx_chip *chip);
+
+/*link timestamps*/
+void lx_tstamp_init(struct lx_chip *chip);
+void lx_tstamp_stop(struct lx_chip *chip);
+
 /*pic meters*/
+void lx_meter_init(struct lx_chip *chip);
+int lx_meter_create(struct snd_card *card, struct lx_chip *chip);
+void lx_meter_stop(struct lx_chip *chip);
+void lx_meter_read(struct lx_chip *chip, int is_capture, u32 *levels);
 void lx_proc_levels_read(struct snd_info_entry *entry,
 		struct snd_info_buffer *buffer);
 
+void lx_proc_get_dma(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer);
 int lx_proc_create(struct snd_card *card, struct lx_chip *chip);
 
 
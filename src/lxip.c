@@ -34,6 +34,9 @@
 
 #include "lxcommon.h"
 
+#define CREATE_TRACE_POINTS
+#include "lx_trace.h"
+
 MODULE_AUTHOR("Sylvain Jubier <alsa@digigram.com> ");
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("digigram lxip");
@@ -98,9 +101,14 @@ static struct snd_pcm_hardware lx_ip_caps = {
 		.info = (SNDRV_PCM_INFO_MMAP |
 			SNDRV_PCM_INFO_INTERLEAVED |
 			SNDRV_PCM_INFO_MMAP_VALID |
-			SNDRV_PCM_INFO_SYNC_START),
-		.formats =	(SNDRV_PCM_FMTBIT_S24_3LE |
-				SNDRV_PCM_FMTBIT_S24_3BE),
+			SNDRV_PCM_INFO_SYNC_START |
+			LX_PCM_INFO_ATIME |
+			LX_PCM_INFO_COPY),
+		.formats =	(SNDRV_PCM_FMTBIT_S16_LE |
+				SNDRV_PCM_FMTBIT_S16_BE |
+				SNDRV_PCM_FMTBIT_S24_3LE |
+				SNDRV_PCM_FMTBIT_S24_3BE |
+				LX_PCM_FMTBIT_COPY),
 		.rates = LXIP_USE_RATE,
 		.rate_min = 44100,
 		.rate_max = 96000,
@@ -182,6 +190,25 @@ static int set_internal_clock(struct lx_chip *chip) {
     return 0;
 }
 
+/* a freshly reset board: select the internal clock again, the only one
+ * the card drives, the Ravenna engine gives its rate back by itself.
+ */
+static int restore_config(struct lx_chip *chip)
+{
+	struct ravenna_clocks_info clocks_information;
+	int err;
+
+	err = set_internal_clock(chip);
+	if (err < 0)
+		return err;
+
+	lx_ip_get_clocks_status(chip, &clocks_information);
+	dev_dbg(chip->card->dev, "%s, clock mode %u, rate %u\n", __func__,
+			clocks_information.cm,
+			clocks_information.ravenna_freq);
+	return 0;
+}
+
 /*Clock Mode "Uggly hack" for Digigram Audio Engine.*/
 const char * const sync_names[] = {"Internal"};
 static int snd_clock_iobox_info(struct snd_kcontrol *kcontrol,
@@ -345,6 +372,17 @@ static struct snd_pcm_ops lx_ops_playback = {
 		.hw_free = lx_pcm_hw_free,
 		.trigger = lx_pcm_trigger,
 		.pointer = lx_pcm_stream_pointer,
+#if KERNEL_VERSION(4, 1, 0) <= LINUX_VERSION_CODE
+		.get_time_info = lx_pcm_get_time_info,
+#endif
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+		.copy = lx_pcm_copy,
+		.fill_silence = lx_pcm_fill_silence,
+#elif KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+		.copy_user = lx_pcm_copy_user,
+		.copy_kernel = lx_pcm_copy_kernel,
+		.fill_silence = lx_pcm_fill_silence,
+#endif
 };
 
 static struct snd_pcm_ops lx_ops_capture = {
@@ -356,6 +394,17 @@ static struct snd_pcm_ops lx_ops_capture = {
 		.hw_free = lx_pcm_hw_free,
 		.trigger = lx_pcm_trigger,
 		.pointer = lx_pcm_stream_pointer,
+#if KERNEL_VERSION(4, 1, 0) <= LINUX_VERSION_CODE
+		.get_time_info = lx_pcm_get_time_info,
+#endif
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+		.copy = lx_pcm_copy,
+		.fill_silence = lx_pcm_fill_silence,
+#elif KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+		.copy_user = lx_pcm_copy_user,
+		.copy_kernel = lx_pcm_copy_kernel,
+		.fill_silence = lx_pcm_fill_silence,
+#endif
 };
 
 static int snd_ip_create(struct snd_card *card, struct pci_dev *pci,
@@ -393,6 +442,7 @@ static int snd_ip_create(struct snd_card *card, struct pci_dev *pci,
 
 	chip = *rchip;
 	chip->set_internal_clock = set_internal_clock;
+	chip->restore_config = restore_config;
 
 	err = lx_ip_proc_create(card, *rchip);
 	if (err < 0) {
@@ -443,6 +493,7 @@ static int snd_ip_create(struct snd_card *card, struct pci_dev *pci,
 	return 0;
 
 device_new_failed:
+	lx_irq_affinity_release(chip);
 	if (chip->irq >= 0)
 		free_irq(pci->irq, *rchip);
 
@@ -36,6 +36,9 @@
 
 #include "lxcommon.h"
 
+#define CREATE_TRACE_POINTS
+#include "lx_trace.h"
+
 MODULE_SUPPORTED_DEVICE("{digigram lxmadi{}}");
 
 static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
@@ -86,9 +89,14 @@ static struct snd_pcm_hardware lx_madi_caps = {
 	.info = (SNDRV_PCM_INFO_MMAP |
 		SNDRV_PCM_INFO_INTERLEAVED |
 		SNDRV_PCM_INFO_MMAP_VALID |
-		SNDRV_PCM_INFO_SYNC_START),
-	.formats =	(SNDRV_PCM_FMTBIT_S24_3LE |
-			SNDRV_PCM_FMTBIT_S24_3BE),
+		SNDRV_PCM_INFO_SYNC_START |
+		LX_PCM_INFO_ATIME |
+		LX_PCM_INFO_COPY),
+	.formats =	(SNDRV_PCM_FMTBIT_S16_LE |
+			SNDRV_PCM_FMTBIT_S16_BE |
+			SNDRV_PCM_FMTBIT_S24_3LE |
+			SNDRV_PCM_FMTBIT_S24_3BE |
+			LX_PCM_FMTBIT_COPY),
 	.rates = MADI_USE_RATE,
 	.rate_min = 44100,
 	.rate_max = 96000,
@@ -182,12 +190,9 @@ int lx_madi_set_clock_diviseur(struct lx_chip *chip,
 		unsigned char clock_diviseur)
 {
 	int err = 0;
-	unsigned long clock_status;
 
-	clock_status = lx_dsp_reg_read(chip, REG_MADI_RAVENNA_CLOCK_CFG);
-	clock_status &= ~(MADI_DIVISEUR_MASK);
-	clock_status |= (((0x01) & clock_diviseur) << 7);
-	lx_dsp_reg_write(chip, REG_MADI_RAVENNA_CLOCK_CFG, clock_status);
+	lx_dsp_reg_update(chip, REG_MADI_RAVENNA_CLOCK_CFG,
+			MADI_DIVISEUR_MASK, ((0x01) & clock_diviseur) << 7);
 
 	return err;
 }
@@ -198,17 +203,14 @@ int lx_madi_set_clock_frequency(struct lx_chip *chip, int clock_frequency)
 	unsigned i = 0;
 	struct clocks_info clocks_information;
 	unsigned char fpga_freq = 0;
-	unsigned long clock_status;
 
 	for (i = 0; i < 4; i++) {
 		if (internal_freq_conversion[i] == clock_frequency)
 			fpga_freq = i;
 	}
 
-	clock_status = lx_dsp_reg_read(chip, REG_MADI_RAVENNA_CLOCK_CFG);
-	clock_status &= ~(IP_RAVENNA_FREQ_MASK);
-	clock_status |= (fpga_freq << 2);
-	lx_dsp_reg_write(chip, REG_MADI_RAVENNA_CLOCK_CFG, clock_status);
+	lx_dsp_reg_update(chip, REG_MADI_RAVENNA_CLOCK_CFG,
+			IP_RAVENNA_FREQ_MASK, fpga_freq << 2);
 
 	if (chip == lx_chips_master) {
 		if (lx_chips_slave != NULL) {
@@ -237,12 +239,9 @@ int lx_madi_set_clock_frequency(struct lx_chip *chip, int clock_frequency)
 int lx_madi_set_clock_sync(struct lx_chip *chip, int clock_sync)
 {
 	int err = 0;
-	unsigned long clock_status;
 
-	clock_status = lx_dsp_reg_read(chip, REG_MADI_RAVENNA_CLOCK_CFG);
-	clock_status &= ~(0x0000003);
-	clock_status |= (clock_sync);
-	lx_dsp_reg_write(chip, REG_MADI_RAVENNA_CLOCK_CFG, clock_status);
+	lx_dsp_reg_update(chip, REG_MADI_RAVENNA_CLOCK_CFG,
+			0x0000003, clock_sync);
 
 	return err;
 }
@@ -257,15 +256,26 @@ int lx_madi_set_word_clock_direction(struct lx_chip *chip,
 		unsigned char clock_dir)
 {
 	int err = 0;
-	unsigned long clock_status;
 
-	clock_status = lx_dsp_reg_read(chip, REG_MADI_RAVENNA_CLOCK_CFG);
-	clock_status &= ~(0x0000040);
-	clock_status |= (clock_dir << 6);
-	lx_dsp_reg_write(chip, REG_MADI_RAVENNA_CLOCK_CFG, clock_status);
+	lx_dsp_reg_update(chip, REG_MADI_RAVENNA_CLOCK_CFG,
+			0x0000040, clock_dir << 6);
 
 	return err;
 }
+
+/* write the mixer settings to a freshly reset board */
+static int restore_config(struct lx_chip *chip)
+{
+	lx_madi_set_clock_sync(chip, chip->use_clock_sync);
+	lx_madi_set_word_clock_direction(chip, chip->word_clock_out);
+	lx_madi_set_clock_diviseur(chip, (unsigned char)chip->diviseur_mode);
+	if (chip->use_clock_sync == LXMADI_CLOCK_SYNC_INTERNAL &&
+	    chip->board_sample_rate != 0)
+		lx_madi_set_clock_frequency(chip, chip->board_sample_rate);
+
+	return lx_madi_set_madi_state(chip);
+}
+
 /*Mixer		-> "Internal", "Madi In", "Word Clock In"*/
 /*internal value -> "Madi In", "Word Clock In","Internal"*/
 const char * const sync_names[] = {"Internal", "Madi In", "Word Clock In"};
@@ -815,7 +825,10 @@ void lx_madi_proc_get_madi_status(struct snd_info_entry *entry,
 	struct madi_status status;
 	struct lx_chip *chip = entry->private_data;
 
-	lx_madi_get_madi_state(chip, &status);
+	if (lx_madi_get_madi_state(chip, &status)) {
+		snd_iprintf(buffer, "madi state unavailable\n");
+		return;
+	}
 
 	snd_iprintf(buffer, "Mute : \t%s\n"
 			"channel_mode :\t%d\n"
@@ -999,7 +1012,6 @@ static int lxmadi_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 	int err = 0;
 #ifdef SYNC_START
 	struct lx_chip *chip = snd_pcm_substream_chip(substream);
-	struct lx_chip *link_chip = NULL;
 	struct snd_pcm_substream *s;
 	struct lx_stream *link_lx_stream;
 
@@ -1024,14 +1036,7 @@ static int lxmadi_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 		case SNDRV_PCM_TRIGGER_START:
 			if (snd_pcm_stream_linked(substream)) {
 				snd_pcm_group_for_each_entry(s, substream) {
-					link_chip = snd_pcm_substream_chip(s);
-					if (s ==
-					link_chip->capture_stream.stream)
-						link_lx_stream =
-						&link_chip->capture_stream;
-					else
-						link_lx_stream =
-						&link_chip->playback_stream;
+					link_lx_stream = lx_substream_stream(s);
 					/*if command pending*/
 					while (link_lx_stream->status ==
 						LX_STREAM_STATUS_SCHEDULE_STOP)
@@ -1080,6 +1085,17 @@ static struct snd_pcm_ops lx_ops_playback = {
 	.hw_free = lx_pcm_hw_free,
 	.trigger = lxmadi_pcm_trigger,
 	.pointer = lx_pcm_stream_pointer,
+#if KERNEL_VERSION(4, 1, 0) <= LINUX_VERSION_CODE
+	.get_time_info = lx_pcm_get_time_info,
+#endif
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+	.copy = lx_pcm_copy,
+	.fill_silence = lx_pcm_fill_silence,
+#elif KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+	.copy_user = lx_pcm_copy_user,
+	.copy_kernel = lx_pcm_copy_kernel,
+	.fill_silence = lx_pcm_fill_silence,
+#endif
 };
 
 static struct snd_pcm_ops lx_ops_capture = {
@@ -1091,6 +1107,17 @@ static struct snd_pcm_ops lx_ops_capture = {
 	.hw_free = lx_pcm_hw_free,
 	.trigger = lxmadi_pcm_trigger,
 	.pointer = lx_pcm_stream_pointer,
+#if KERNEL_VERSION(4, 1, 0) <= LINUX_VERSION_CODE
+	.get_time_info = lx_pcm_get_time_info,
+#endif
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+	.copy = lx_pcm_copy,
+	.fill_silence = lx_pcm_fill_silence,
+#elif KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+	.copy_user = lx_pcm_copy_user,
+	.copy_kernel = lx_pcm_copy_kernel,
+	.fill_silence = lx_pcm_fill_silence,
+#endif
 };
 
 static int snd_lxmadi_create(struct snd_card *card, struct pci_dev *pci,
@@ -1117,6 +1144,7 @@ static int snd_lxmadi_create(struct snd_card *card, struct pci_dev *pci,
 		return err;
 	chip = *rchip;
 	chip->set_internal_clock = set_internal_clock;
+	chip->restore_config = restore_config;
 	err = lx_madi_proc_create(card, chip);
 	if (err < 0) {
 		dev_err(&pci->dev, "%s,lx_proc_create failed\n", __func__);
@@ -1174,6 +1202,7 @@ static int snd_lxmadi_create(struct snd_card *card, struct pci_dev *pci,
 	return 0;
 
 device_new_failed:
+	lx_irq_affinity_release(chip);
 	if (chip->irq >= 0)
 		free_irq(pci->irq, chip);
 